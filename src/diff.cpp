@@ -0,0 +1,323 @@
+/** \file diff.cpp
+ *  Structural differences between two documents, matched by subtree hashes.
+ *  \author David Labský <labskdav@fit.cvut.cz> */
+
+#ifndef SUXML_DIFF_CPP
+#define SUXML_DIFF_CPP
+
+#include <algorithm>
+#include <unordered_map>
+#include "xml.cpp"
+
+/// The kinds of differences TreeDiff finds
+enum DifferenceKind {
+    /// A node or attribute only in the new document
+    DIFF_INSERTED,
+    /// A node or attribute only in the old document
+    DIFF_DELETED,
+    /// A node in both documents, somewhere else in the new one
+    DIFF_MOVED,
+    /// A node or attribute in both documents, changed
+    DIFF_MODIFIED
+};
+
+/// A difference found by TreeDiff
+struct Difference {
+    DifferenceKind kind;
+    /// Where the node is in the old document, empty if it isn't there
+    string old_path;
+    /// Where the node is in the new document, empty if it isn't there
+    string new_path;
+    /// Whether the difference has text, see old_text and new_text
+    bool has_text;
+    /// The text, comment or attribute value in the old document
+    string old_text;
+    /// The text, comment or attribute value in the new document
+    string new_text;
+    /// The node in the new document, or the tag it was deleted from
+    XMLNode* node;
+    /// The hash of the node's subtree, see XMLNode::hash
+    uint64_t hash;
+};
+
+/// The differences between two documents
+/** Every subtree of both documents is hashed, children before their
+ *  parents, and subtrees which hash the same are the same.  The documents
+ *  are then gone through from the root, only going into tags which differ.
+ *  The children of such tags are paired up in linear time: identical
+ *  subtrees first, then the rest by name, in order.  Identical children
+ *  paired out of order were moved; the fewest are reported, outside the
+ *  longest run still in order.  Paired children which differ are modified,
+ *  and the rest were inserted or deleted, unless an identical subtree was
+ *  deleted or inserted elsewhere, in which case it was moved.
+ *
+ *  Nodes are known by their path, such as /catalog/item[3]/name[1]/#text[1],
+ *  counting the children with the same name from 1.  Attributes are known
+ *  by their tag's path followed by /@ and their name.
+ */
+class TreeDiff {
+    public:
+        /// Finds the differences between two documents
+        /** The hashes are left in the nodes of both documents. */
+        TreeDiff(XMLDocument* old_document, XMLDocument* new_document) {
+            old_document->root.hash_subtree();
+            new_document->root.hash_subtree();
+            string old_declaration = old_document->have_declaration ? old_document->declaration.to_str() : "";
+            string new_declaration = new_document->have_declaration ? new_document->declaration.to_str() : "";
+            if (old_declaration != new_declaration) {
+                add(DIFF_MODIFIED, "<?xml?>", "<?xml?>", &new_document->declaration, 0);
+                set_text(old_declaration, new_declaration);
+            }
+            string old_doctype = old_document->have_doctype ? old_document->doctype.text : "";
+            string new_doctype = new_document->have_doctype ? new_document->doctype.text : "";
+            if (old_doctype != new_doctype) {
+                add(DIFF_MODIFIED, "<!DOCTYPE>", "<!DOCTYPE>", &new_document->doctype, 0);
+                set_text(old_doctype, new_doctype);
+            }
+            compare_tags(&old_document->root, &new_document->root,
+                "/" + old_document->root.element, "/" + new_document->root.element);
+            find_moves();
+        }
+
+        /// The differences, in document order mostly
+        vector<Difference> differences;
+
+        /// Lists the differences, a line each
+        string to_str() const {
+            static const char* kinds[] = {"inserted ", "deleted  ", "moved    ", "modified "};
+            string out = "";
+            for (const Difference& difference : differences) {
+                out += kinds[difference.kind];
+                out += difference.old_path.length() ? difference.old_path : difference.new_path;
+                if (difference.old_path.length() && difference.new_path.length()
+                    && difference.old_path != difference.new_path) {
+                    out += " -> " + difference.new_path;
+                }
+                if (difference.kind == DIFF_MODIFIED && difference.has_text) {
+                    out += ": " + json_string(difference.old_text) + " -> " + json_string(difference.new_text);
+                } else if (difference.has_text) {
+                    out += " = " + json_string(difference.kind == DIFF_DELETED ? difference.old_text : difference.new_text);
+                }
+                out += '\n';
+            }
+            return out;
+        }
+
+        /// Marks the differences in the new document, like a search
+        /** The nodes which were inserted, moved or modified, and the tags
+         *  nodes or attributes were deleted from or changed in, are found
+         *  and expanded into view, see XMLDocument::find().
+         *  \param document The new document */
+        void mark(XMLDocument* document) const {
+            document->expand_to(0);
+            clear_found(&document->root);
+            document->doctype.found = false;
+            for (const Difference& difference : differences) {
+                difference.node->set_found(true);
+            }
+            show_found(&document->root, document->policy);
+        }
+    private:
+        /// Where the node and attribute insertions and deletions are, for
+        /// find_moves()
+        vector<size_t> inserted;
+        vector<size_t> deleted;
+
+        void add(DifferenceKind kind, const string& old_path, const string& new_path, XMLNode* node, uint64_t hash) {
+            Difference difference;
+            difference.kind = kind;
+            difference.old_path = old_path;
+            difference.new_path = new_path;
+            difference.has_text = false;
+            difference.node = node;
+            difference.hash = hash;
+            differences.push_back(difference);
+        }
+        /// Gives the last difference its text
+        void set_text(const string& old_text, const string& new_text) {
+            differences.back().has_text = true;
+            differences.back().old_text = old_text;
+            differences.back().new_text = new_text;
+        }
+
+        void compare_tags(const XMLTag* old_tag, XMLTag* new_tag, const string& old_path, const string& new_path) {
+            if (old_tag->hash == new_tag->hash) return;
+            if (old_tag->element != new_tag->element) add(DIFF_MODIFIED, old_path, new_path, new_tag, new_tag->hash);
+            // tags don't have many attributes, so they're just looked up
+            for (const XMLAttribute& attr : new_tag->attributes) {
+                const XMLAttribute* old_attr = find_attribute(old_tag, attr.attribute);
+                if (old_attr == NULL) {
+                    add(DIFF_INSERTED, "", new_path + "/@" + attr.attribute, new_tag, 0);
+                    set_text("", attr.value);
+                } else if (old_attr->value != attr.value) {
+                    add(DIFF_MODIFIED, old_path + "/@" + attr.attribute, new_path + "/@" + attr.attribute, new_tag, 0);
+                    set_text(old_attr->value, attr.value);
+                }
+            }
+            for (const XMLAttribute& attr : old_tag->attributes) {
+                if (find_attribute(new_tag, attr.attribute) == NULL) {
+                    add(DIFF_DELETED, old_path + "/@" + attr.attribute, "", new_tag, 0);
+                    set_text(attr.value, "");
+                }
+            }
+            compare_children(old_tag, new_tag, old_path, new_path);
+        }
+
+        void compare_children(const XMLTag* old_tag, XMLTag* new_tag, const string& old_path, const string& new_path) {
+            const vector<XMLNode*>& old_children = old_tag->children;
+            const vector<XMLNode*>& new_children = new_tag->children;
+            vector<string> old_paths = child_paths(old_tag, old_path);
+            vector<string> new_paths = child_paths(new_tag, new_path);
+            vector<char> old_paired (old_children.size(), false);
+            vector<char> new_paired (new_children.size(), false);
+
+            // identical subtrees first, the first old one for each new one
+            unordered_map<uint64_t, vector<size_t> > by_hash;
+            for (size_t i=old_children.size(); i-- > 0; ) {
+                by_hash[old_children[i]->hash].push_back(i);
+            }
+            vector<size_t> same_old, same_new;
+            for (size_t j=0; j<new_children.size(); j++) {
+                auto same = by_hash.find(new_children[j]->hash);
+                if (same == by_hash.end() || same->second.empty()) continue;
+                size_t i = same->second.back();
+                same->second.pop_back();
+                old_paired[i] = new_paired[j] = true;
+                same_old.push_back(i);
+                same_new.push_back(j);
+            }
+            vector<char> in_order = longest_increasing(same_old);
+            for (size_t k=0; k<same_old.size(); k++) {
+                if (in_order[k]) continue;
+                add(DIFF_MOVED, old_paths[same_old[k]], new_paths[same_new[k]],
+                    new_children[same_new[k]], new_children[same_new[k]]->hash);
+            }
+
+            // then the rest by name, in order
+            unordered_map<string, vector<size_t> > by_name;
+            for (size_t i=old_children.size(); i-- > 0; ) {
+                if (!old_paired[i]) by_name[old_children[i]->path_name()].push_back(i);
+            }
+            for (size_t j=0; j<new_children.size(); j++) {
+                if (new_paired[j]) continue;
+                XMLNode* node = new_children[j];
+                auto named = by_name.find(node->path_name());
+                if (named == by_name.end() || named->second.empty()) {
+                    inserted.push_back(differences.size());
+                    add(DIFF_INSERTED, "", new_paths[j], node, node->hash);
+                    continue;
+                }
+                size_t i = named->second.back();
+                named->second.pop_back();
+                old_paired[i] = true;
+                XMLTag* tag = dynamic_cast<XMLTag*>(node);
+                if (tag) {
+                    compare_tags(static_cast<const XMLTag*>(old_children[i]), tag, old_paths[i], new_paths[j]);
+                } else {
+                    add(DIFF_MODIFIED, old_paths[i], new_paths[j], node, node->hash);
+                    set_text(text_of(old_children[i]), text_of(node));
+                }
+            }
+            for (size_t i=0; i<old_children.size(); i++) {
+                if (old_paired[i]) continue;
+                deleted.push_back(differences.size());
+                add(DIFF_DELETED, old_paths[i], "", new_tag, old_children[i]->hash);
+            }
+        }
+
+        /// Makes insertions and deletions of identical subtrees into moves
+        void find_moves() {
+            unordered_map<uint64_t, vector<size_t> > deleted_by_hash;
+            for (size_t k=deleted.size(); k-- > 0; ) {
+                deleted_by_hash[differences[deleted[k]].hash].push_back(deleted[k]);
+            }
+            vector<char> moved (differences.size(), false);
+            for (size_t k : inserted) {
+                auto same = deleted_by_hash.find(differences[k].hash);
+                if (same == deleted_by_hash.end() || same->second.empty()) continue;
+                differences[k].kind = DIFF_MOVED;
+                differences[k].old_path = differences[same->second.back()].old_path;
+                moved[same->second.back()] = true;
+                same->second.pop_back();
+            }
+            size_t kept = 0;
+            for (size_t k=0; k<differences.size(); k++) {
+                if (!moved[k]) differences[kept++] = differences[k];
+            }
+            differences.resize(kept);
+        }
+
+        /// The paths of the children of a tag
+        static vector<string> child_paths(const XMLTag* tag, const string& path) {
+            vector<string> paths;
+            paths.reserve(tag->children.size());
+            unordered_map<string, int> counts;
+            for (XMLNode* child : tag->children) {
+                const string& name = child->path_name();
+                paths.push_back(path + "/" + name + "[" + to_string(++counts[name]) + "]");
+            }
+            return paths;
+        }
+
+        static const XMLAttribute* find_attribute(const XMLTag* tag, const string& name) {
+            for (const XMLAttribute& attr : tag->attributes) {
+                if (attr.attribute == name) return &attr;
+            }
+            return NULL;
+        }
+
+        /// The text of a text node or comment
+        static string text_of(const XMLNode* node) {
+            const XMLContent* content = dynamic_cast<const XMLContent*>(node);
+            if (content) return content->content;
+            const XMLComment* comment = dynamic_cast<const XMLComment*>(node);
+            return comment ? comment->comment : "";
+        }
+
+        /// Finds the longest increasing run in a sequence of distinct numbers
+        /** Patience sorting, in O(n log n).
+         *  \return Whether each number is part of the run */
+        static vector<char> longest_increasing(const vector<size_t>& sequence) {
+            // the last number of the best run of each length so far
+            vector<size_t> ends;
+            vector<size_t> previous (sequence.size(), string::npos);
+            for (size_t i=0; i<sequence.size(); i++) {
+                size_t length = lower_bound(ends.begin(), ends.end(), sequence[i],
+                    [&sequence](size_t end, size_t value) { return sequence[end] < value; }) - ends.begin();
+                if (length > 0) previous[i] = ends[length-1];
+                if (length == ends.size()) ends.push_back(i);
+                else ends[length] = i;
+            }
+            vector<char> in_run (sequence.size(), false);
+            for (size_t i = ends.empty() ? string::npos : ends.back(); i != string::npos; i = previous[i]) {
+                in_run[i] = true;
+            }
+            return in_run;
+        }
+
+        static void clear_found(XMLNode* node) {
+            node->found = false;
+            XMLTag* tag = dynamic_cast<XMLTag*>(node);
+            if (tag == NULL) return;
+            for (XMLNode* child : tag->children) {
+                clear_found(child);
+            }
+        }
+
+        /// Expands the tags with found nodes inside, like XMLTag::find()
+        /** \return Whether the node is found or has found nodes inside */
+        static bool show_found(XMLNode* node, const ExpandPolicy& policy) {
+            XMLTag* tag = dynamic_cast<XMLTag*>(node);
+            bool inside = false;
+            if (tag != NULL) {
+                for (XMLNode* child : tag->children) {
+                    if (show_found(child, policy)) inside = true;
+                }
+            }
+            if (!node->found && !inside) return false;
+            if (tag != NULL && tag->has_children()) tag->set_expanded(true, policy);
+            return true;
+        }
+};
+
+#endif
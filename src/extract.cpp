@@ -0,0 +1,208 @@
+/** \file extract.cpp
+ *  Splitting a document into records, without loading all of it.
+ *  \author David Labský <labskdav@fit.cvut.cz> */
+
+#ifndef SUXML_EXTRACT_CPP
+#define SUXML_EXTRACT_CPP
+
+#include "tokenizer.cpp"
+
+/// How many records extract_records() formats at once per thread
+#define EXTRACT_BATCH_PER_THREAD 4
+
+/// Where to write records, see extract_records()
+/** A filename with a %d in it, optionally zero-padded like %05d, gets a
+ *  file per record, numbered from 1.  Anything else, including - for
+ *  stdout, gets a single stream with a JSON object per line. */
+class RecordOutput {
+    public:
+        RecordOutput(string filename) : filename(filename), per_file(false), prefix(filename) {
+            size_t percent = filename.find('%');
+            if (percent == string::npos) return;
+            size_t end = percent+1;
+            while (end < filename.length() && isdigit(filename[end])) end++;
+            if (end >= filename.length() || filename[end] != 'd') return;
+            string width = filename.substr(percent+1, end - percent-1);
+            per_file = true;
+            zero_padded = width.length() && width[0] == '0';
+            min_width = atoi(width.c_str());
+            prefix = filename.substr(0, percent);
+            suffix = filename.substr(end+1);
+        }
+
+        /// The stream's filename, - for stdout
+        string filename;
+        /// Whether every record gets its own file
+        bool per_file;
+
+        /// The file a record goes to
+        /** \param record The number of the record, counted from 1 */
+        string record_filename(long long record) const {
+            string number = to_string(record);
+            if ((int)number.length() < min_width) {
+                number = string(min_width - number.length(), zero_padded ? '0' : ' ') + number;
+            }
+            return prefix + number + suffix;
+        }
+    private:
+        string prefix;
+        string suffix;
+        bool zero_padded = false;
+        int min_width = 0;
+};
+
+/// Formats a record as a document of its own
+/** The record gets the declaration of the document it came from, so it's
+ *  checked against the same encoding.
+ *  \param declaration The declaration, or an empty string
+ *  \param data The record, from its start tag to its end tag */
+inline unique_ptr<XMLDocument> parse_record(const string& declaration, const char* data, size_t length) {
+    string buffer = declaration + string(data, length);
+    unique_ptr<XMLDocument> document (new XMLDocument());
+    document->parse(buffer.data(), buffer.length());
+    return document;
+}
+
+/// Writes the subtrees matching a path as records of their own
+/** The document is tokenized without building a tree.  Every record is
+ *  parsed on its own and written with the formatter, so memory only grows
+ *  with the records being formatted at once.  A batch of records at a time
+ *  is handed to the shared TaskPool; records in a stream stay in document
+ *  order.  Records nested in other records are part of those.
+ *
+ *  \param data The document
+ *  \param length The length of the document
+ *  \param path Which elements are records
+ *  \param output Where to write the records
+ *  \param newline Whether record files end with a newline
+ *  \param style How to lay the records out
+ *  \param offset Where to put the byte offset of a parsing error, which is
+ *  string::npos when writing failed
+ *  \param records Where to put how many records were written
+ *  \return NULL if everything went fine, an error message otherwise */
+inline const char* extract_records(const char* data, size_t length, const ElementPath& path,
+                                   const RecordOutput& output, bool newline, OutputStyle style,
+                                   size_t* offset, long long* records) {
+    ofstream stream_file;
+    ostream* stream = &cout;
+    if (!output.per_file && output.filename != "-") {
+        stream_file.open(output.filename, ios::out | ios::binary);
+        if (!stream_file.is_open()) {
+            *offset = string::npos;
+            return "failed to write";
+        }
+        stream = &stream_file;
+    }
+
+    TaskPool& pool = TaskPool::shared();
+    size_t batch_size = EXTRACT_BATCH_PER_THREAD * pool.size();
+    // the records of the batch and what became of them
+    vector<pair<size_t, size_t> > batch;
+    vector<string> results;
+    vector<const char*> errors;
+    *records = 0;
+
+    string declaration = "";
+    // formats and writes the batch, up to the first record which failed
+    auto flush = [&](size_t* error_offset) -> const char* {
+        results.assign(batch.size(), "");
+        errors.assign(batch.size(), NULL);
+        TaskGroup group (pool);
+        for (size_t i=0; i<batch.size(); i++) {
+            long long number = *records + i + 1;
+            group.run([&, i, number]() {
+                try {
+                    unique_ptr<XMLDocument> document = parse_record(declaration, data + batch[i].first, batch[i].second);
+                    if (output.per_file) {
+                        document->save(output.record_filename(number), newline, style);
+                    } else {
+                        results[i] = "{\"record\": " + to_string(number) + ", \"offset\": "
+                            + to_string(batch[i].first) + ", \"xml\": "
+                            + json_string(document->to_str(false, style)) + "}\n";
+                    }
+                } catch (char const* message) {
+                    // records were tokenized fine, so this is writing
+                    errors[i] = message;
+                }
+            });
+        }
+        group.wait();
+        const char* error = NULL;
+        for (size_t i=0; i<batch.size(); i++) {
+            if (errors[i] != NULL) {
+                error = errors[i];
+                *error_offset = string::npos;
+                break;
+            }
+            *stream << results[i];
+            (*records)++;
+        }
+        batch.clear();
+        return error;
+    };
+
+    XMLTokenizer tokenizer (data, length);
+    XMLToken token;
+    // whether the path matches up to each open element
+    vector<char> open;
+    // how deep the record being skipped over starts, 0 outside records
+    size_t record_depth = 0;
+    size_t record_start = 0;
+    bool in_declaration = false;
+    const char* error = NULL;
+    try {
+        while (error == NULL && tokenizer.next(&token)) {
+            if (token.type == TOKEN_DECLARATION) {
+                declaration = "<?xml";
+                in_declaration = true;
+                continue;
+            } else if (token.type == TOKEN_ATTRIBUTE) {
+                if (in_declaration) {
+                    char quote = memchr(token.value.data, '"', token.value.length) ? '\'' : '"';
+                    declaration += " " + token.name.str() + "=" + quote + token.value.str() + quote;
+                }
+                continue;
+            }
+            if (in_declaration) declaration += "?>\n";
+            in_declaration = false;
+            if (token.type == TOKEN_START_TAG) {
+                bool parents_match = open.size() == 0 || open.back();
+                size_t depth = open.size()+1;
+                if (record_depth == 0 && path.matches(depth, token.name, parents_match)) {
+                    record_depth = depth;
+                    record_start = token.offset;
+                }
+                open.push_back(record_depth == 0 && path.leads_to(depth, token.name, parents_match));
+            } else if (token.type == TOKEN_END_TAG) {
+                if (open.size() == record_depth) {
+                    // empty-element tags end where their token is
+                    size_t end = token.empty ? token.offset : token.offset + token.name.length + 3;
+                    batch.push_back(make_pair(record_start, end - record_start));
+                    record_depth = 0;
+                    if (batch.size() >= batch_size) error = flush(offset);
+                }
+                open.pop_back();
+            }
+        }
+    } catch (char const* message) {
+        *offset = tokenizer.offset();
+        error = message;
+    }
+    // records before an error are still written
+    if (batch.size()) {
+        size_t write_offset;
+        const char* write_error = flush(&write_offset);
+        if (error == NULL && write_error != NULL) {
+            error = write_error;
+            *offset = write_offset;
+        }
+    }
+    stream->flush();
+    if (error == NULL && !stream->good()) {
+        error = "failed to write";
+        *offset = string::npos;
+    }
+    return error;
+}
+
+#endif
@@ -0,0 +1,128 @@
+/** \file latency.cpp
+ *  Latency measurements of the editor loop.
+ *  \author David Labský <labskdav@fit.cvut.cz> */
+
+#ifndef SUXML_LATENCY_CPP
+#define SUXML_LATENCY_CPP
+
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+using namespace std;
+
+/// Linear sub-buckets in every power of two of a LatencyHistogram
+#define LATENCY_SUB_BUCKETS 32
+
+/// Nanoseconds since an arbitrary point, for measuring durations
+inline long long now_ns() {
+    return chrono::duration_cast<chrono::nanoseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/// A histogram of latencies
+/** Works like an HDR histogram: values are bucketed by their power of two,
+ *  and every power of two is split into LATENCY_SUB_BUCKETS linear
+ *  buckets.  This keeps the relative error of percentiles around 3% for
+ *  anything from nanoseconds to minutes, in a few kilobytes.
+ */
+class LatencyHistogram {
+    public:
+        /// How many values were recorded
+        long long count = 0;
+        /// The smallest recorded value
+        long long min = 0;
+        /// The largest recorded value
+        long long max = 0;
+
+        LatencyHistogram() : buckets(64*LATENCY_SUB_BUCKETS, 0) {};
+
+        /// Records a value
+        void record(long long value) {
+            if (value < 0) value = 0;
+            if (count == 0 || value < min) min = value;
+            if (count == 0 || value > max) max = value;
+            count++;
+            buckets[bucket_of(value)]++;
+        }
+
+        /// Gets a percentile of the recorded values
+        /** \param percent The percentile, 0 to 100
+         *  \return The upper bound of the bucket containing the percentile */
+        long long percentile(double percent) const {
+            if (count == 0) return 0;
+            long long wanted = (long long)(count * percent / 100.0 + 0.5);
+            if (wanted < 1) wanted = 1;
+            long long seen = 0;
+            for (size_t i=0; i<buckets.size(); i++) {
+                seen += buckets[i];
+                if (seen >= wanted) {
+                    long long top = bucket_top(i);
+                    return top < max ? top : max;
+                }
+            }
+            return max;
+        }
+    private:
+        vector<long long> buckets;
+
+        static int bucket_of(long long value) {
+            if (value < LATENCY_SUB_BUCKETS) return value;
+            // the power of two above the sub-bucket range, and the
+            // linear position within it
+            int shift = 0;
+            while ((value >> shift) >= 2*LATENCY_SUB_BUCKETS) shift++;
+            return (shift+1)*LATENCY_SUB_BUCKETS + (value >> shift) - LATENCY_SUB_BUCKETS;
+        }
+
+        static long long bucket_top(int bucket) {
+            if (bucket < LATENCY_SUB_BUCKETS) return bucket;
+            int shift = bucket/LATENCY_SUB_BUCKETS - 1;
+            long long base = bucket%LATENCY_SUB_BUCKETS + LATENCY_SUB_BUCKETS;
+            return ((base+1) << shift) - 1;
+        }
+};
+
+/// The phases of handling a key in the editor
+enum LatencyPhase { PHASE_COMMAND, PHASE_RENDER, PHASE_REPAINT, PHASE_TOTAL, PHASE_COUNT };
+
+/// Latency histograms of the editor, per command and phase
+class LatencyRecorder {
+    public:
+        /// Records how long handling a key took
+        /** \param command The name of the command
+         *  \param times Nanoseconds spent in each phase, PHASE_TOTAL included */
+        void record(string command, const long long* times) {
+            vector<LatencyHistogram>& phases = histograms[command];
+            if (phases.size() == 0) phases.resize(PHASE_COUNT);
+            for (int i=0; i<PHASE_COUNT; i++) {
+                phases[i].record(times[i]);
+            }
+        }
+
+        /// Writes the histograms as a table, in microseconds
+        /** \return True if successful */
+        bool write(string filename) const {
+            FILE* out = fopen(filename.c_str(), "w");
+            if (out == NULL) return false;
+            const char* phase_names[] = {"command", "render", "repaint", "total"};
+            fprintf(out, "# suxml key latencies in microseconds\n");
+            fprintf(out, "%-12s %-8s %8s %10s %10s %10s %10s %10s %10s\n",
+                "key", "phase", "count", "min", "p50", "p90", "p99", "p99.9", "max");
+            for (auto& entry : histograms) {
+                for (int i=0; i<PHASE_COUNT; i++) {
+                    const LatencyHistogram& h = entry.second[i];
+                    fprintf(out, "%-12s %-8s %8lld %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+                        entry.first.c_str(), phase_names[i], h.count,
+                        h.min/1000.0, h.percentile(50)/1000.0, h.percentile(90)/1000.0,
+                        h.percentile(99)/1000.0, h.percentile(99.9)/1000.0, h.max/1000.0);
+                }
+            }
+            return fclose(out) == 0;
+        }
+    private:
+        map<string, vector<LatencyHistogram> > histograms;
+};
+
+#endif
@@ -0,0 +1,298 @@
+/** \file pages.cpp
+ *  Editing documents bigger than memory, by paging subtrees out to the file.
+ *  \author David Labský <labskdav@fit.cvut.cz> */
+
+#ifndef SUXML_PAGES_CPP
+#define SUXML_PAGES_CPP
+
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <unordered_set>
+using namespace std;
+
+#include "tokenizer.cpp"
+#include "extract.cpp"
+
+/// How long the source of a page gets, in bytes
+#define PAGE_SOURCE_BYTES 65536
+/// What the source of a run is wrapped in to be parsed, see PageStore
+#define PAGE_RUN_START "<run>"
+#define PAGE_RUN_END "</run>"
+
+/// Pages the tags of a document out to the file it's parsed from
+/** Only the tags longer than PAGE_SOURCE_BYTES are kept in memory.  The
+ *  children of each go into runs of consecutive siblings, about
+ *  PAGE_SOURCE_BYTES long, which only keep where they are in the file,
+ *  which is kept mapped for them; see XMLTag::run.  So a long list of
+ *  small elements takes a node per page rather than per element.  Runs
+ *  start and end with a tag or a comment, and the text around them stays
+ *  in memory.  Their children are parsed again when they're needed, and
+ *  freed again by trim(), the ones used longest ago first, until the ones
+ *  in memory fit the budget.  Children which were edited, found or
+ *  expanded by hand stay in memory, see XMLTag::is_evictable().
+ */
+class PageStore : public Pager {
+    public:
+        /// Opens the file
+        /** Throws "cannot open file" like SourceFile.
+         *  \param filename The file, which isn't read until load()
+         *  \param budget How much memory the paged in children can take */
+        PageStore(string filename, long long budget) : source(filename), budget(budget) {};
+
+        /// Parses the document, paging out the children of every tag big enough
+        /** Behaves like XMLDocument::parse(), but the file is only gone
+         *  through with XMLTokenizer, so memory only grows with the tags
+         *  kept in memory.  The line index is built if it's wanted, and
+         *  stays pointing into the file.
+         *  \param document The document to parse into, which has to be
+         *  freed before the store */
+        void load(XMLDocument* document) {
+            const char* data = source.data();
+            size_t length = source.length();
+            document->pager = this;
+            document->line_index.reset(data, length);
+            if (document->index_lines) document->line_index.build();
+
+            XMLTokenizer tokenizer (data, length);
+            XMLToken token;
+            vector<XMLTag*> open;
+            // the run of children being gathered in each open tag
+            vector<PendingRun> runs;
+            // how many nodes there were before each open tag
+            vector<size_t> nodes_before;
+            size_t nodes = 0;
+            bool in_declaration = false;
+            // the text the lines of text go into, until something else
+            XMLContent* text = NULL;
+            try {
+                while (tokenizer.next(&token)) {
+                    if (token.type == TOKEN_DECLARATION) {
+                        document->have_declaration = true;
+                        declaration = "<?xml";
+                        in_declaration = true;
+                        continue;
+                    } else if (token.type == TOKEN_ATTRIBUTE) {
+                        if (in_declaration) {
+                            document->declaration.attributes.push_back(XMLAttribute(token.name.str(), token.value.str()));
+                            char quote = memchr(token.value.data, '"', token.value.length) ? '\'' : '"';
+                            declaration += " " + token.name.str() + "=" + quote + token.value.str() + quote;
+                        } else {
+                            open.back()->attributes.push_back(XMLAttribute(token.name.str(), token.value.str()));
+                        }
+                        continue;
+                    }
+                    if (in_declaration) declaration += "?>\n";
+                    in_declaration = false;
+                    if (token.type == TOKEN_TEXT) {
+                        if (text == NULL) {
+                            text = new XMLContent();
+                            open.back()->children.push_back(text);
+                            nodes++;
+                        }
+                        text->add_line(token.name.str(), token.offset);
+                        continue;
+                    }
+                    if (text) text->shrink();
+                    text = NULL;
+                    if (token.type == TOKEN_DOCTYPE) {
+                        document->have_doctype = true;
+                        document->doctype.text = token.name.str();
+                        document->doctype.source_offset = token.offset;
+                    } else if (token.type == TOKEN_START_TAG) {
+                        XMLTag* tag = open.empty() ? &document->root : new XMLTag();
+                        tag->element = token.name.str();
+                        tag->source_offset = token.offset;
+                        if (!open.empty()) {
+                            runs.back().add(open.back(), token.offset);
+                            open.back()->children.push_back(tag);
+                        }
+                        open.push_back(tag);
+                        runs.push_back(PendingRun());
+                        nodes_before.push_back(nodes);
+                        nodes++;
+                    } else if (token.type == TOKEN_COMMENT) {
+                        XMLComment* comment = new XMLComment(token.name.str());
+                        comment->source_offset = token.offset;
+                        runs.back().add(open.back(), token.offset);
+                        open.back()->children.push_back(comment);
+                        nodes++;
+                        // "<!--" and "-->"
+                        runs.back().ended(open.back(), token.offset + token.name.length + 7);
+                        if (runs.back().is_full()) nodes += close_run(open.back(), &runs.back());
+                    } else if (token.type == TOKEN_END_TAG) {
+                        // empty-element tags end where their token is
+                        size_t end = token.empty ? token.offset : token.offset + token.name.length + 3;
+                        XMLTag* tag = open.back();
+                        bool big = end - tag->source_offset > PAGE_SOURCE_BYTES;
+                        // the children of small tags are paged with them
+                        if (big) nodes += close_run(tag, &runs.back());
+                        tag->subtree_nodes = nodes - nodes_before.back();
+                        open.pop_back();
+                        runs.pop_back();
+                        nodes_before.pop_back();
+                        if (open.empty()) continue;
+                        if (big) {
+                            // the run before a big tag ends before it
+                            nodes += close_run(open.back(), &runs.back());
+                        } else {
+                            runs.back().ended(open.back(), end);
+                            if (runs.back().is_full()) nodes += close_run(open.back(), &runs.back());
+                        }
+                    }
+                }
+            } catch (char const* message) {
+                document->last_parsed_offset = tokenizer.offset();
+                if (!document->index_lines) document->line_index.build();
+                document->last_parsed_line = document->line_index.line_of(document->last_parsed_offset);
+                document->last_parsed_column = document->line_index.column_of(document->last_parsed_offset);
+                throw;
+            }
+        }
+
+        void page_in(XMLTag* tag) {
+            vector<XMLNode*> children;
+            read_children(tag, &children);
+            HeapCensus census;
+            long long bytes = 0;
+            for (XMLNode* child : children) {
+                bytes += child->census(&census);
+            }
+            lock_guard<mutex> guard (lock);
+            tag->children.swap(children);
+            tag->page->loaded = true;
+            tag->page->bytes = bytes;
+            tag->page->used = clock;
+            loaded_bytes += bytes;
+            loaded.insert(tag);
+        }
+
+        void page_out(XMLTag* tag) {
+            lock_guard<mutex> guard (lock);
+            unload(tag);
+        }
+
+        void read_children(const XMLTag* tag, vector<XMLNode*>* children) const {
+            const XMLPage* page = tag->page;
+            // runs are parsed as the children of a tag around them
+            string run = PAGE_RUN_START + string(source.data() + page->start, page->end - page->start)
+                + PAGE_RUN_END;
+            unique_ptr<XMLDocument> document = parse_record(declaration, run.data(), run.length());
+            // the record starts after the declaration
+            long long offset = (long long)page->start - declaration.length() - strlen(PAGE_RUN_START);
+            for (XMLNode* child : document->root.children) {
+                XMLDocument::move_offsets(child, offset);
+            }
+            children->swap(document->root.children);
+        }
+
+        void touch(XMLTag* tag) {
+            lock_guard<mutex> guard (lock);
+            tag->page->used = clock;
+        }
+
+        void forget(XMLTag* tag) {
+            lock_guard<mutex> guard (lock);
+            if (loaded.erase(tag)) loaded_bytes -= tag->page->bytes;
+        }
+
+        /// Pages out the children used longest ago, until they fit the budget
+        /** Children used since the last trim stay, even over the budget,
+         *  so the ones rendered last are never freed from under the editor. */
+        void trim(const ExpandPolicy& policy) {
+            lock_guard<mutex> guard (lock);
+            if (loaded_bytes > budget) {
+                vector<pair<unsigned long long, XMLTag*> > by_use;
+                for (XMLTag* tag : loaded) {
+                    if (tag->page->used < clock) by_use.push_back(make_pair(tag->page->used, tag));
+                }
+                sort(by_use.begin(), by_use.end());
+                for (size_t i=0; i<by_use.size() && loaded_bytes > budget; i++) {
+                    if (by_use[i].second->is_evictable(policy)) unload(by_use[i].second);
+                }
+            }
+            clock++;
+        }
+    private:
+        PageStore(const PageStore&);
+        PageStore& operator=(const PageStore&);
+
+        /// The children of a tag being gathered into a run by load()
+        struct PendingRun {
+            /// The index of the first child, npos if there's none yet
+            size_t first = string::npos;
+            /// Where the first child starts
+            size_t start = 0;
+            /// The index after the last tag or comment
+            size_t last = 0;
+            /// Where it ends
+            size_t end = 0;
+
+            /// Adds a tag or comment about to be added to a tag
+            void add(const XMLTag* parent, size_t offset) {
+                if (first != string::npos) return;
+                first = parent->children.size();
+                start = offset;
+            }
+            /// Marks where the last child added ends
+            void ended(const XMLTag* parent, size_t offset) {
+                last = parent->children.size();
+                end = offset;
+            }
+            /// Whether the run is long enough to be a page
+            bool is_full() const {
+                return end - start >= PAGE_SOURCE_BYTES;
+            }
+        };
+
+        /// Replaces the children of a pending run with a paged out run
+        /** Text after its last tag or comment stays a child of the parent.
+         *  \param parent The tag the children are in
+         *  \param pending The run, which starts over
+         *  \return How many nodes were added, 1 or 0 if the run was empty */
+        size_t close_run(XMLTag* parent, PendingRun* pending) {
+            PendingRun closed = *pending;
+            *pending = PendingRun();
+            size_t first = closed.first, last = closed.last;
+            if (first == string::npos || last <= first) return 0;
+            XMLTag* run = new XMLTag();
+            run->run = true;
+            run->source_offset = closed.start;
+            run->page = new XMLPage(this, closed.start, closed.end);
+            for (size_t i=first; i<last; i++) {
+                run->subtree_nodes += parent->children[i]->subtree_nodes;
+                delete parent->children[i];
+            }
+            parent->children.erase(parent->children.begin() + first + 1, parent->children.begin() + last);
+            parent->children[first] = run;
+            return 1;
+        }
+
+        /// The file, kept mapped for the paged out tags
+        SourceFile source;
+        /// The declaration of the document, which pages are parsed with
+        string declaration;
+        long long budget;
+
+        mutex lock;
+        /// The tags with their children paged in
+        unordered_set<XMLTag*> loaded;
+        /// The memory they take
+        long long loaded_bytes = 0;
+        /// Counts trim() calls, so it knows what was used since the last one
+        unsigned long long clock = 1;
+
+        /// Frees the children of a tag, with the lock held
+        void unload(XMLTag* tag) {
+            if (!loaded.erase(tag)) return;
+            for (XMLNode* child : tag->children) {
+                delete child;
+            }
+            vector<XMLNode*>().swap(tag->children);
+            tag->page->loaded = false;
+            loaded_bytes -= tag->page->bytes;
+            tag->page->bytes = 0;
+        }
+};
+
+#endif
@@ -0,0 +1,185 @@
+/** \file parallel.cpp
+ *  A work-stealing thread pool, for going through big documents in parallel.
+ *  \author David Labský <labskdav@fit.cvut.cz> */
+
+#ifndef SUXML_PARALLEL_CPP
+#define SUXML_PARALLEL_CPP
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+using namespace std;
+
+/// A pool of threads running tasks, which steal work from each other
+/** Every worker has its own queue of tasks.  A worker takes the newest
+ *  task from its own queue and, when it runs out, steals the oldest task
+ *  from another queue - the oldest tasks tend to be the biggest.  Threads
+ *  outside the pool share one more queue.
+ *
+ *  Tasks are waited for with a TaskGroup; a thread waiting for its tasks
+ *  runs tasks itself meanwhile, so tasks can fork and wait for more tasks
+ *  without tying up the pool.  Tasks must not throw.
+ */
+class TaskPool {
+    public:
+        typedef function<void()> Task;
+
+        /// Starts the workers
+        /** \param threads How many threads run tasks, counting the thread
+         *  waiting for them, so one thread means no workers at all */
+        explicit TaskPool(unsigned threads) : stopping(false), queued(0) {
+            if (threads < 1) threads = 1;
+            for (unsigned i=0; i<threads; i++) {
+                queues.push_back(unique_ptr<Queue>(new Queue()));
+            }
+            for (unsigned i=0; i+1<threads; i++) {
+                workers.push_back(thread(&TaskPool::work, this, i));
+            }
+        }
+
+        ~TaskPool() {
+            {
+                lock_guard<mutex> lock (sleep_lock);
+                stopping = true;
+            }
+            wake.notify_all();
+            for (auto& worker : workers) {
+                worker.join();
+            }
+        }
+
+        /// The pool shared by the whole program
+        /** Created on first use, with as many threads as set_threads()
+         *  asked for, or as there are processors. */
+        static TaskPool& shared() {
+            static TaskPool pool (shared_threads());
+            return pool;
+        }
+
+        /// Sets how many threads the shared pool has
+        /** Only works before the pool is first used. */
+        static void set_threads(unsigned threads) {
+            shared_threads() = threads;
+        }
+
+        /// How many threads run tasks, counting the one waiting for them
+        size_t size() const {
+            return queues.size();
+        }
+
+        /// Queues a task, preferably onto the calling worker's own queue
+        void push(Task task) {
+            Queue& queue = *queues[own_queue()];
+            {
+                lock_guard<mutex> lock (queue.lock);
+                queue.tasks.push_back(move(task));
+            }
+            {
+                lock_guard<mutex> lock (sleep_lock);
+                queued++;
+            }
+            wake.notify_one();
+        }
+
+        /// Runs a single task, if there's any
+        /** \return Whether a task was run */
+        bool run_one() {
+            Task task;
+            if (!take(&task)) return false;
+            task();
+            return true;
+        }
+    private:
+        struct Queue {
+            mutex lock;
+            deque<Task> tasks;
+        };
+
+        vector<unique_ptr<Queue> > queues;
+        vector<thread> workers;
+        bool stopping;
+        /// How many tasks are queued, for waking sleeping workers
+        int queued;
+        mutex sleep_lock;
+        condition_variable wake;
+
+        static unsigned& shared_threads() {
+            static unsigned threads = thread::hardware_concurrency();
+            return threads;
+        }
+
+        /// The queue of the calling thread's worker, set in work()
+        static int& worker_index() {
+            static thread_local int index = -1;
+            return index;
+        }
+
+        size_t own_queue() const {
+            int index = worker_index();
+            // threads outside the pool share the last queue
+            return index == -1 ? queues.size()-1 : index;
+        }
+
+        /// Takes a task, from our own queue first, otherwise stealing one
+        bool take(Task* task) {
+            size_t own = own_queue();
+            for (size_t i=0; i<queues.size(); i++) {
+                Queue& queue = *queues[(own+i) % queues.size()];
+                lock_guard<mutex> lock (queue.lock);
+                if (queue.tasks.empty()) continue;
+                if (i == 0) {
+                    *task = move(queue.tasks.back());
+                    queue.tasks.pop_back();
+                } else {
+                    *task = move(queue.tasks.front());
+                    queue.tasks.pop_front();
+                }
+                lock_guard<mutex> sleep (sleep_lock);
+                queued--;
+                return true;
+            }
+            return false;
+        }
+
+        void work(int index) {
+            worker_index() = index;
+            while (true) {
+                if (run_one()) continue;
+                unique_lock<mutex> lock (sleep_lock);
+                wake.wait(lock, [this]() { return stopping || queued > 0; });
+                if (stopping) return;
+            }
+        }
+};
+
+/// Tasks which are waited for together
+class TaskGroup {
+    public:
+        explicit TaskGroup(TaskPool& pool) : pool(pool), pending(0) {};
+
+        /// Runs a task in the pool
+        void run(function<void()> task) {
+            pending++;
+            pool.push([this, task]() {
+                task();
+                pending--;
+            });
+        }
+
+        /// Waits for all the tasks, running tasks in the meantime
+        void wait() {
+            while (pending > 0) {
+                if (!pool.run_one()) this_thread::yield();
+            }
+        }
+    private:
+        TaskPool& pool;
+        atomic<int> pending;
+};
+
+#endif
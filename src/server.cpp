@@ -0,0 +1,179 @@
+/** \file server.cpp
+ *  Resident formatting server, listening on a Unix domain socket.
+ *  \author David Labský <labskdav@fit.cvut.cz> */
+
+#include <cerrno>
+#include <exception>
+#include <string>
+#include <thread>
+#include <vector>
+using namespace std;
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/// How much to read from a client at once
+#define SERVER_READ_SIZE 65536
+/// The biggest document a client can send, in bytes
+#define SERVER_MAX_REQUEST (256LL*1048576)
+/// How long a client can keep a worker waiting to read or write, in seconds
+#define SERVER_TIMEOUT 30
+
+/// Read everything a client sends, until it shuts down its end
+/** Reading stops when the client sends nothing for SERVER_TIMEOUT, or more
+ *  than SERVER_MAX_REQUEST.
+ *  \param fd The client socket
+ *  \param out The string to append the data to
+ *  \return True if the whole request was read */
+bool server_read_all(int fd, string* out) {
+    char buf[SERVER_READ_SIZE];
+    while (true) {
+        ssize_t got = read(fd, buf, sizeof(buf));
+        if (got == 0) return true;
+        if (got < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        out->append(buf, got);
+        if ((long long)out->length() > SERVER_MAX_REQUEST) return false;
+    }
+}
+
+/// Write a whole string to a client
+/** \return True if everything was written */
+bool server_write_all(int fd, const string& data) {
+    size_t done = 0;
+    while (done < data.length()) {
+        // MSG_NOSIGNAL, so a client hanging up doesn't kill the server
+        ssize_t sent = send(fd, data.data()+done, data.length()-done, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        done += sent;
+    }
+    return true;
+}
+
+/// Reformat a single document, like -P does
+/** The response starts with a status line: either "OK", followed by the
+ *  reformatted document, or "ERROR line N, column C, byte B: message".
+ *
+ *  \param request The document to format
+ *  \param newline Whether to end the document with a newline
+ *  \param style How to lay the document out
+ *  \param response The string to put the response into */
+void server_format(const string& request, bool newline, OutputStyle style, string* response) {
+    XMLDocument xmldoc = XMLDocument();
+    try {
+        xmldoc.parse(request.data(), request.length());
+    } catch (char const* message) {
+        *response = "ERROR line " + to_string(xmldoc.last_parsed_line)
+            + ", column " + to_string(xmldoc.last_parsed_column)
+            + ", byte " + to_string(xmldoc.last_parsed_offset) + ": " + message + "\n";
+        return;
+    }
+    *response = "OK\n";
+    *response += xmldoc.to_str(newline, style);
+}
+
+/// Serve clients until the listening socket fails
+/** Every worker thread runs this.  The request and response buffers are
+ *  kept between clients, so a warm worker doesn't reallocate them.  A
+ *  request which fails, such as by running out of memory, is answered
+ *  with "ERROR" and the message, and the worker goes on. */
+void server_worker(int listen_fd, bool newline, OutputStyle style) {
+    string request;
+    string response;
+    while (true) {
+        int client = accept(listen_fd, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            return;
+        }
+        // a client which stops sending or reading doesn't keep the worker
+        timeval timeout = {SERVER_TIMEOUT, 0};
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        try {
+            request.clear();
+            if (server_read_all(client, &request)) {
+                server_format(request, newline, style, &response);
+                server_write_all(client, response);
+            } else if ((long long)request.length() > SERVER_MAX_REQUEST) {
+                server_write_all(client, "ERROR request too large\n");
+            }
+        } catch (const exception& e) {
+            // the buffers may be what took the memory
+            string().swap(request);
+            string().swap(response);
+            server_write_all(client, string("ERROR ") + e.what() + "\n");
+        } catch (char const* message) {
+            server_write_all(client, string("ERROR ") + message + "\n");
+        }
+        close(client);
+    }
+}
+
+/// Run the formatting server
+/** Listens on a Unix domain socket at socket_path.  Each client sends a
+ *  document and shuts down its writing end; suxml answers with the
+ *  reformatted document (see server_format()) and closes the connection.
+ *  Clients are served concurrently by a pool of worker threads.
+ *
+ *  \param socket_path Where to create the socket
+ *  \param threads How many worker threads to run
+ *  \param newline Whether to end the documents with a newline
+ *  \param style How to lay the documents out
+ *  \return Exit code, only returned if the server fails to start */
+int serve(const char* socket_path, int threads, bool newline, OutputStyle style) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        printf("Cannot create socket: %s\n", strerror(errno));
+        return 1;
+    }
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        printf("Socket path too long.\n");
+        return 1;
+    }
+    strcpy(addr.sun_path, socket_path);
+    // a socket left over from a previous run would make bind() fail; but
+    // anything else at the path, or a server still listening there, is
+    // left alone
+    struct stat existing;
+    if (lstat(socket_path, &existing) == 0) {
+        if (!S_ISSOCK(existing.st_mode)) {
+            printf("Cannot listen on %s: %s\n", socket_path, strerror(EEXIST));
+            return 1;
+        }
+        int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        bool left_over = probe >= 0 && connect(probe, (sockaddr*)&addr, sizeof(addr)) < 0
+            && errno == ECONNREFUSED;
+        if (probe >= 0) close(probe);
+        if (!left_over) {
+            printf("Cannot listen on %s: %s\n", socket_path, strerror(EADDRINUSE));
+            return 1;
+        }
+        unlink(socket_path);
+    }
+    if (bind(fd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        printf("Cannot listen on %s: %s\n", socket_path, strerror(errno));
+        return 1;
+    }
+    
+    vector<thread> pool;
+    for (int i=0; i<threads; i++) {
+        pool.push_back(thread(server_worker, fd, newline, style));
+    }
+    for (auto& worker : pool) {
+        worker.join();
+    }
+    close(fd);
+    if (lstat(socket_path, &existing) == 0 && S_ISSOCK(existing.st_mode)) unlink(socket_path);
+    return 1;
+}
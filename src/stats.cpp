@@ -0,0 +1,426 @@
+/** \file stats.cpp
+ *  Statistics about the shape of a document, gathered in a single pass.
+ *  \author David Labský <labskdav@fit.cvut.cz> */
+
+#ifndef SUXML_STATS_CPP
+#define SUXML_STATS_CPP
+
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <iomanip>
+#include <mutex>
+#include "tokenizer.cpp"
+
+/// How many registers a DistinctCounter has, as a power of two
+#define STATS_SKETCH_BITS 10
+/// How many tokens are handed between the threads of gather_stats() at once
+#define STATS_BATCH 4096
+/// How many batches of tokens can be waiting at once
+#define STATS_BATCHES 4
+/// Documents smaller than this are gathered on a single thread
+#define STATS_PIPELINE_SIZE 1048576
+/// How many fan-out buckets there are, see DocumentStats::fan_out
+#define STATS_FAN_OUT_BUCKETS 34
+
+/// Estimates how many distinct strings it has seen
+/** A HyperLogLog sketch: takes 2^STATS_SKETCH_BITS bytes however many
+ *  strings are added, and is usually within a few percent.  Small counts
+ *  are nearly exact.
+ */
+class DistinctCounter {
+    public:
+        DistinctCounter() : registers(1 << STATS_SKETCH_BITS, 0) {};
+
+        /// Adds a string
+        void add(const char* data, size_t length) {
+            uint64_t hash = hash_bytes(data, length);
+            size_t index = hash >> (64 - STATS_SKETCH_BITS);
+            uint64_t rest = hash << STATS_SKETCH_BITS;
+            // where the first set bit of the rest is, counted from 1
+            unsigned char rank = 1;
+            while (rank <= 64 - STATS_SKETCH_BITS && !(rest >> 63)) {
+                rank++;
+                rest <<= 1;
+            }
+            if (rank > registers[index]) registers[index] = rank;
+        }
+
+        /// How many distinct strings there were, roughly
+        long long estimate() const {
+            double m = registers.size();
+            double sum = 0;
+            int zeros = 0;
+            for (unsigned char rank : registers) {
+                sum += ldexp(1.0, -rank);
+                if (rank == 0) zeros++;
+            }
+            double estimate = 0.7213 / (1 + 1.079/m) * m * m / sum;
+            // few strings are better counted by the empty registers
+            if (estimate <= 2.5*m && zeros) estimate = m * log(m/zeros);
+            return llround(estimate);
+        }
+    private:
+        vector<unsigned char> registers;
+};
+
+/// Statistics of elements with one name, see DocumentStats
+struct ElementStats {
+    /// How many elements there are
+    long long count = 0;
+    /// How many attributes they have
+    long long attributes = 0;
+    /// How many children they have
+    long long children = 0;
+};
+
+/// Statistics of attributes with one name, see DocumentStats
+struct AttributeStats {
+    /// How many times the attribute is used
+    long long count = 0;
+    /// The distinct values of the attribute
+    DistinctCounter values;
+};
+
+/// The shape of a document
+/** Filled in token by token, see gather_stats().  The memory taken only
+ *  grows with how deep the document is and how many element and attribute
+ *  names it uses.
+ *
+ *  Bytes are split into markup, text, comments and whitespace.  Markup is
+ *  counted as if the tags were written compactly, with one space before
+ *  each attribute, so any other whitespace inside tags counts as
+ *  whitespace, like the indentation.  Text is counted without the
+ *  whitespace the editor would trim.
+ */
+class DocumentStats {
+    public:
+        /// The size of the document
+        long long bytes = 0;
+        /// Bytes of tags, the declaration and the doctype
+        long long markup_bytes = 0;
+        /// Bytes of text content
+        long long text_bytes = 0;
+        /// Bytes of comments, with their &lt;!-- and -->
+        long long comment_bytes = 0;
+        /// Everything else
+        long long whitespace_bytes = 0;
+
+        long long elements = 0;
+        long long attributes = 0;
+        /// Lines of text; the lines between two other nodes are one node
+        /// in the editor, but each line is counted here
+        long long texts = 0;
+        long long comments = 0;
+
+        /// How deep the deepest element is, the root being 1
+        int max_depth = 0;
+        /// The depths of all elements added up
+        long long depth_sum = 0;
+        /// The most children an element has
+        long long max_fan_out = 0;
+        /// How many elements have 0, 1, 2-3, 4-7... children
+        vector<long long> fan_out;
+
+        map<string, ElementStats> element_stats;
+        map<string, AttributeStats> attribute_stats;
+
+        DocumentStats() : fan_out(STATS_FAN_OUT_BUCKETS, 0), in_declaration(false) {};
+
+        /// Adds a token, in document order
+        void add(const XMLToken& token) {
+            switch (token.type) {
+                case TOKEN_DECLARATION:
+                    // <?xml and ?>
+                    markup_bytes += 7;
+                    in_declaration = true;
+                    break;
+                case TOKEN_DOCTYPE:
+                    // <!DOCTYPE, a space and >
+                    markup_bytes += token.name.length + 11;
+                    in_declaration = false;
+                    break;
+                case TOKEN_START_TAG: {
+                    in_declaration = false;
+                    add_child();
+                    elements++;
+                    int depth = open.size() + 1;
+                    depth_sum += depth;
+                    if (depth > max_depth) max_depth = depth;
+                    name.assign(token.name.data, token.name.length);
+                    ElementStats* element = &element_stats[name];
+                    element->count++;
+                    open.push_back(make_pair(element, 0LL));
+                    // < and >
+                    markup_bytes += token.name.length + 2;
+                    break;
+                }
+                case TOKEN_ATTRIBUTE:
+                    // a space, =, and the quotes
+                    markup_bytes += token.name.length + token.value.length + 4;
+                    if (in_declaration) break;
+                    attributes++;
+                    open.back().first->attributes++;
+                    name.assign(token.name.data, token.name.length);
+                    {
+                        AttributeStats& attribute = attribute_stats[name];
+                        attribute.count++;
+                        attribute.values.add(token.value.data, token.value.length);
+                    }
+                    break;
+                case TOKEN_TEXT:
+                    add_child();
+                    texts++;
+                    text_bytes += token.name.length;
+                    break;
+                case TOKEN_COMMENT:
+                    add_child();
+                    comments++;
+                    comment_bytes += token.name.length + 7;
+                    break;
+                case TOKEN_END_TAG: {
+                    // the / of an empty-element tag, or a whole end tag
+                    markup_bytes += token.empty ? 1 : token.name.length + 3;
+                    long long children = open.back().second;
+                    open.back().first->children += children;
+                    if (children > max_fan_out) max_fan_out = children;
+                    int bucket = 0;
+                    while (children >> bucket) bucket++;
+                    fan_out[bucket]++;
+                    open.pop_back();
+                    break;
+                }
+            }
+        }
+
+        /// Finishes the statistics once all tokens were added
+        /** \param length The length of the document */
+        void finish(size_t length) {
+            bytes = length;
+            whitespace_bytes = bytes - markup_bytes - text_bytes - comment_bytes;
+        }
+
+        /// The statistics as a text table
+        /** Elements and attributes are listed from the most used. */
+        string to_table() const {
+            ostringstream out;
+            out << fixed << setprecision(1);
+            out << "bytes        " << setw(14) << bytes << "\n";
+            out << "  markup     " << setw(14) << markup_bytes << percent(markup_bytes) << "\n";
+            out << "  text       " << setw(14) << text_bytes << percent(text_bytes) << "\n";
+            out << "  comments   " << setw(14) << comment_bytes << percent(comment_bytes) << "\n";
+            out << "  whitespace " << setw(14) << whitespace_bytes << percent(whitespace_bytes) << "\n";
+            out << "elements     " << setw(14) << elements << "\n";
+            out << "attributes   " << setw(14) << attributes << "\n";
+            out << "text lines   " << setw(14) << texts << "\n";
+            out << "comments     " << setw(14) << comments << "\n";
+            out << "depth        " << setw(14) << max_depth << " max, "
+                << average(depth_sum, elements) << " average\n";
+            out << "fan-out      " << setw(14) << max_fan_out << " max, "
+                << average(elements + texts + comments - 1, elements) << " average\n";
+
+            out << "\nchildren           elements\n";
+            for (size_t i=0; i<fan_out.size(); i++) {
+                if (fan_out[i] == 0) continue;
+                out << left << setw(12) << fan_out_label(i) << right << setw(15) << fan_out[i] << "\n";
+            }
+
+            size_t width = 12;
+            for (auto& entry : element_stats) width = max(width, entry.first.length());
+            out << "\n" << left << setw(width) << "element" << right << setw(15) << "count"
+                << setw(15) << "attributes" << setw(15) << "children" << "\n";
+            for (auto& entry : by_count(element_stats)) {
+                const ElementStats& element = *entry.second;
+                out << left << setw(width) << *entry.first << right << setw(15) << element.count
+                    << setw(15) << element.attributes << setw(15) << element.children << "\n";
+            }
+
+            width = 12;
+            for (auto& entry : attribute_stats) width = max(width, entry.first.length());
+            out << "\n" << left << setw(width) << "attribute" << right << setw(15) << "count"
+                << setw(15) << "~values" << "\n";
+            for (auto& entry : by_count(attribute_stats)) {
+                out << left << setw(width) << *entry.first << right << setw(15) << entry.second->count
+                    << setw(15) << entry.second->values.estimate() << "\n";
+            }
+            return out.str();
+        }
+
+        /// The statistics as JSON
+        /** Elements and attributes are listed from the most used. */
+        string to_json() const {
+            ostringstream out;
+            out << "{\n  \"bytes\": " << bytes
+                << ",\n  \"markup_bytes\": " << markup_bytes
+                << ",\n  \"text_bytes\": " << text_bytes
+                << ",\n  \"comment_bytes\": " << comment_bytes
+                << ",\n  \"whitespace_bytes\": " << whitespace_bytes
+                << ",\n  \"elements\": " << elements
+                << ",\n  \"attributes\": " << attributes
+                << ",\n  \"text_lines\": " << texts
+                << ",\n  \"comments\": " << comments
+                << ",\n  \"max_depth\": " << max_depth
+                << ",\n  \"average_depth\": " << average(depth_sum, elements)
+                << ",\n  \"max_fan_out\": " << max_fan_out
+                << ",\n  \"average_fan_out\": " << average(elements + texts + comments - 1, elements)
+                << ",\n  \"fan_out\": [\n";
+            bool first = true;
+            for (size_t i=0; i<fan_out.size(); i++) {
+                if (fan_out[i] == 0) continue;
+                out << (first ? "" : ",\n") << "    {\"children\": " << json_string(fan_out_label(i))
+                    << ", \"elements\": " << fan_out[i] << "}";
+                first = false;
+            }
+            out << "\n  ],\n  \"element_names\": [\n";
+            first = true;
+            for (auto& entry : by_count(element_stats)) {
+                out << (first ? "" : ",\n") << "    {\"element\": " << json_string(*entry.first)
+                    << ", \"count\": " << entry.second->count
+                    << ", \"attributes\": " << entry.second->attributes
+                    << ", \"children\": " << entry.second->children << "}";
+                first = false;
+            }
+            out << "\n  ],\n  \"attribute_names\": [\n";
+            first = true;
+            for (auto& entry : by_count(attribute_stats)) {
+                out << (first ? "" : ",\n") << "    {\"attribute\": " << json_string(*entry.first)
+                    << ", \"count\": " << entry.second->count
+                    << ", \"distinct_values\": " << entry.second->values.estimate() << "}";
+                first = false;
+            }
+            out << "\n  ]\n}\n";
+            return out.str();
+        }
+    private:
+        /// The open elements, with how many children they have so far
+        vector<pair<ElementStats*, long long> > open;
+        /// Whether attributes belong to the declaration
+        bool in_declaration;
+        /// A buffer for looking up names
+        string name;
+
+        void add_child() {
+            if (open.size()) open.back().second++;
+        }
+
+        string percent(long long part) const {
+            ostringstream out;
+            out << fixed << setprecision(1) << setw(7) << (bytes ? 100.0 * part / bytes : 0.0) << "%";
+            return out.str();
+        }
+
+        static string average(long long sum, long long count) {
+            ostringstream out;
+            out << fixed << setprecision(2) << (count ? (double)sum / count : 0.0);
+            return out.str();
+        }
+
+        static string fan_out_label(size_t bucket) {
+            if (bucket < 2) return to_string(bucket);
+            return to_string(1LL << (bucket-1)) + "-" + to_string((1LL << bucket) - 1);
+        }
+
+        /// Lists the entries of a map from the most used
+        template <typename Stats>
+        static vector<pair<const string*, const Stats*> > by_count(const map<string, Stats>& entries) {
+            vector<pair<const string*, const Stats*> > order;
+            for (auto& entry : entries) {
+                order.push_back(make_pair(&entry.first, &entry.second));
+            }
+            stable_sort(order.begin(), order.end(), [](const pair<const string*, const Stats*>& a,
+                const pair<const string*, const Stats*>& b) {
+                return a.second->count > b.second->count;
+            });
+            return order;
+        }
+};
+
+/// Gathers the statistics of a document, without building a tree
+/** Large documents are tokenized on another thread, which hands the
+ *  tokens over in batches, so at most STATS_BATCHES batches are held at
+ *  once.
+ *
+ *  \param data The document
+ *  \param length The length of the document
+ *  \param threads How many threads can be used
+ *  \param stats Where to gather the statistics
+ *  \param offset Where to put the byte offset of the error, see LineIndex
+ *  \return NULL if the document is fine, an error message otherwise */
+inline const char* gather_stats(const char* data, size_t length, int threads,
+                                DocumentStats* stats, size_t* offset) {
+    XMLTokenizer tokenizer (data, length);
+    const char* error = NULL;
+    if (threads < 2 || length < STATS_PIPELINE_SIZE) {
+        XMLToken token;
+        try {
+            while (tokenizer.next(&token)) stats->add(token);
+        } catch (char const* message) {
+            *offset = tokenizer.offset();
+            error = message;
+        }
+    } else {
+        vector<vector<XMLToken> > batches (STATS_BATCHES, vector<XMLToken>(STATS_BATCH));
+        vector<size_t> filled (STATS_BATCHES, 0);
+        // batches are handed over in a ring, counted by these
+        size_t produced = 0;
+        size_t consumed = 0;
+        bool finished = false;
+        mutex lock;
+        condition_variable changed;
+
+        thread producer ([&]() {
+            try {
+                bool more = true;
+                while (more) {
+                    size_t slot;
+                    {
+                        unique_lock<mutex> wait (lock);
+                        changed.wait(wait, [&]() { return produced - consumed < STATS_BATCHES; });
+                        slot = produced % STATS_BATCHES;
+                    }
+                    vector<XMLToken>& batch = batches[slot];
+                    size_t count = 0;
+                    while (count < STATS_BATCH && (more = tokenizer.next(&batch[count]))) count++;
+                    {
+                        lock_guard<mutex> hand_over (lock);
+                        filled[slot] = count;
+                        produced++;
+                        finished = !more;
+                    }
+                    changed.notify_all();
+                }
+            } catch (char const* message) {
+                {
+                    lock_guard<mutex> fail (lock);
+                    *offset = tokenizer.offset();
+                    error = message;
+                    finished = true;
+                }
+                changed.notify_all();
+            }
+        });
+        while (true) {
+            size_t slot;
+            {
+                unique_lock<mutex> wait (lock);
+                changed.wait(wait, [&]() { return consumed < produced || finished; });
+                // an error leaves the remaining tokens alone
+                if (consumed == produced || error != NULL) break;
+                slot = consumed % STATS_BATCHES;
+            }
+            for (size_t i=0; i<filled[slot]; i++) {
+                stats->add(batches[slot][i]);
+            }
+            {
+                lock_guard<mutex> done (lock);
+                consumed++;
+            }
+            changed.notify_all();
+        }
+        producer.join();
+    }
+    if (error == NULL) stats->finish(length);
+    return error;
+}
+
+#endif
@@ -1,7 +1,7 @@
 /** \file suxml.cpp
  *  UI code for suxml, the XML editor
  *  \author David Labský <labskdav@fit.cvut.cz> */
- 
+
 /** \mainpage
  *  This is a simple and opinionated interactive xml editor using ncurses.
  * 
@@ -23,22 +23,46 @@
  * \section features Features
  * suxml has numerous features:
  * \li Interactive and intuitive visual editor
- * \li Automatic reformatting
+ * \li Automatic reformatting, indented, compact or minified
  * \li Insertion of new tags, text snippets, and comments
+ * \li Undo and redo, without copying the document
+ * \li Reloading files changed by someone else, parsing only what changed
  * \li Editing and insertion of new attributes
  * \li Understands doctype and xml specifications
- * \li Simple find feature
+ * \li Full-text find feature with match navigation
+ * \li Renaming, deleting, wrapping and setting attributes on all matches at once
+ * \li Going to a line or byte offset of the source file
+ * \li Instant expanding of everything, or down to a level, even in huge files
+ * \li Searching and saving huge files on all processors
+ * \li Profiling the shape of files too big to edit
+ * \li Splitting huge files into records
+ * \li Editing files bigger than memory, parsing parts of them as they're needed
+ * \li Keeping repeated subtrees in memory once, copying them when edited
+ * \li Long texts kept as one node, still edited a line at a time
+ * \li Structural diffs between documents, also against the file on disk
+ * \li Deeply nested documents shifted left to follow the cursor
  *
  * \section structure Structure
- * There are two source files, `suxml.cpp` and `xml.cpp`.  The former contains
- * the editor code (using ncurses) and the latter contains the classes for
- * parsing, modifying, and outputting XML.
+ * There are two main source files, `suxml.cpp` and `xml.cpp`.  The former
+ * contains the editor code (using ncurses) and the latter contains the classes
+ * for parsing, modifying, and outputting XML.  `tokenizer.cpp` goes through
+ * documents without building a tree, also fed a piece at a time;
+ * `stats.cpp` and `extract.cpp` use it to profile the shape of documents
+ * and split them into records, and `server.cpp` contains the resident
+ * formatting server.  `watch.cpp`
+ * notices when someone else changes the edited file, `pages.cpp` pages
+ * out parts of files bigger than memory, and `diff.cpp` compares documents.
+ * `parallel.cpp` has the work-stealing thread pool which big documents are
+ * searched, saved and measured with.
  * 
  * \section lib Usage as a library
  * I suppose xml could be used as a library without the UI cludge of suxml.  I
- * would certainly recommend against it though.
+ * would certainly recommend against it though.  If you insist, `xml.cpp`
+ * doesn't depend on ncurses and can simply be included; `make lib` checks
+ * that it builds on its own.  Documents can be parsed from a file, a stream
+ * or a buffer in memory, and XMLDocument::to_str() gives the formatted output.
  **/
- 
+
 #include <cstdio>
 #include <cassert>
 #include <cstdlib>
@@ -50,18 +74,241 @@
 #include <string>
 #include <vector>
 #include <algorithm>
+#include <atomic>
+#include <thread>
 using namespace std;
 
 #include <ncurses.h>
 
 #include "banner.h"
 #include "xml.cpp"
+#include "tokenizer.cpp"
+#include "stats.cpp"
+#include "extract.cpp"
+#include "diff.cpp"
+#include "pages.cpp"
+#include "server.cpp"
+#include "watch.cpp"
+#include "latency.cpp"
 
 /// The help text shown at the bottom of the screen
 const char* help_text[] = {
     "Q -QUIT", "W -WRITE", "RET -EDIT", "ESC -BACK",
     "DEL -DELETE", "I -INSERT", "N -NEW TAG", "/ -FIND",
-    "E -EXPAND ALL", "C -COMMENT"};
+    "E -EXPAND ALL", "1..9 -EXPAND TO LEVEL", "C -COMMENT", "./, -NEXT/PREV",
+    "G -GO TO LINE", "B -BULK EDIT", "U -UNDO", "R -REDO", "D -DIFF"};
+
+/// Check whether files are well-formed, without opening the editor
+/** The files are divided between threads; errors are printed in the
+ *  order the files were given.  A file named "-" is standard input,
+ *  which is checked as it's read.
+ *
+ *  \param filenames The files to check
+ *  \param threads How many files to check at once
+ *  \return Exit code, 0 if all files are fine */
+int validate_files(const vector<char*>& filenames, int threads) {
+    vector<string> errors (filenames.size());
+    atomic<size_t> next_file (0);
+    auto worker = [&]() {
+        size_t i;
+        while ((i = next_file++) < filenames.size()) {
+            if (strcmp(filenames[i], "-") == 0) {
+                // standard input is checked as it arrives
+                int line, column;
+                size_t offset;
+                const char* message = validate_stream(stdin, &line, &column, &offset);
+                if (message != NULL) {
+                    errors[i] = "line " + to_string(line) + ", column " + to_string(column)
+                        + ", byte " + to_string(offset) + ": " + message;
+                }
+                continue;
+            }
+            try {
+                SourceFile source (filenames[i]);
+                size_t offset;
+                const char* message = validate(source.data(), source.length(), &offset);
+                if (message != NULL) {
+                    // only the part up to the error needs to be indexed
+                    LineIndex lines (source.data(), source.length());
+                    errors[i] = "line " + to_string(lines.line_of(offset))
+                        + ", column " + to_string(lines.column_of(offset))
+                        + ", byte " + to_string(offset) + ": " + message;
+                }
+            } catch (char const* message) {
+                errors[i] = message;
+            }
+        }
+    };
+    vector<thread> pool;
+    for (int i=1; i<threads && i<(int)filenames.size(); i++) {
+        pool.push_back(thread(worker));
+    }
+    worker();
+    for (auto& t : pool) {
+        t.join();
+    }
+    
+    int status = 0;
+    for (size_t i=0; i<filenames.size(); i++) {
+        if (errors[i].length()) {
+            printf("%s: %s\n", filenames[i], errors[i].c_str());
+            status = 1;
+        }
+    }
+    return status;
+}
+
+/// Print statistics about the shape of a file, without opening the editor
+/** \param filename The file to go through
+ *  \param output_filename Where to write the statistics, - for stdout
+ *  \param threads How many threads can be used
+ *  \param json Whether to write JSON instead of a table
+ *  \return Exit code, 0 if the file is fine */
+int report_stats(const char* filename, const char* output_filename, int threads, bool json) {
+    DocumentStats stats;
+    try {
+        SourceFile source (filename);
+        size_t offset;
+        const char* message = gather_stats(source.data(), source.length(), threads, &stats, &offset);
+        if (message != NULL) {
+            LineIndex lines (source.data(), source.length());
+            printf("%s: line %d, column %d, byte %zu: %s\n", filename, lines.line_of(offset),
+                lines.column_of(offset), offset, message);
+            return 1;
+        }
+    } catch (char const* message) {
+        printf("%s: %s\n", filename, message);
+        return 1;
+    }
+    string out = json ? stats.to_json() : stats.to_table();
+    if (strcmp(output_filename, "-") == 0) {
+        cout << out;
+    } else {
+        ofstream fout (output_filename, ios::out);
+        fout << out;
+        fout.close();
+        if (fout.fail()) {
+            printf("Error while writing: failed to write\n");
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/// Write the records of a file, without opening the editor
+/** See extract_records().
+ *  \param filename The file to split
+ *  \param path Which elements are records, see ElementPath
+ *  \param output_filename Where to write the records, see RecordOutput
+ *  \param newline Whether record files end with a newline
+ *  \param style How to lay the records out
+ *  \return Exit code, 0 if everything was written */
+int extract_files(const char* filename, const char* path, const char* output_filename, bool newline,
+                  OutputStyle style) {
+    ElementPath record_path (path);
+    if (!record_path.valid()) {
+        printf("Invalid path %s\n", path);
+        return 1;
+    }
+    try {
+        SourceFile source (filename);
+        size_t offset;
+        long long records;
+        const char* message = extract_records(source.data(), source.length(), record_path,
+            RecordOutput(output_filename), newline, style, &offset, &records);
+        if (message == NULL) return 0;
+        if (offset == string::npos) {
+            printf("Error while writing: %s\n", message);
+        } else {
+            LineIndex lines (source.data(), source.length());
+            printf("%s: line %d, column %d, byte %zu: %s\n", filename, lines.line_of(offset),
+                lines.column_of(offset), offset, message);
+        }
+        return 1;
+    } catch (char const* message) {
+        printf("%s: %s\n", filename, message);
+        return 1;
+    }
+}
+
+/// Print the differences between two versions of a file, without opening
+/// the editor
+/** See TreeDiff.  The files are parsed at once, on two threads.
+ *  \param old_filename The old version
+ *  \param filename The new version
+ *  \param output_filename Where to write the differences, - for stdout
+ *  \return Exit code, 0 if the files are the same, 1 if they differ and
+ *  2 if either doesn't parse or the differences can't be written */
+int diff_files(const char* old_filename, const char* filename, const char* output_filename) {
+    XMLDocument documents[2];
+    const char* filenames[2] = {old_filename, filename};
+    string errors[2];
+    auto parse = [&](int i) {
+        try {
+            documents[i].parse(filenames[i]);
+        } catch (char const* message) {
+            if (strcmp(message, "cannot open file") == 0) {
+                errors[i] = message;
+            } else {
+                errors[i] = "line " + to_string(documents[i].last_parsed_line)
+                    + ", column " + to_string(documents[i].last_parsed_column)
+                    + ", byte " + to_string(documents[i].last_parsed_offset) + ": " + message;
+            }
+        }
+    };
+    thread old_parser (parse, 0);
+    parse(1);
+    old_parser.join();
+    for (int i=0; i<2; i++) {
+        if (errors[i].length()) {
+            printf("%s: %s\n", filenames[i], errors[i].c_str());
+            return 2;
+        }
+    }
+    TreeDiff diff (&documents[0], &documents[1]);
+    string out = diff.to_str();
+    if (strcmp(output_filename, "-") == 0) {
+        cout << out;
+    } else {
+        ofstream fout (output_filename, ios::out);
+        fout << out;
+        fout.close();
+        if (fout.fail()) {
+            printf("Error while writing: failed to write\n");
+            return 2;
+        }
+    }
+    return diff.differences.empty() ? 0 : 1;
+}
+
+/// Name a key of the editor, for the latency report
+const char* command_name(int command) {
+    switch (command) {
+        case 'q': return "quit";
+        case 'w': return "write";
+        case '\n': return "edit";
+        case KEY_UP: return "up";
+        case KEY_DOWN: return "down";
+        case KEY_RIGHT: return "expand";
+        case KEY_LEFT: return "collapse";
+        case KEY_DC: return "delete";
+        case 'i': return "insert";
+        case 'n': return "new-tag";
+        case 'c': return "comment";
+        case '/': return "find";
+        case '.': return "next-match";
+        case ',': return "prev-match";
+        case 'e': return "expand-all";
+        case 'g': return "goto-line";
+        case 'b': return "bulk-edit";
+        case 'u': return "undo";
+        case 'r': return "redo";
+        case 'd': return "diff";
+        default:
+            if (command >= '1' && command <= '9') return "expand-level";
+            return "other";
+    }
+}
 
 /// Ask for confirmation before an operation
 bool ask(const char* question) {
@@ -76,28 +323,144 @@ bool ask(const char* question) {
     return false;
 }
 
+/// Read a line of input at the bottom of the screen
+/** \param question What to ask for
+ *  \return The input, or an empty string if ESC was pressed */
+string prompt(const char* question) {
+    string input = "";
+    move(LINES-1, 0);
+    printw(string(COLS, ' ').c_str());
+    move(LINES-1, 0);
+    printw(" %s", question);
+    
+    while (true) {
+        int c = getch();
+        if (c == 27) { // ESC
+            return "";
+        } else if (c == '\n') {
+            return input;
+        } else if (c == '\x7f' or c == KEY_BACKSPACE) {
+            if (input.length() > 0) {
+                input.erase(input.end()-1);
+            }
+        } else if (isprint(c)) {
+            input += string(1, c);
+        }
+        move(LINES-1, 0);
+        printw(" %s", question);
+        attrset(COLOR_PAIR(1));
+        printw((input).c_str());
+        attrset(COLOR_PAIR(10));
+        printw(" ");
+        move(LINES-1, 1+strlen(question)+input.length());
+    }
+}
+
 int main(int argc, char* argv []) {
     char* filename = NULL;
     char* output_filename = NULL;
     bool light = false;
     bool newline = true;
+    OutputStyle style = OUTPUT_PRETTY;
+    bool share = false;
     bool reading_output_filename = false;
     bool pass = false;
+    char* socket_path = NULL;
+    bool reading_socket_path = false;
+    int threads = thread::hardware_concurrency();
+    bool reading_threads = false;
+    bool validate_only = false;
+    bool stats_table = false;
+    bool stats_json = false;
+    char* extract_path = NULL;
+    bool reading_extract_path = false;
+    vector<char*> bulk_edits;
+    bool reading_bulk_edit = false;
+    bool memory_report = false;
+    vector<char*> filenames;
+    char* latency_filename = NULL;
+    bool reading_latency_filename = false;
+    int journal_megabytes = JOURNAL_DEFAULT_LIMIT;
+    bool reading_journal_limit = false;
+    int page_megabytes = 0;
+    bool reading_page_budget = false;
+    char* old_filename = NULL;
+    bool reading_old_filename = false;
+    int goto_line = 0;
     for (int i=1; i<argc; i++) {
         if (strcmp(argv[i], "--light") == 0) {
             light = true;
         } else if (strcmp(argv[i], "-L") == 0) {
             newline = false;
+        } else if (strcmp(argv[i], "--compact") == 0) {
+            style = OUTPUT_COMPACT;
+        } else if (strcmp(argv[i], "--minify") == 0) {
+            style = OUTPUT_MINIFIED;
+        } else if (strcmp(argv[i], "--share") == 0) {
+            share = true;
         } else if (strcmp(argv[i], "-O") == 0) {
             reading_output_filename = true;
         } else if (strcmp(argv[i], "-P") == 0) {
             pass = true;
+        } else if (strcmp(argv[i], "-S") == 0) {
+            reading_socket_path = true;
+        } else if (strcmp(argv[i], "-j") == 0) {
+            reading_threads = true;
+        } else if (strcmp(argv[i], "-V") == 0) {
+            validate_only = true;
+        } else if (strcmp(argv[i], "-I") == 0) {
+            stats_table = true;
+        } else if (strcmp(argv[i], "-J") == 0) {
+            stats_json = true;
+        } else if (strcmp(argv[i], "-X") == 0) {
+            reading_extract_path = true;
+        } else if (strcmp(argv[i], "-E") == 0) {
+            reading_bulk_edit = true;
+            pass = true;
+        } else if (strcmp(argv[i], "-M") == 0) {
+            memory_report = true;
+            pass = true;
+        } else if (strcmp(argv[i], "-T") == 0) {
+            reading_latency_filename = true;
+        } else if (strcmp(argv[i], "-U") == 0) {
+            reading_journal_limit = true;
+        } else if (strcmp(argv[i], "-B") == 0) {
+            reading_page_budget = true;
+        } else if (strcmp(argv[i], "-D") == 0) {
+            reading_old_filename = true;
+        } else if (argv[i][0] == '+' && isdigit(argv[i][1])) {
+            goto_line = atoi(argv[i]+1);
         } else {
             if (reading_output_filename) {
                 output_filename = argv[i];
                 reading_output_filename = false;
+            } else if (reading_socket_path) {
+                socket_path = argv[i];
+                reading_socket_path = false;
+            } else if (reading_threads) {
+                threads = atoi(argv[i]);
+                reading_threads = false;
+            } else if (reading_extract_path) {
+                extract_path = argv[i];
+                reading_extract_path = false;
+            } else if (reading_bulk_edit) {
+                bulk_edits.push_back(argv[i]);
+                reading_bulk_edit = false;
+            } else if (reading_latency_filename) {
+                latency_filename = argv[i];
+                reading_latency_filename = false;
+            } else if (reading_journal_limit) {
+                journal_megabytes = atoi(argv[i]);
+                reading_journal_limit = false;
+            } else if (reading_page_budget) {
+                page_megabytes = atoi(argv[i]);
+                reading_page_budget = false;
+            } else if (reading_old_filename) {
+                old_filename = argv[i];
+                reading_old_filename = false;
             } else {
                 filename = argv[i];
+                filenames.push_back(argv[i]);
             }
         }
     }
@@ -106,6 +469,72 @@ int main(int argc, char* argv []) {
         printf("-O needs a parameter\n");
         return 0;
     }
+    if (reading_socket_path) {
+        printf("-S needs a parameter\n");
+        return 0;
+    }
+    if (reading_threads) {
+        printf("-j needs a parameter\n");
+        return 0;
+    }
+    if (reading_latency_filename) {
+        printf("-T needs a parameter\n");
+        return 0;
+    }
+    if (reading_extract_path) {
+        printf("-X needs a parameter\n");
+        return 0;
+    }
+    if (reading_journal_limit) {
+        printf("-U needs a parameter\n");
+        return 0;
+    }
+    if (reading_page_budget) {
+        printf("-B needs a parameter\n");
+        return 0;
+    }
+    if (reading_old_filename) {
+        printf("-D needs a parameter\n");
+        return 0;
+    }
+    if (reading_bulk_edit) {
+        printf("-E needs a parameter\n");
+        return 0;
+    }
+    // the edits are checked before the file is parsed
+    vector<ElementPath> bulk_paths;
+    vector<BulkEdit> bulk_operations;
+    for (char* bulk_edit : bulk_edits) {
+        string query = bulk_edit;
+        size_t space = query.find(' ');
+        bulk_paths.push_back(ElementPath(query.substr(0, space)));
+        if (space == string::npos || !bulk_paths.back().valid()) {
+            printf("Invalid edit %s, expected a path and an edit\n", bulk_edit);
+            return 1;
+        }
+        try {
+            bulk_operations.push_back(BulkEdit(query.substr(space+1)));
+        } catch (char const* message) {
+            printf("Invalid edit %s: %s\n", bulk_edit, message);
+            return 1;
+        }
+    }
+    if (share && page_megabytes > 0) {
+        printf("--share and -B can't be used together\n");
+        return 1;
+    }
+    if (share && goto_line > 0) {
+        // the places of a shared subtree don't have offsets of their own
+        printf("--share and +line can't be used together\n");
+        return 1;
+    }
+    if (threads < 1) threads = 1;
+    TaskPool::set_threads(threads);
+    
+    if (socket_path != NULL) {
+        // stay resident and format documents sent over the socket
+        return serve(socket_path, threads, newline, style);
+    }
     
     // Error out if we don't get a file
     if (filename == NULL) {
@@ -113,8 +542,32 @@ int main(int argc, char* argv []) {
         return 0;
     }
     
+    if (validate_only) {
+        return validate_files(filenames, threads);
+    }
+    
+    if (stats_table || stats_json) {
+        return report_stats(filename, output_filename ? output_filename : (char*)"-", threads, stats_json);
+    }
+    
+    if (extract_path != NULL) {
+        return extract_files(filename, extract_path, output_filename ? output_filename : (char*)"-", newline, style);
+    }
+    
+    if (old_filename != NULL) {
+        return diff_files(old_filename, filename, output_filename ? output_filename : (char*)"-");
+    }
+    
+    // the memory report shouldn't overwrite the file by default
+    if (output_filename == NULL && memory_report) output_filename = (char*)"-";
     if (output_filename == NULL) output_filename = filename;
     
+    // the editor needs stdin for the keyboard
+    if (!pass && strcmp(filename, "-") == 0) {
+        printf("Reading from stdin only works with -P\n");
+        return 1;
+    }
+    
     if (!pass) {
         
         // Setup ncurses stuff
@@ -148,34 +601,74 @@ int main(int argc, char* argv []) {
         // Display the pretty suxml banner I spent like a minute on
         attrset(COLOR_PAIR(10));
         printw(SUXML_BANNER);
-    
+        
         printw("Parsing file %s...\n", filename);
     }
+    // the editor notices when someone else changes the file, unless it's
+    // too big to read whole or shares subtrees, which can't be reloaded
+    unique_ptr<FileWatcher> watcher;
+    if (!pass && page_megabytes <= 0 && !share) watcher.reset(new FileWatcher(filename));
+    // pages out subtrees to the file, and has to outlive the document
+    unique_ptr<PageStore> pages;
     // Attempt to parse the file
     XMLDocument xmldoc = XMLDocument();
+    // the editor can go to a line of the file
+    xmldoc.index_lines = !pass;
+    xmldoc.share_subtrees = share;
+    xmldoc.journal.limit = journal_megabytes * 1048576LL;
     string error = "";
     try {
-        xmldoc.parse(filename);
+        // the watcher compares changes with what it read, so parse that
+        shared_ptr<const string> contents = watcher ? watcher->contents() : NULL;
+        if (page_megabytes > 0) {
+            pages.reset(new PageStore(filename, page_megabytes * 1048576LL));
+            pages->load(&xmldoc);
+        } else if (contents && contents->length()) {
+            xmldoc.parse(contents->data(), contents->length());
+        } else {
+            xmldoc.parse(filename);
+        }
     } catch (char const* message) {
         error = message;
     }
     
-    xmldoc.render();
-    
     // Report an error if one occurred
     if (error.length() == 0) {
         if (!pass) printw("File parsed successfully\n");
         
+        for (size_t i=0; i<bulk_operations.size(); i++) {
+            xmldoc.bulk_edit(bulk_operations[i], &bulk_paths[i]);
+        }
+        
+        if (memory_report) {
+            // count the editor lines as they'd be with everything expanded
+            xmldoc.expand_all();
+            xmldoc.render();
+            HeapCensus census;
+            xmldoc.census(&census);
+            if (strcmp(output_filename, "-") == 0) {
+                cout << census.to_json();
+            } else {
+                ofstream fout (output_filename, ios::out);
+                fout << census.to_json();
+                fout.close();
+                if (fout.fail()) {
+                    printf("Error while writing: failed to write\n");
+                    exit(1);
+                }
+            }
+            exit(0);
+        }
         if (pass) {
-            ofstream fout (output_filename, ios::out);
-            if (!fout.is_open() || !fout.good() || !fout || fout.fail()) {
-                throw "failed to write";
+            try {
+                xmldoc.save(output_filename, newline, style);
+            } catch (char const* message) {
+                printf("Error while writing: %s\n", message);
+                exit(1);
             }
-            fout << xmldoc.to_str(newline);
-            fout.close();
             exit(0);
         }
-        
+    
     } else if (error == "cannot open file") {
         if (!pass) {
             printw("File doesn't exist and will be created when saving.\n");
@@ -188,13 +681,15 @@ int main(int argc, char* argv []) {
             attrset(COLOR_PAIR(6));
             printw("Error while parsing:");
             attrset(COLOR_PAIR(10));
-            printw(" line %d: %s\n", xmldoc.last_parsed_line, error.c_str());
+            printw(" line %d, column %d, byte %zu: %s\n", xmldoc.last_parsed_line,
+                xmldoc.last_parsed_column, xmldoc.last_parsed_offset, error.c_str());
             printw("\n");
             printw("Error encountered while parsing.\n");
             printw("suxml will edit the partial file.\n");
         } else {
             printf("Error while parsing:");
-            printf(" line %d: %s\n", xmldoc.last_parsed_line, error.c_str());
+            printf(" line %d, column %d, byte %zu: %s\n", xmldoc.last_parsed_line,
+                xmldoc.last_parsed_column, xmldoc.last_parsed_offset, error.c_str());
             printf("File not changed.\n");
             return 1;
         }
@@ -206,6 +701,9 @@ int main(int argc, char* argv []) {
     
     // Window offset from the start of the document (or, the topmost line shown)
     int top = 0;
+    // How many levels of indentation are scrolled off to the left, so deep
+    // lines still fit the screen
+    int shift = 0;
     // Currently selected line
     int cursor = 0;
     // Is select mode active
@@ -225,29 +723,160 @@ int main(int argc, char* argv []) {
     
     // Which piece of help text should be highlighted in green
     int highlight_help_text = -1;
+    // A message to show instead of the help text, e.g. search results
+    string message = "";
+    // Which of xmldoc.matches() the cursor was last moved to
+    int match_index = -1;
+    // Whether the document is what the watcher last read, so only the
+    // changed part needs to be parsed again
+    bool reload_changes = error.length() == 0;
+    // Whether the file changed on disk and wasn't reloaded
+    bool disk_changed = false;
+    bool saving_over_source = strcmp(output_filename, filename) == 0;
+    
+    // Latency measurements, if enabled with -T
+    bool timing = latency_filename != NULL;
+    LatencyRecorder latency;
+    // Time spent in each phase of handling the current key
+    long long phase_ns[PHASE_COUNT];
+    // How long the last key took, for the overlay
+    long long last_frame_ns = 0;
+    // Renders the lines on the screen, timing it
+    auto render = [&]() {
+        long long start = now_ns();
+        // keep the cursor within bounds
+        if (cursor < 0) cursor = 0;
+        int last_top = top;
+        while (true) {
+            // scroll the visible portion of the sceren
+            // make sure the cursor is at least 1/3 from the top or bottom
+            // of the screen, this makes the viewing area pleasant
+            if (cursor < top+(LINES/3)) top = cursor-(LINES/3);
+            if (top < 0) top = 0;
+            if (cursor > top+(LINES/3)*2) top = cursor-(LINES/3)*2;
+            xmldoc.render_window(top, LINES-1);
+            if (cursor < top + (int)xmldoc.editor_lines.size()) break;
+            // the cursor went past the end of the document
+            cursor = xmldoc.line_count()-1;
+            top = last_top;
+        }
+        // scroll the indentation too, so the cursor's line starts in the
+        // left half of the screen; shallower lines scroll it back
+        int depth = xmldoc.line(cursor).depth;
+        int levels = (COLS/4 - 2)/2;
+        if (depth < shift || 2 + (depth-shift)*2 > COLS/2) shift = depth - levels;
+        if (shift < 0) shift = 0;
+        phase_ns[PHASE_RENDER] += now_ns() - start;
+    };
+    
+    // How wide the column left of the lines is, which shows how many levels
+    // of indentation each line lost to the shift
+    auto gutter = [&]() {
+        return shift ? (int)to_string(shift).length() + 1 : 0;
+    };
+    
+    // The column a line starts at, with the indentation shifted; lines
+    // shallower than the shift start at the left
+    auto indent_x = [&](int line_num) {
+        int depth = xmldoc.line(line_num).depth - shift;
+        return gutter() + 2 + (depth > 0 ? depth*2 : 0);
+    };
+    
+    // Moves the cursor to the first match at or after it, and counts them
+    auto first_match = [&]() {
+        const vector<int>& matches = xmldoc.matches();
+        match_index = -1;
+        if (matches.size()) {
+            match_index = lower_bound(matches.begin(), matches.end(), cursor) - matches.begin();
+            if (match_index == (int)matches.size()) match_index = 0;
+            cursor = matches[match_index];
+        }
+        return matches.size();
+    };
+    
+    // The first part of the node on the cursor's line, the line itself
+    // for text spanning several
+    auto part = [&]() {
+        return xmldoc.line(cursor).part;
+    };
     
     // expand the root for convenience
-    xmldoc.root.expanded = true;
-    xmldoc.render();
+    xmldoc.expand_to(1);
+    if (goto_line > 0) {
+        cursor = xmldoc.go_to_line(goto_line);
+    } else if (error.length() && error != "cannot open file" && !share) {
+        // show where the partial document ends
+        cursor = xmldoc.go_to_offset(xmldoc.last_parsed_offset);
+    }
+    render();
     
     while (true) {
+        // the key being handled and when we got it
+        int key = -1;
+        long long key_start = 0;
+        for (int i=0; i<PHASE_COUNT; i++) phase_ns[i] = 0;
         if (!redraw) {
+            // wake up now and then to look for changes of the file
+            if (watcher) timeout(WATCH_INTERVAL);
             int command = getch();
-            if (command == 'q') { // QUIT
+            timeout(-1);
+            FileChange change;
+            if (command == ERR && !(watcher && watcher->take(&change))) continue;
+            key = command;
+            key_start = now_ns();
+            if (command == ERR) { // FILE CHANGED
+                if (xmldoc.modified && !ask("File changed on disk. Reload and lose your edits?")) {
+                    disk_changed = true;
+                    reload_changes = false;
+                    message = "Kept your edits, W overwrites the file";
+                } else {
+                    // the cursor stays on the node in the same place, and
+                    // on the same line of text
+                    vector<size_t> cursor_path;
+                    bool cursor_found = xmldoc.path_of(xmldoc.line(cursor).node, &cursor_path);
+                    int cursor_part = part();
+                    const string& contents = *change.contents;
+                    try {
+                        xmldoc.reload(contents.data(), contents.length(),
+                            reload_changes ? change.prefix : 0, reload_changes ? change.suffix : 0);
+                        reload_changes = true;
+                        disk_changed = false;
+                        match_index = -1;
+                        if (cursor_found) cursor = xmldoc.line_of_path(cursor_path, false) + cursor_part;
+                        message = "Reloaded, the file changed on disk";
+                    } catch (char const* reload_error) {
+                        reload_changes = false;
+                        disk_changed = true;
+                        message = "The file changed on disk but doesn't parse: line "
+                            + to_string(xmldoc.last_parsed_line) + ", column "
+                            + to_string(xmldoc.last_parsed_column) + ": " + reload_error;
+                    }
+                    render();
+                }
+            } else if (command == 'q') { // QUIT
                 // ask for confirmation when quitting!
                 if (ask("Really quit?")) break;
             } else if (command == 'w') { // WRITE
-                if (ask("Save?")) {
-                    ofstream fout (output_filename, ios::out);
-                    if (!fout.is_open() || !fout.good() || !fout || fout.fail()) {
-                        throw "failed to write";
+                bool save = ask(disk_changed && saving_over_source ? "File changed on disk. Overwrite?" : "Save?");
+                // don't count the time spent answering
+                key_start = now_ns();
+                if (save) {
+                    try {
+                        xmldoc.save(output_filename, newline, style);
+                        xmldoc.modified = false;
+                        if (saving_over_source) {
+                            // the file isn't what the document was parsed from anymore
+                            if (watcher) watcher->saved();
+                            reload_changes = false;
+                            disk_changed = false;
+                        }
+                        highlight_help_text = 1;
+                    } catch (char const* write_error) {
+                        message = write_error;
                     }
-                    fout << xmldoc.to_str(newline);
-                    fout.close();
-                    highlight_help_text = 1;
                 }
             } else if (command == '\n') { // EDIT
-                if (xmldoc.editor_lines[cursor].selectable) {
+                if (xmldoc.line(cursor).selectable) {
                     select = true;
                     select_cursor = 0;
                 }
@@ -256,82 +885,133 @@ int main(int argc, char* argv []) {
             } else if (command == KEY_DOWN) {
                 cursor++;
             } else if (command == KEY_RIGHT) {
-                xmldoc.editor_lines[cursor].node->expanded = true;
-                xmldoc.render();
+                xmldoc.set_expanded(cursor, true);
+                render();
             } else if (command == KEY_LEFT) {
-                xmldoc.editor_lines[cursor].node->expanded = false;
-                xmldoc.render();
+                xmldoc.set_expanded(cursor, false);
+                render();
             } else if (command == KEY_DC) { // DELETE
-                if (xmldoc.del_node(xmldoc.editor_lines[cursor].node)) {
-                    xmldoc.render();
+                xmldoc.changing(cursor);
+                if (xmldoc.del_line(cursor)) {
+                    render();
                 }
             } else if (command == 'i') { // INSERT
-                xmldoc.editor_lines[cursor].node->expanded = true;
-                if (xmldoc.ins_node(xmldoc.editor_lines[cursor].node,
-                  !xmldoc.editor_lines[cursor].selectable, new XMLContent(""))) {
+                xmldoc.set_expanded(cursor, true);
+                if (xmldoc.ins_line(cursor, new XMLContent(""))) {
                     cursor++;
-                    xmldoc.render();
+                    render();
                 }
             } else if (command == 'n') { // NEW NODE
-                xmldoc.editor_lines[cursor].node->expanded = true;
-                if (xmldoc.ins_node(xmldoc.editor_lines[cursor].node,
-                  !xmldoc.editor_lines[cursor].selectable, new XMLTag(""))) {
+                xmldoc.set_expanded(cursor, true);
+                if (xmldoc.ins_line(cursor, new XMLTag(""))) {
                     cursor++;
-                    xmldoc.render();
+                    render();
                 }
             } else if (command == 'c') { // COMMENT
-                xmldoc.editor_lines[cursor].node->expanded = true;
-                if (xmldoc.ins_node(xmldoc.editor_lines[cursor].node,
-                  !xmldoc.editor_lines[cursor].selectable, new XMLComment(""))) {
+                xmldoc.set_expanded(cursor, true);
+                if (xmldoc.ins_line(cursor, new XMLComment(""))) {
                     cursor++;
-                    xmldoc.render();
+                    render();
                 }
             } else if (command == '/') { // FIND
-                string find_string = "";
-                move(LINES-1, 0);
-                printw(string(COLS, ' ').c_str());
-                move(LINES-1, 0);
-                printw(" Search for: ");
-                
-                while (true) {
-                    int c = getch();
-                    if (c == 27) { // ESC
-                        find_string = "";
-                        break;
-                    } else if (c == '\n') {
-                        break;
-                    } else if (c == '\x7f' or c == KEY_BACKSPACE) {
-                        if (find_string.length() > 0) {
-                            find_string.erase(find_string.end()-1);
-                        }
-                    } else if (isprint(c)) {
-                        find_string += string(1, c);
-                    }
-                    move(LINES-1, 0);
-                    printw(" Search for: ");
-                    attrset(COLOR_PAIR(1));
-                    printw((find_string).c_str());
-                    attrset(COLOR_PAIR(10));
-                    printw(" ");
-                    move(LINES-1, 13+find_string.length());
-                }
-                
+                string find_string = prompt("Search for: ");
+                // don't count the time spent typing
+                key_start = now_ns();
                 if (find_string.length() > 0) {
                     xmldoc.find(find_string);
-                    xmldoc.render();
+                    size_t matches = first_match();
+                    render();
+                    message = to_string(matches) + " matches";
                 }
-                
+            } else if (command == 'd') { // DIFF
+                if (pages) {
+                    // the file would have to be parsed whole
+                    message = "Can't compare with the file while paging it";
+                } else {
+                    XMLDocument on_disk;
+                    try {
+                        shared_ptr<const string> contents = watcher ? watcher->contents() : NULL;
+                        if (contents && contents->length()) on_disk.parse(contents->data(), contents->length());
+                        else on_disk.parse(filename);
+                        TreeDiff diff (&on_disk, &xmldoc);
+                        diff.mark(&xmldoc);
+                        first_match();
+                        render();
+                        message = to_string(diff.differences.size()) + " differences from the file";
+                    } catch (char const* diff_error) {
+                        message = string("Can't compare with the file: ") + diff_error;
+                    }
+                }
+            } else if (command == '.' or command == ',') { // NEXT/PREV MATCH
+                int matches = xmldoc.matches().size();
+                if (matches) {
+                    if (command == '.') match_index++;
+                    else match_index--;
+                    // wrap around the ends of the document
+                    match_index = (match_index % matches + matches) % matches;
+                    cursor = xmldoc.matches()[match_index];
+                    message = "match " + to_string(match_index+1) + " of " + to_string(matches);
+                } else {
+                    flash();
+                }
+            
             } else if (command == 'e') {
                 xmldoc.expand_all();
-                xmldoc.render();
+                render();
+            } else if (command >= '1' && command <= '9') { // EXPAND TO LEVEL
+                xmldoc.expand_to(command - '0');
+                render();
+            } else if (command == 'g' && share) {
+                message = "Can't go to a line while sharing subtrees";
+            } else if (command == 'g') { // GO TO LINE
+                string where = prompt("Go to line (or @byte): ");
+                // don't count the time spent typing
+                key_start = now_ns();
+                if (where.length() && where[0] == '@' && isdigit(where.c_str()[1])) {
+                    cursor = xmldoc.go_to_offset(strtoull(where.c_str()+1, NULL, 10));
+                    render();
+                } else if (where.length() && isdigit(where[0])) {
+                    cursor = xmldoc.go_to_line(atoi(where.c_str()));
+                    render();
+                } else if (where.length()) {
+                    flash();
+                }
+            } else if (command == 'b') { // BULK EDIT
+                if (xmldoc.matches().size() == 0) {
+                    // there's nothing found to edit
+                    flash();
+                } else {
+                    string edit = prompt("Edit matches (rename, delete, set, unset, wrap, unwrap): ");
+                    // don't count the time spent typing
+                    key_start = now_ns();
+                    if (edit.length()) {
+                        try {
+                            long long edited = xmldoc.bulk_edit(BulkEdit(edit), NULL);
+                            match_index = -1;
+                            render();
+                            message = to_string(edited) + " nodes edited";
+                        } catch (char const* edit_error) {
+                            message = edit_error;
+                        }
+                    }
+                }
+            } else if (command == 'u' || command == 'r') { // UNDO/REDO
+                int line = command == 'u' ? xmldoc.undo() : xmldoc.redo();
+                if (line == -1) {
+                    flash();
+                } else {
+                    cursor = line;
+                    render();
+                }
             }
+            phase_ns[PHASE_COMMAND] = now_ns() - key_start - phase_ns[PHASE_RENDER];
         }
         int command = -1;
         bool skip=true;
         int error_at = -1;
         while (select || editing) {
             if (select) {
-                if (xmldoc.editor_lines[cursor].node->num_settable() > 1) {
+                if (xmldoc.line(cursor).node->num_settable() > 1) {
                     // selecting...
                     if (!skip) command = getch();
                     if (command == 27 || command == KEY_UP || command == KEY_DOWN) { // esc
@@ -347,20 +1027,21 @@ int main(int argc, char* argv []) {
                         if (select_cursor < 0) select_cursor = 0;
                     } else if (command == KEY_RIGHT) {
                         select_cursor++;
-                        if (select_cursor >= xmldoc.editor_lines[cursor].node->num_settable()) {
-                            select_cursor = xmldoc.editor_lines[cursor].node->num_settable()-1;
+                        if (select_cursor >= xmldoc.line(cursor).node->num_settable()) {
+                            select_cursor = xmldoc.line(cursor).node->num_settable()-1;
                         }
                     } else if (command == KEY_DC) { // DELETE
-                        bool del = xmldoc.editor_lines[cursor].node->del(select_cursor);
-                        if (del) xmldoc.render();
+                        xmldoc.changing(cursor);
+                        bool del = xmldoc.del(xmldoc.line(cursor).node, part() + select_cursor);
+                        if (del) render();
                     }
                     
-                    edit_buf = xmldoc.editor_lines[cursor].node->settable_parts()[select_cursor];
-                    
+                    edit_buf = xmldoc.line(cursor).node->settable_parts()[part() + select_cursor];
+                
                 } else {
                     select = false;
                     editing = true;
-                    edit_buf = xmldoc.editor_lines[cursor].node->settable_parts()[0];
+                    edit_buf = xmldoc.line(cursor).node->settable_parts()[part()];
                     edit_col = edit_buf.length();
                 }
             }
@@ -368,11 +1049,12 @@ int main(int argc, char* argv []) {
                 int c = -1;
                 if (!skip) c = getch();
                 if (c == '\n' or c == 27) { // 27 == ESC
-                    pair<bool, int> set = xmldoc.editor_lines[cursor].node->set(select_cursor, edit_buf);
+                    xmldoc.changing(cursor);
+                    pair<bool, int> set = xmldoc.set(xmldoc.line(cursor).node, part() + select_cursor, edit_buf);
                     if (set.first) {
-                        xmldoc.render();
+                        render();
                         editing = false;
-                        if (xmldoc.editor_lines[cursor].node->num_settable() > 1) select = true;
+                        if (xmldoc.line(cursor).node->num_settable() > 1) select = true;
                     } else {
                         error_at = set.second;
                     }
@@ -401,12 +1083,12 @@ int main(int argc, char* argv []) {
                 }
             }
             // render line while selecting or editing
-            auto line_and_select_x = xmldoc.editor_lines[cursor].node->get_settable_line(select_cursor, edit_buf);
+            auto line_and_select_x = xmldoc.line(cursor).node->get_settable_line(part() + select_cursor, edit_buf);
             string line = line_and_select_x.first;
             int select_x = line_and_select_x.second;
             
             attrset(COLOR_PAIR(10));
-            move(cursor-top, 0);
+            move(cursor-top, gutter());
             // show the fact that we're editing a string
             if (editing) printw("*");
             else printw(" ");
@@ -414,7 +1096,8 @@ int main(int argc, char* argv []) {
             // while editing, we want to make it possible to at least
             // gracefully edit lines that are too long.
             // calculate some helper variables for that
-            int chars_fit = COLS - (2+xmldoc.editor_lines[cursor].depth*2);
+            int x = indent_x(cursor);
+            int chars_fit = COLS - x;
             int extra_lines = 0;
             int overflow = line.length() - chars_fit;
             while (overflow >= 0) {
@@ -423,25 +1106,22 @@ int main(int argc, char* argv []) {
             }
             
             // erase the line and any ones that we're gonna overlap
-            move(cursor-top, 2+xmldoc.editor_lines[cursor].depth*2);
-            printw(string(chars_fit, ' ').c_str());
-            for (int i=0; i<extra_lines; i++) {
-                printw(string(COLS, ' ').c_str());
+            for (int i=0; i<=extra_lines; i++) {
+                move(cursor-top+i, i ? 0 : x);
+                clrtoeol();
             }
             
             // print the line and the selected part over it, inverted
-            move(cursor-top, 2+xmldoc.editor_lines[cursor].depth*2);
-            printw(line.c_str());
-            move(cursor-top, 2 + (xmldoc.editor_lines[cursor].depth*2) + select_x);
-            move(cursor-top + ((select_x - chars_fit + (COLS))/COLS),
-                (2 + (xmldoc.editor_lines[cursor].depth*2) + select_x) % COLS);
+            move(cursor-top, x);
+            addstr(line.c_str());
+            move(cursor-top + ((select_x - chars_fit + (COLS))/COLS), (x + select_x) % COLS);
             attrset(COLOR_PAIR(1));
-            printw(edit_buf.c_str());
+            addstr(edit_buf.c_str());
             if (error_at != -1) {
                 // if there's an error, highlight it in red
                 attrset(COLOR_PAIR(2));
-                move(cursor-top, 2 + (xmldoc.editor_lines[cursor].depth*2) + select_x + error_at);
-                printw(string(1, edit_buf[error_at]).c_str());
+                move(cursor-top, x + select_x + error_at);
+                addnstr(edit_buf.c_str() + error_at, 1);
                 error_at = -1;
             }
             if (select) {
@@ -449,14 +1129,14 @@ int main(int argc, char* argv []) {
                 // move the cursor there, otherwise place the cursor to the
                 // corner (the inverted colors are enough to denote selection)
                 if (edit_buf.length() == 0) {
-                    move(cursor-top, 2 + (xmldoc.editor_lines[cursor].depth*2) + select_x);
+                    move(cursor-top, x + select_x);
                 } else {
                     move(LINES-1, COLS-1);
                 }
             } else if (editing) {
                 // if we're editing, move the cursor over the current character
                 move(cursor - top + ((select_x+edit_col - chars_fit + (COLS))/COLS),
-                    (2 + (xmldoc.editor_lines[cursor].depth*2) + select_x + edit_col) % COLS);
+                    (x + select_x + edit_col) % COLS);
             }
             attrset(COLOR_PAIR(10));
             
@@ -464,56 +1144,57 @@ int main(int argc, char* argv []) {
             skip = false;
         }
         
+        render();
         // get the highlighted node, so we can tell if there's an end tag
-        // and highlight it too
-        highlighted = xmldoc.editor_lines[cursor].node;
-        
-        // keep the cursor within bounds
-        if (cursor < 0) cursor = 0;
-        if (cursor >= (int)xmldoc.editor_lines.size()) cursor = xmldoc.editor_lines.size()-1;
-        
-        // scroll the visible portion of the sceren
-        // make sure the cursor is at least 1/3 from the top or bottom
-        // of the screen, this makes the viewing area pleasant
-        while (cursor < top+(LINES/3)) top--;
-        if (top < 0) top = 0;
-        while (cursor > top+(LINES/3)*2) top++;
-        
+        // and highlight it too; of text, only the line itself is
+        highlighted = xmldoc.line(cursor).node;
         
         // render the screen
+        long long repaint_start = now_ns();
         clear();
         for (int y=0; y<LINES-1; y++) {
             int line_num = top+y;
-            if (line_num < (int)xmldoc.editor_lines.size()) {
-                if ((line_num == cursor or xmldoc.editor_lines[line_num].node == highlighted)
-                    && xmldoc.editor_lines[cursor].selectable) {
+            if (line_num < top + (int)xmldoc.editor_lines.size()) {
+                const EditorLine& line = xmldoc.line(line_num);
+                // lines past the right edge still show their $
+                int x = indent_x(line_num);
+                if (x > COLS-1) x = COLS-1;
+                if (shift) {
+                    // the levels of indentation left out of the line
+                    move(y, 0);
+                    printw("%*d", gutter()-1, line.depth < shift ? line.depth : shift);
+                }
+                if ((line_num == cursor or (xmldoc.line(line_num).node == highlighted
+                                            && xmldoc.line(line_num).part == part()))
+                    && xmldoc.line(cursor).selectable) {
                     // highlight the line the cursor is over
-                    if (!xmldoc.editor_lines[line_num].highlight) {
+                    if (!xmldoc.line(line_num).highlight) {
                         attrset(COLOR_PAIR(1));
                     } else {
                         attrset(COLOR_PAIR(5));
                     }
-                } else if (xmldoc.editor_lines[line_num].highlight) {
+                } else if (xmldoc.line(line_num).highlight) {
                     attrset(COLOR_PAIR(4));
                 }
-                move(y, 2 + xmldoc.editor_lines[line_num].depth*2);
+                move(y, x);
                 
                 // calculate how many characters fit; if the line doesn't fit,
-                // show an inverted $ at the endto portray it
-                int chars_fit = COLS - (2 + xmldoc.editor_lines[line_num].depth*2);
-                if ((int)xmldoc.editor_lines[line_num].text.size() > chars_fit) {
-                    printw(xmldoc.editor_lines[line_num].text.substr(0, chars_fit-1).c_str());
+                // show an inverted $ at the endto portray it; only the part
+                // that fits is drawn
+                int chars_fit = COLS - x;
+                if ((int)line.text.size() > chars_fit) {
+                    addnstr(line.text.c_str(), chars_fit-1);
                     attrset(COLOR_PAIR(1));
                     printw("$");
                     attrset(COLOR_PAIR(10));
-                } else if (xmldoc.editor_lines[line_num].text.size()) {
-                    printw(xmldoc.editor_lines[line_num].text.c_str());
+                } else if (line.text.size()) {
+                    addstr(line.text.c_str());
                 } else {
                     // if the line is empty, print a single space to make
                     // it possible to hover over it anyway
                     printw(" ");
                 }
-                if (line_num == cursor && !xmldoc.editor_lines[cursor].selectable) {
+                if (line_num == cursor && !xmldoc.line(cursor).selectable) {
                     // if the line isn't selectable, print an inverted space at
                     // the end of it, to visualize the fact that if you
                     // insert or add a tag, it'll get put after the line
@@ -522,10 +1203,10 @@ int main(int argc, char* argv []) {
                 }
                 attrset(COLOR_PAIR(10));
                 
-                if (!xmldoc.editor_lines[line_num].node->expanded
-                    && xmldoc.editor_lines[line_num].node->is_expandable()) {
+                if (!xmldoc.is_expanded(line_num)
+                    && xmldoc.line(line_num).node->is_expandable()) {
                     // print an inverted + if the line can be expanded
-                    move(y, 1+xmldoc.editor_lines[line_num].depth*2);
+                    move(y, x-1);
                     attrset(COLOR_PAIR(1));
                     printw("+");
                     attrset(COLOR_PAIR(10));
@@ -541,29 +1222,60 @@ int main(int argc, char* argv []) {
         // print the help text at the bottom of the screen
         move(LINES-1, 0);
         printw(" ");
-        int i = 0;
-        for (auto text : help_text) {
+        if (message.length()) {
+            // a message replaces the help text until the next key
             attrset(COLOR_PAIR(1));
-            // set the color to green if this help text is to be highlighted
-            if (highlight_help_text == i) attrset(COLOR_PAIR(3));
-            printw(" ");
-            // print the help string up to -, invert colors after it
-            // (this is done to save screen estate yet make storage convenient)
-            for (auto c : string(text)) {
-                if (c != '-') printw(string(1, c).c_str());
-                else attrset(COLOR_PAIR(10));
-            }
-            printw(" ");
+            printw(" %s ", message.c_str());
             attrset(COLOR_PAIR(10));
-            i++;
+            message = "";
+        } else {
+            int i = 0;
+            for (auto text : help_text) {
+                attrset(COLOR_PAIR(1));
+                // set the color to green if this help text is to be highlighted
+                if (highlight_help_text == i) attrset(COLOR_PAIR(3));
+                printw(" ");
+                // print the help string up to -, invert colors after it
+                // (this is done to save screen estate yet make storage convenient)
+                for (auto c : string(text)) {
+                    if (c != '-') printw(string(1, c).c_str());
+                    else attrset(COLOR_PAIR(10));
+                }
+                printw(" ");
+                attrset(COLOR_PAIR(10));
+                i++;
+            }
         }
         highlight_help_text = -1;
+        
+        if (timing) {
+            // show how long the last key took in the corner
+            move(LINES-1, COLS-14);
+            attrset(COLOR_PAIR(1));
+            printw(" %9.2fms ", last_frame_ns/1e6);
+            attrset(COLOR_PAIR(10));
+        }
         move(LINES-1, COLS-1);
         redraw = false;
+        
+        if (timing && key != -1) {
+            // push the screen out now, so the repaint is measured too
+            refresh();
+            long long end = now_ns();
+            phase_ns[PHASE_REPAINT] = end - repaint_start;
+            phase_ns[PHASE_TOTAL] = phase_ns[PHASE_COMMAND] + phase_ns[PHASE_RENDER]
+                + phase_ns[PHASE_REPAINT];
+            last_frame_ns = phase_ns[PHASE_TOTAL];
+            latency.record(command_name(key), phase_ns);
+        }
     }
     
     // bye!
     endwin();
     
+    if (timing && !latency.write(latency_filename)) {
+        printf("Cannot write latencies to %s\n", latency_filename);
+    }
+    
     return 0;
 }
@@ -0,0 +1,613 @@
+/** \file tokenizer.cpp
+ *  A tokenizer for XML documents, which doesn't build a tree.
+ *  \author David Labský <labskdav@fit.cvut.cz> */
+
+#ifndef SUXML_TOKENIZER_CPP
+#define SUXML_TOKENIZER_CPP
+
+#include "xml.cpp"
+
+/// How much of a stream validate_stream() reads at a time, in bytes
+#define TOKENIZER_READ_CHUNK 65536
+
+/// A piece of the document being tokenized
+/** Points into the tokenizer's input, nothing is copied. */
+struct TextView {
+    const char* data;
+    size_t length;
+    
+    TextView() : data(NULL), length(0) {};
+    TextView(const char* data, size_t length) : data(data), length(length) {};
+    
+    /// Copies the text into a string
+    string str() const {
+        return string(data, length);
+    }
+    bool operator==(const TextView& other) const {
+        return length == other.length && memcmp(data, other.data, length) == 0;
+    }
+    bool operator==(const char* other) const {
+        return length == strlen(other) && memcmp(data, other, length) == 0;
+    }
+    bool operator!=(const TextView& other) const { return !(*this == other); }
+    bool operator!=(const char* other) const { return !(*this == other); }
+};
+
+/// The kinds of tokens XMLTokenizer produces
+enum XMLTokenType {
+    /// The &lt;?xml declaration, followed by its attributes
+    TOKEN_DECLARATION,
+    /// The doctype, with its contents as text
+    TOKEN_DOCTYPE,
+    /// A start tag or an empty-element tag, followed by its attributes
+    TOKEN_START_TAG,
+    /// An attribute of the last declaration or start tag
+    TOKEN_ATTRIBUTE,
+    /// A line of text content, trimmed like XMLDocument::parse() does
+    TOKEN_TEXT,
+    /// A comment
+    TOKEN_COMMENT,
+    /// An end tag; empty-element tags get one too
+    TOKEN_END_TAG
+};
+
+/// A token found in the document
+struct XMLToken {
+    XMLTokenType type;
+    /// Element or attribute name, or the text of text, comment and doctype
+    TextView name;
+    /// The attribute value
+    TextView value;
+    /// Byte offset of the token in the document
+    size_t offset;
+    /// Whether an end tag closes an empty-element tag
+    bool empty;
+};
+
+/// An XML tokenizer
+/** Goes through the document with the same grammar as XMLDocument::parse(),
+ *  and throws the same messages, but produces a stream of tokens instead of
+ *  a tree.  The only thing it allocates is the stack of open elements.
+ *  Tokens point into the document, which has to outlive them.
+ *
+ *  The document can also be fed in pieces as it arrives, from a socket or
+ *  a pipe, see feed().  When next() runs out of input in the middle of a
+ *  token, it goes back to where the token started and returns false with
+ *  needs_input() set; the token is read whole once there's more.  Only the
+ *  unfinished token is kept between pieces, and tokens point into it, so
+ *  they only last until the next feed().  The input before the encoding is
+ *  known is kept too, so it can be checked.  Reading the token again skips
+ *  what was already searched for its delimiters, so each byte of a long
+ *  token is only looked at once however many pieces it comes in.
+ */
+class XMLTokenizer {
+    public:
+        /// Tokenizes a whole document
+        XMLTokenizer(const char* data, size_t length)
+            : start(data), pos(data), end(data+length), last(true), at_eof(false), c(0),
+              state(STATE_PROLOG), attributes_of(ATTRIBUTES_TAG), tag_start(NULL),
+              encoding(ENCODING_UNCHECKED), checked(end), invalid(NULL) {};
+        /// Tokenizes a document fed in pieces, see feed()
+        XMLTokenizer()
+            : start(NULL), pos(NULL), end(NULL), last(false), at_eof(false), c(0),
+              state(STATE_PROLOG), attributes_of(ATTRIBUTES_TAG), tag_start(NULL),
+              encoding(ENCODING_UNCHECKED), checked(NULL), invalid(NULL) {};
+        
+        /// Adds the next piece of a document being fed in pieces
+        /** The input the tokens so far were read from is freed, except for
+         *  the token next() stopped in.  The piece is copied.
+         *  \param data The piece
+         *  \param length Its length in bytes */
+        void feed(const char* data, size_t length) {
+            assert (!last);
+            // the tag being read started before pos
+            const char* keep = state == STATE_DOCTYPE || state == STATE_ROOT || state == STATE_TAG ? tag_start : pos;
+            if (!encoding_started) keep = start;
+            forget(keep);
+            // the element names still needed were in what's forgotten, or
+            // in the copy of current from the last piece
+            while (kept_names.size() < stack.size()) {
+                kept_names.push_back(stack[kept_names.size()].str());
+                stack[kept_names.size()-1] = TextView(kept_names.back().data(), kept_names.back().length());
+            }
+            if (state == STATE_ATTRIBUTES && attributes_of != ATTRIBUTES_DECLARATION) {
+                current_name = current.str();
+                current = TextView(current_name.data(), current_name.length());
+            }
+            size_t kept = end - keep;
+            size_t checked_at = encoding == ENCODING_UNCHECKED ? string::npos : checked < keep ? 0 : checked - keep;
+            size_t invalid_at = invalid ? invalid - keep : 0;
+            size_t pos_at = pos - keep;
+            size_t tag_start_at = tag_start && tag_start >= keep ? tag_start - keep : string::npos;
+            buffer.erase(0, buffer.length() - kept);
+            buffer.append(data, length);
+            start = buffer.data();
+            end = start + buffer.length();
+            pos = start + pos_at;
+            checked = checked_at == string::npos ? end : start + checked_at;
+            if (invalid) invalid = start + invalid_at;
+            if (tag_start_at != string::npos) tag_start = start + tag_start_at;
+        }
+        
+        /// Tells the tokenizer a document fed in pieces has ended
+        void finish() {
+            last = true;
+        }
+        
+        /// Whether next() stopped because the input ran out, see feed()
+        bool needs_input() const {
+            return hungry;
+        }
+        
+        /// Reads the next token
+        /** Throws a message if the document isn't well-formed.
+         *  \param token Where to put the token
+         *  \return False if the document has ended, or it's being fed in
+         *  pieces and needs the next one, see needs_input() */
+        bool next(XMLToken* token) {
+            hungry = false;
+            if (last) return read_token(token);
+            // the token is read again from the start when there's more
+            const char* pos_before = pos;
+            char c_before = c;
+            State state_before = state;
+            AttributesOf attributes_of_before = attributes_of;
+            const char* tag_start_before = tag_start;
+            TextView current_before = current;
+            size_t open_before = stack.size();
+            try {
+                return read_token(token);
+            } catch (char const* message) {
+                if (message != NEEDS_INPUT) throw;
+                pos = pos_before;
+                c = c_before;
+                state = state_before;
+                attributes_of = attributes_of_before;
+                tag_start = tag_start_before;
+                current = current_before;
+                stack.resize(open_before);
+                hungry = true;
+                return false;
+            }
+        }
+        
+        /// The byte offset the tokenizer got to
+        /** After an error, this is where the error was found. */
+        size_t offset() const {
+            return offset_of(pos);
+        }
+        
+        /// The line the tokenizer got to, counted from 1, see offset()
+        /** Counts the lines, so it's meant for reporting errors. */
+        int line() const {
+            int line = 1 + forgotten_lines;
+            for (const char* p = start; p < pos; p++) {
+                if (*p == '\n') line++;
+            }
+            return line;
+        }
+        
+        /// The column the tokenizer got to, in bytes from 1, see line()
+        int column() const {
+            size_t line_start = forgotten_line_start;
+            for (const char* p = start; p < pos; p++) {
+                if (*p == '\n') line_start = offset_of(p+1);
+            }
+            return offset() - line_start + 1;
+        }
+        
+        /// How many elements are open
+        int depth() const {
+            return stack.size();
+        }
+    private:
+        enum State {
+            STATE_PROLOG, STATE_DOCTYPE, STATE_ROOT, STATE_ATTRIBUTES,
+            STATE_CONTENT, STATE_TEXT, STATE_TAG, STATE_TRAILER, STATE_DONE
+        };
+        enum AttributesOf { ATTRIBUTES_DECLARATION, ATTRIBUTES_ROOT, ATTRIBUTES_TAG };
+        
+        /// Thrown inside when the input runs out before the document ends
+        static constexpr const char* NEEDS_INPUT = "needs more input";
+        
+        /// The input, from where the first token not read yet starts
+        const char* start;
+        const char* pos;
+        const char* end;
+        /// Whether the input goes to the end of the document
+        bool last;
+        /// Whether next() ran out of input, see needs_input()
+        bool hungry = false;
+        /// The input of a document fed in pieces, see feed()
+        string buffer;
+        /// How much input was forgotten before start, see feed()
+        size_t forgotten = 0;
+        /// How many lines were forgotten, and where the last one ended
+        int forgotten_lines = 0;
+        size_t forgotten_line_start = 0;
+        
+        bool at_eof;
+        char c;
+        State state;
+        /// Whose attributes are being read
+        AttributesOf attributes_of;
+        /// Where the last tag started
+        const char* tag_start;
+        /// The element whose attributes are being read
+        TextView current;
+        /// The open elements
+        vector<TextView> stack;
+        /// Copies of the names in current and stack, once their input is
+        /// forgotten
+        string current_name;
+        deque<string> kept_names;
+        /// The encoding attribute of the declaration
+        string declared_encoding;
+        /// Whether the encoding is known, see start_encoding_check()
+        bool encoding_started = false;
+        /// The encoding the document is checked against
+        Encoding encoding;
+        /// How far the encoding has been checked
+        const char* checked;
+        /// The first invalid character found, if any
+        const char* invalid;
+        /// Where the last search for delimiters which ran out of input
+        /// started, which of them it searched for, and how far it got, so
+        /// it doesn't search it again, see read_until(); offsets, as they
+        /// outlive the input
+        size_t resume_from = string::npos;
+        unsigned resume_stops = 0;
+        size_t resume_at = 0;
+        /// Where the comment being read started, and where the last search
+        /// for its end started, see resume_from
+        size_t comment_from = string::npos;
+        size_t comment_at = 0;
+        
+        size_t offset_of(const char* at) const {
+            return forgotten + (at - start);
+        }
+        
+        /// Forgets the input before a point, counting its lines
+        void forget(const char* keep) {
+            for (const char* p = start; p < keep; p++) {
+                if (*p != '\n') continue;
+                forgotten_lines++;
+                forgotten_line_start = offset_of(p+1);
+            }
+            forgotten += keep - start;
+        }
+        
+        /// Reads the next token, see next()
+        bool read_token(XMLToken* token) {
+            token->value = TextView();
+            token->empty = false;
+            while (true) {
+                switch (state) {
+                    case STATE_PROLOG:
+                        // no content can be present before the root tag
+                        if (!is_whitespace(read_until<CHAR_OPEN>())) throw "content before root tag or declaration";
+                        tag_start = pos-1;
+                        read_char();
+                        if (c == '?') {
+                            // this is a declaration
+                            TextView dec_name = read_until<CHAR_BREAK | CHAR_QUESTION | CHAR_CLOSE>();
+                            if (c == '>') throw "invalid declaration";
+                            if (dec_name != "xml") throw "declaration does not start with <?xml";
+                            state = STATE_ATTRIBUTES;
+                            attributes_of = ATTRIBUTES_DECLARATION;
+                            return make_token(token, TOKEN_DECLARATION, dec_name, tag_start);
+                        }
+                        unread();
+                        start_encoding_check("");
+                        state = STATE_DOCTYPE;
+                        break;
+                    case STATE_DOCTYPE:
+                        read_char();
+                        state = STATE_ROOT;
+                        if (c == '!') {
+                            // this might be a DOCTYPE
+                            TextView name = read_until<CHAR_BREAK>();
+                            if (name != "DOCTYPE") throw "invalid root tag starting with !";
+                            TextView text = read_until<CHAR_CLOSE>();
+                            size_t offset = offset_of(tag_start);
+                            if (!is_whitespace(read_until<CHAR_OPEN>())) throw "content between doctype and root tag";
+                            tag_start = pos-1;
+                            token->type = TOKEN_DOCTYPE;
+                            token->name = text;
+                            token->offset = offset;
+                            return true;
+                        }
+                        unread();
+                        break;
+                    case STATE_ROOT: {
+                        // this is the root tag
+                        TextView element_name = read_until<CHAR_BREAK | CHAR_CLOSE>();
+                        unread();
+                        current = element_name;
+                        state = STATE_ATTRIBUTES;
+                        attributes_of = ATTRIBUTES_ROOT;
+                        return make_token(token, TOKEN_START_TAG, element_name, tag_start);
+                    }
+                    case STATE_ATTRIBUTES:
+                        read_whitespace(false);
+                        if (c == '>' || c == '/' || (attributes_of == ATTRIBUTES_DECLARATION && c == '?')) {
+                            if (end_of_attributes(token)) return true;
+                            break;
+                        } else {
+                            unread();
+                            TextView name = read_until<CHAR_BREAK | CHAR_EQUALS>();
+                            if (c != '=') throw "attribute lacks value";
+                            read_whitespace(false);
+                            if (c != '"' && c != '\'') throw "attribute value not in quotes";
+                            token->value = c == '"' ? read_until<CHAR_QUOTE>() : read_until<CHAR_APOSTROPHE>();
+                            if (attributes_of == ATTRIBUTES_DECLARATION && name == "encoding") {
+                                declared_encoding = token->value.str();
+                            }
+                            return make_token(token, TOKEN_ATTRIBUTE, name, name.data);
+                        }
+                    case STATE_CONTENT:
+                        read_whitespace(false);
+                        if (eof()) throw "early eof";
+                        unread();
+                        state = STATE_TEXT;
+                        break;
+                    case STATE_TEXT: {
+                        // read any content between tags, a line at a time
+                        TextView content = read_until<CHAR_NEWLINE | CHAR_OPEN>();
+                        while (content.length && char_is<CHAR_BREAK>(content.data[content.length-1])) {
+                            content.length--;
+                        }
+                        if (c == '<') {
+                            tag_start = pos-1;
+                            state = STATE_TAG;
+                        } else {
+                            read_whitespace(false);
+                            unread();
+                        }
+                        if (content.length) return make_token(token, TOKEN_TEXT, content, content.data);
+                        break;
+                    }
+                    case STATE_TAG:
+                        // inside a tag
+                        read_char();
+                        if (c == '!') {
+                            for (int i=0; i < 2; i++) {
+                                read_char();
+                                if (c != '-') throw "errornous tag starting with !";
+                            }
+                            // this is a comment
+                            const char* comment_start = pos;
+                            // the dashes before where it ran out of input
+                            // last time didn't end it
+                            if (offset_of(comment_start) == comment_from) pos = start + (comment_at - forgotten);
+                            comment_from = offset_of(comment_start);
+                            while (true) {
+                                comment_at = offset_of(pos);
+                                read_until<CHAR_DASH>();
+                                read_char();
+                                if (c == '-') break;
+                                unread();
+                            }
+                            TextView comment (comment_start, pos-2 - comment_start);
+                            read_char();
+                            if (c != '>') throw "errornous comment, contains --";
+                            state = STATE_CONTENT;
+                            return make_token(token, TOKEN_COMMENT, comment, tag_start);
+                        } else if (c == '/') {
+                            // this is an end tag
+                            TextView element_name = read_until<CHAR_CLOSE>();
+                            if (element_name != stack.back()) throw "mismatched end tag";
+                            stack.pop_back();
+                            if (kept_names.size() > stack.size()) kept_names.pop_back();
+                            state = stack.size() ? STATE_CONTENT : STATE_TRAILER;
+                            return make_token(token, TOKEN_END_TAG, element_name, tag_start);
+                        } else {
+                            // this is a regular element
+                            if (char_is<CHAR_NOT_NAME_START>(c)) throw "invalid first character of element name";
+                            unread();
+                            TextView element_name = read_until<CHAR_NAME_END>();
+                            if (char_is<CHAR_NOT_NAME>(c)) {
+                                throw "invalid character in element name";
+                            }
+                            unread();
+                            current = element_name;
+                            state = STATE_ATTRIBUTES;
+                            attributes_of = ATTRIBUTES_TAG;
+                            return make_token(token, TOKEN_START_TAG, element_name, tag_start);
+                        }
+                    case STATE_TRAILER:
+                        read_whitespace(true);
+                        // there must not be anything else besides the root tag
+                        if (!eof()) throw "root tag isn't alone";
+                        state = STATE_DONE;
+                        return false;
+                    case STATE_DONE:
+                        return false;
+                }
+            }
+        }
+
+        
+        bool make_token(XMLToken* token, XMLTokenType type, TextView name, const char* at) {
+            token->type = type;
+            token->name = name;
+            token->offset = offset_of(at);
+            return true;
+        }
+        
+        /// Finishes a tag after its attributes
+        /** \return True if a token was produced */
+        bool end_of_attributes(XMLToken* token) {
+            if (attributes_of == ATTRIBUTES_DECLARATION) {
+                if (c != '?') throw "invalid declaration";
+                read_char();
+                if (c != '>') throw "invalid declaration";
+                if (!is_whitespace(read_until<CHAR_OPEN>())) throw "content between declaration and doctype or root tag";
+                tag_start = pos-1;
+                start_encoding_check(declared_encoding);
+                state = STATE_DOCTYPE;
+                return false;
+            }
+            if (c == '>') {
+                stack.push_back(current);
+                state = STATE_CONTENT;
+                return false;
+            }
+            // an empty-element tag, c is /
+            read_char();
+            if (attributes_of == ATTRIBUTES_ROOT) {
+                // the root tag was empty!
+                if (c != '>') throw "incomplete empty root tag";
+                state = STATE_TRAILER;
+            } else {
+                if (c != '>') throw "characters after / in empty-element tag";
+                state = STATE_CONTENT;
+            }
+            token->empty = true;
+            return make_token(token, TOKEN_END_TAG, current, pos);
+        }
+        
+        static bool is_whitespace(TextView text) {
+            for (size_t i=0; i<text.length; i++) {
+                if (!char_is<CHAR_SPACE>(text.data[i])) return false;
+            }
+            return true;
+        }
+        
+        /// Starts checking the encoding, once the declaration has been read
+        void start_encoding_check(string name) {
+            // a token read again doesn't start it again
+            if (encoding_started) return;
+            encoding_started = true;
+            encoding = encoding_from_name(name);
+            if (encoding == ENCODING_UNCHECKED) return;
+            checked = start;
+            check_ahead();
+        }
+        
+        /// Checks the encoding of the next chunk, like XMLDocument does
+        void check_ahead() {
+            // a character cut off by the end of a piece is checked once
+            // it's whole
+            const char* until = end;
+            if (!last) until = end - checked > 3 ? end - 3 : checked;
+            while (invalid == NULL && checked <= pos && checked < until) {
+                const char* to = until - checked > ENCODING_CHUNK ? checked + ENCODING_CHUNK : until;
+                checked = check_encoding(checked, to, end, encoding, &invalid);
+            }
+            if (invalid != NULL && invalid <= pos) {
+                pos = invalid;
+                throw encoding_error(encoding);
+            }
+            if (!last && checked <= pos) throw NEEDS_INPUT;
+        }
+        
+        void read_char() {
+            if (pos < end) {
+                if (pos >= checked) check_ahead();
+                c = *pos++;
+            } else if (!last) {
+                throw NEEDS_INPUT;
+            } else {
+                at_eof = true;
+            }
+        }
+        
+        void unread() {
+            if (!at_eof && pos > start) pos--;
+        }
+        
+        bool eof() const {
+            return at_eof;
+        }
+        
+        void read_whitespace(bool eof_fine) {
+            if (eof()) {
+                if (eof_fine) return;
+                throw "early eof";
+            }
+            while (true) {
+                read_char();
+                if (!char_is<CHAR_SPACE>(c)) return;
+                if (eof()) {
+                    if (eof_fine) return;
+                    throw "early eof";
+                }
+            }
+        }
+        
+        /// Reads up to a character in some classes, which is left in c
+        /** \param Stops The classes, see CharClass */
+        template <unsigned Stops>
+        TextView read_until() {
+            if (eof()) throw "early eof";
+            const char* from = pos;
+            // the same search was already made up to where the input ran out
+            if (offset_of(from) == resume_from && Stops == resume_stops) pos = start + (resume_at - forgotten);
+            try {
+                while (true) {
+                    read_char();
+                    if (eof()) throw "early eof";
+                    if (char_is<Stops>(c)) return TextView(from, pos-1 - from);
+                }
+            } catch (char const* message) {
+                if (message == NEEDS_INPUT) {
+                    resume_from = offset_of(from);
+                    resume_stops = Stops;
+                    resume_at = offset_of(pos);
+                }
+                throw;
+            }
+        }
+};
+
+constexpr const char* XMLTokenizer::NEEDS_INPUT;
+
+/// Checks whether a document is well-formed, without building a tree
+/** \param data The document
+ *  \param length The length of the document
+ *  \param offset Where to put the byte offset of the error, see LineIndex
+ *  \return NULL if the document is fine, an error message otherwise */
+inline const char* validate(const char* data, size_t length, size_t* offset) {
+    XMLTokenizer tokenizer (data, length);
+    XMLToken token;
+    try {
+        while (tokenizer.next(&token));
+    } catch (char const* message) {
+        *offset = tokenizer.offset();
+        return message;
+    }
+    return NULL;
+}
+
+/// Checks whether a document read from a stream is well-formed
+/** Like validate(), but the stream is read and tokenized a piece at a time,
+ *  so only the token being read is in memory however long it is.  A read
+ *  error ends the document.
+ *  \param file The stream, read to its end
+ *  \param line Where to put the line of the error, counted from 1
+ *  \param column Where to put the column of the error, in bytes from 1
+ *  \param offset Where to put the byte offset of the error
+ *  \return NULL if the document is fine, an error message otherwise */
+inline const char* validate_stream(FILE* file, int* line, int* column, size_t* offset) {
+    XMLTokenizer tokenizer;
+    XMLToken token;
+    vector<char> piece (TOKENIZER_READ_CHUNK);
+    try {
+        while (true) {
+            while (tokenizer.next(&token));
+            if (!tokenizer.needs_input()) break;
+            size_t got = fread(piece.data(), 1, piece.size(), file);
+            if (got == 0) tokenizer.finish();
+            else tokenizer.feed(piece.data(), got);
+        }
+    } catch (char const* message) {
+        *offset = tokenizer.offset();
+        *line = tokenizer.line();
+        *column = tokenizer.column();
+        return message;
+    }
+    return NULL;
+}
+
+#endif
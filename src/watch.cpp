@@ -0,0 +1,181 @@
+/** \file watch.cpp
+ *  Noticing when the file being edited is changed by someone else.
+ *  \author David Labský <labskdav@fit.cvut.cz> */
+
+#ifndef SUXML_WATCH_CPP
+#define SUXML_WATCH_CPP
+
+#include <algorithm>
+#include <cerrno>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+using namespace std;
+
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "xml.cpp"
+
+/// How long the editor waits for a key before looking for changes, in ms
+#define WATCH_INTERVAL 200
+/// How long to wait for more writes before reading a changed file, in ms
+#define WATCH_SETTLE 50
+
+/// A change of the watched file, see FileWatcher
+struct FileChange {
+    /// The new contents of the file
+    shared_ptr<const string> contents;
+    /// How many bytes at the start are the same as before
+    size_t prefix = 0;
+    /// How many bytes at the end are the same as before, not overlapping
+    /// the prefix
+    size_t suffix = 0;
+};
+
+/// Watches a file with inotify
+/** The file's directory is watched rather than the file, so files replaced
+ *  by renaming another over them, as most editors and tools save, are
+ *  noticed too.  A thread reads the file when it changes and compares it
+ *  with the contents last taken, so taking a change is instant.
+ */
+class FileWatcher {
+    public:
+        /// Reads the file and starts watching it
+        /** A file which doesn't exist yet is empty until it's created. */
+        FileWatcher(string filename) : filename(filename), pending(false), stop_pipe{-1, -1} {
+            size_t slash = filename.rfind('/');
+            string directory = slash == string::npos ? "." : filename.substr(0, slash+1);
+            name = slash == string::npos ? filename : filename.substr(slash+1);
+            inotify = inotify_init1(IN_CLOEXEC);
+            if (inotify >= 0) {
+                inotify_add_watch(inotify, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+            }
+            // the contents are read once watching, so no change is missed
+            current = read_contents();
+            if (inotify >= 0 && pipe(stop_pipe) == 0) {
+                watcher = thread(&FileWatcher::watch, this);
+            }
+        }
+
+        ~FileWatcher() {
+            if (watcher.joinable()) {
+                char stop = 0;
+                if (write(stop_pipe[1], &stop, 1) != 1) {}
+                watcher.join();
+            }
+            if (stop_pipe[0] >= 0) close(stop_pipe[0]);
+            if (stop_pipe[1] >= 0) close(stop_pipe[1]);
+            if (inotify >= 0) close(inotify);
+        }
+
+        /// The contents of the file, as of the last change taken
+        shared_ptr<const string> contents() {
+            lock_guard<mutex> lock (changes_lock);
+            return current;
+        }
+
+        /// Takes the change of the file, if there's been any
+        /** The change is compared with the contents of the last one taken.
+         *  \return Whether there was a change */
+        bool take(FileChange* change) {
+            lock_guard<mutex> lock (changes_lock);
+            if (!pending) return false;
+            *change = latest;
+            current = latest.contents;
+            pending = false;
+            return true;
+        }
+
+        /// Tells the watcher the file was written by us
+        /** The file is read again, so writing it isn't taken as a change. */
+        void saved() {
+            shared_ptr<const string> contents = read_contents();
+            lock_guard<mutex> lock (changes_lock);
+            current = contents;
+            pending = false;
+        }
+    private:
+        string filename;
+        /// The filename without the directory, as inotify reports it
+        string name;
+        int inotify;
+        thread watcher;
+
+        mutex changes_lock;
+        shared_ptr<const string> current;
+        bool pending;
+        FileChange latest;
+        /// Written to when the watcher should stop
+        int stop_pipe[2];
+
+        shared_ptr<const string> read_contents() {
+            try {
+                SourceFile source (filename);
+                return make_shared<const string>(source.data(), source.length());
+            } catch (char const* message) {
+                return make_shared<const string>();
+            }
+        }
+
+        /// Waits for events about the file
+        /** Signals landing on the thread don't stop it, only the stop pipe
+         *  or an error does.
+         *  \return Whether the file changed, false when stopping */
+        bool wait_for_event(int timeout) {
+            pollfd fds[2] = {{inotify, POLLIN, 0}, {stop_pipe[0], POLLIN, 0}};
+            bool changed = false;
+            while (true) {
+                int ready = poll(fds, 2, timeout);
+                if (ready < 0 && errno == EINTR) continue;
+                if (ready <= 0) break;
+                if (fds[1].revents) return false;
+                alignas(inotify_event) char buffer[4096];
+                ssize_t got = read(inotify, buffer, sizeof(buffer));
+                if (got < 0 && errno == EINTR) continue;
+                if (got <= 0) return false;
+                for (char* p = buffer; p < buffer + got; ) {
+                    inotify_event* event = (inotify_event*)p;
+                    if (event->len && name == event->name) changed = true;
+                    p += sizeof(inotify_event) + event->len;
+                }
+                if (changed) return true;
+            }
+            return changed;
+        }
+
+        void watch() {
+            while (wait_for_event(-1)) {
+                // wait for the writes to settle, so the file is whole
+                while (wait_for_event(WATCH_SETTLE)) {}
+                shared_ptr<const string> contents = read_contents();
+                while (!compare(contents)) {}
+            }
+        }
+
+        /// Makes the contents the latest change, if they changed
+        /** \return False if the contents taken changed meanwhile, so it
+         *  has to be compared again */
+        bool compare(shared_ptr<const string> contents) {
+            shared_ptr<const string> taken = this->contents();
+            const string& before = *taken;
+            const string& after = *contents;
+            size_t shorter = before.length() < after.length() ? before.length() : after.length();
+            size_t prefix = mismatch(before.begin(), before.begin() + shorter, after.begin()).first
+                - before.begin();
+            size_t suffix = mismatch(before.rbegin(), before.rbegin() + (shorter - prefix), after.rbegin()).first
+                - before.rbegin();
+            lock_guard<mutex> lock (changes_lock);
+            if (current != taken) return false;
+            // a change which was undone is no change
+            pending = before.length() != after.length() || prefix != shorter;
+            latest.contents = contents;
+            latest.prefix = prefix;
+            latest.suffix = suffix;
+            return true;
+        }
+};
+
+#endif
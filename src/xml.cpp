@@ -2,15 +2,40 @@
  *  Implementation of XML classes.
  *  \author David Labský <labskdav@fit.cvut.cz> */
 
+#ifndef SUXML_XML_CPP
+#define SUXML_XML_CPP
+
+#include <algorithm>
 #include <cassert>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
 #include <cstring>
+#include <deque>
+#include <fstream>
 #include <iostream>
+#include <map>
+#include <sstream>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 using namespace std;
 
-#define UNREAD() in->seekg(-1, ios::cur)
-#define READ_CHAR() in->read((char*)&c, 1)
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "parallel.cpp"
+
+#define UNREAD() unread()
+#define READ_CHAR() read_char()
 
 #define WHITESPACE " \t\n"
 #define INVALID_ELEMENT_FIRST_CHARS "-.0123456789"
@@ -19,26 +44,809 @@ using namespace std;
 
 #define DEBUG(...) printf("\x1b[33m[%3d] ", __LINE__); printf(__VA_ARGS__); printf("\x1b[39;49m")
 
+/// Classes of characters, which char_classes has for every byte
+/** A character can be in several.  Scanners are templated on the classes
+ *  they stop at, so checking a character is a table lookup and a mask. */
+enum CharClass {
+    /// Whitespace as isspace() sees it in the C locale
+    CHAR_SPACE = 1 << 0,
+    /// Whitespace which ends names, see WHITESPACE
+    CHAR_BREAK = 1 << 1,
+    /// Can't start an element name, see INVALID_ELEMENT_FIRST_CHARS; nor
+    /// can a NUL
+    CHAR_NOT_NAME_START = 1 << 2,
+    /// Can't be in an element name, see INVALID_ELEMENT_CHARS
+    CHAR_NOT_NAME = 1 << 3,
+    /// The delimiters of markup, each a class of its own
+    CHAR_OPEN = 1 << 4,
+    CHAR_CLOSE = 1 << 5,
+    CHAR_SLASH = 1 << 6,
+    CHAR_QUESTION = 1 << 7,
+    CHAR_EQUALS = 1 << 8,
+    CHAR_DASH = 1 << 9,
+    CHAR_NEWLINE = 1 << 10,
+    /// The quotes around attribute values
+    CHAR_QUOTE = 1 << 11,
+    CHAR_APOSTROPHE = 1 << 12,
+    /// What ends an element name
+    CHAR_NAME_END = CHAR_BREAK | CHAR_NOT_NAME | CHAR_CLOSE | CHAR_SLASH
+};
+
+/// Whether a character is in a string, at compile time
+constexpr bool char_in(unsigned char c, const char* chars) {
+    return *chars != 0 && ((unsigned char)*chars == c || char_in(c, chars+1));
+}
+
+/// The classes of a character, see CharClass
+constexpr unsigned short classify_char(unsigned char c) {
+    return (char_in(c, " \t\n\v\f\r") ? CHAR_SPACE : 0)
+        | (char_in(c, WHITESPACE) ? CHAR_BREAK : 0)
+        | (c == 0 || char_in(c, INVALID_ELEMENT_FIRST_CHARS) ? CHAR_NOT_NAME_START : 0)
+        | (char_in(c, INVALID_ELEMENT_CHARS) ? CHAR_NOT_NAME : 0)
+        | (c == '<' ? CHAR_OPEN : 0)
+        | (c == '>' ? CHAR_CLOSE : 0)
+        | (c == '/' ? CHAR_SLASH : 0)
+        | (c == '?' ? CHAR_QUESTION : 0)
+        | (c == '=' ? CHAR_EQUALS : 0)
+        | (c == '-' ? CHAR_DASH : 0)
+        | (c == '\n' ? CHAR_NEWLINE : 0)
+        | (c == '"' ? CHAR_QUOTE : 0)
+        | (c == '\'' ? CHAR_APOSTROPHE : 0);
+}
+
+#define CHAR_CLASSES_4(c) classify_char(c), classify_char(c+1), classify_char(c+2), classify_char(c+3)
+#define CHAR_CLASSES_16(c) CHAR_CLASSES_4(c), CHAR_CLASSES_4(c+4), CHAR_CLASSES_4(c+8), CHAR_CLASSES_4(c+12)
+#define CHAR_CLASSES_64(c) CHAR_CLASSES_16(c), CHAR_CLASSES_16(c+16), CHAR_CLASSES_16(c+32), CHAR_CLASSES_16(c+48)
+
+/// The classes of every byte, made at compile time
+constexpr unsigned short char_classes[256] = {
+    CHAR_CLASSES_64(0), CHAR_CLASSES_64(64), CHAR_CLASSES_64(128), CHAR_CLASSES_64(192)
+};
+
+/// Whether a character is in any of some classes
+/** \param Classes The classes, see CharClass */
+template <unsigned Classes>
+inline bool char_is(char c) {
+    return char_classes[(unsigned char)c] & Classes;
+}
+
 /// Verify whether a string is only whitespace
 /** \return True if string is only whitespace */
-bool is_whitespace(string s) {
+inline bool is_whitespace(const string& s) {
     for (char c : s) {
-        if (!isspace(c)) return false;
+        if (!char_is<CHAR_SPACE>(c)) return false;
     }
     return true;
 }
 
-/// Check if the string contains a specified character
-/** \return True if one of the chars is present */
-int any_char_in_string(string s, string chars) {
-    for (char c : chars) {
-        if (s.find(c) != string::npos) return s.find(c);
+/// Finds the first character of a string in some classes
+/** \param Classes The classes, see CharClass
+ *  \return Where the character is, or -1 if there's none */
+template <unsigned Classes>
+inline int find_char(const string& s) {
+    for (size_t i=0; i<s.length(); i++) {
+        if (char_is<Classes>(s[i])) return i;
     }
     return -1;
 }
 
+/// About how many nodes XMLTag::map_children() gives a single task
+#define PARALLEL_CHUNK 4096
+
+/// How far LineIndex scans at once when looking for a line
+#define LINE_INDEX_CHUNK 1048576
+
+/// How much of the document is checked for invalid characters at once
+/** The parser checks the encoding a chunk ahead of itself, so the chunk is
+ *  still in the cache when it gets parsed. */
+#define ENCODING_CHUNK 16384
+
+/// Encodings suxml can check documents against
+enum Encoding { ENCODING_UNCHECKED, ENCODING_UTF8, ENCODING_ASCII };
+
+/// Find out which encoding to check, from the declaration's encoding
+/** Documents without an encoding are UTF-8.  Other encodings aren't
+ *  checked, since most bytes are valid in them.
+ *  \return The encoding to check */
+inline Encoding encoding_from_name(string name) {
+    transform(name.begin(), name.end(), name.begin(), ::tolower);
+    if (name == "" || name == "utf-8" || name == "utf8") return ENCODING_UTF8;
+    if (name == "us-ascii" || name == "ascii") return ENCODING_ASCII;
+    return ENCODING_UNCHECKED;
+}
+
+/// The message for an invalid character in an encoding
+inline const char* encoding_error(Encoding encoding) {
+    if (encoding == ENCODING_ASCII) return "non-ASCII character in US-ASCII document";
+    return "invalid UTF-8 sequence";
+}
+
+/// Check that text is valid UTF-8, or ASCII
+/** Checks the characters starting between from and to; the last one may
+ *  continue past to, up to end.  Runs of ASCII, which most markup is, are
+ *  skipped 16 bytes at a time.  Overlong forms, surrogates and characters
+ *  above U+10FFFF are invalid, as RFC 3629 says.
+ *
+ *  \param from Where to start checking, at the start of a character
+ *  \param to Where to stop checking
+ *  \param end The end of the text
+ *  \param encoding ENCODING_UTF8 or ENCODING_ASCII
+ *  \param invalid Set to the first invalid character, if there is one
+ *  \return Where the check got to, at the start of a character */
+inline const char* check_encoding(const char* from, const char* to, const char* end,
+        Encoding encoding, const char** invalid) {
+    const unsigned char* p = (const unsigned char*)from;
+    const unsigned char* stop = (const unsigned char*)to;
+    const unsigned char* limit = (const unsigned char*)end;
+    while (p < stop) {
+#ifdef __SSE2__
+        while (p + 16 <= stop && _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)p)) == 0) {
+            p += 16;
+        }
+#else
+        unsigned long long word;
+        while (p + 8 <= stop && (memcpy(&word, p, 8), (word & 0x8080808080808080ULL) == 0)) {
+            p += 8;
+        }
+#endif
+        if (p >= stop) break;
+        unsigned char b = *p;
+        if (b < 0x80) {
+            p++;
+            continue;
+        }
+        int length = 0;
+        if (encoding == ENCODING_ASCII) length = 0;
+        else if (b >= 0xc2 && b <= 0xdf) length = 2;
+        else if ((b & 0xf0) == 0xe0) length = 3;
+        else if (b >= 0xf0 && b <= 0xf4) length = 4;
+        bool valid = length && p + length <= limit;
+        for (int i=1; valid && i<length; i++) {
+            if ((p[i] & 0xc0) != 0x80) valid = false;
+        }
+        if (valid && b == 0xe0 && p[1] < 0xa0) valid = false;
+        if (valid && b == 0xed && p[1] >= 0xa0) valid = false;
+        if (valid && b == 0xf0 && p[1] < 0x90) valid = false;
+        if (valid && b == 0xf4 && p[1] >= 0x90) valid = false;
+        if (!valid) {
+            *invalid = (const char*)p;
+            return (const char*)p;
+        }
+        p += length;
+    }
+    return (const char*)p;
+}
+
+/// Compressed formats suxml can read and write
+/** Compression is done by piping through the gzip and zstd tools, which
+ *  then run alongside suxml. */
+enum Compression { COMPRESSION_NONE, COMPRESSION_GZIP, COMPRESSION_ZSTD };
+
+/// Guess the compression of a file from its name
+/** \return The compression matching the extension */
+inline Compression compression_from_name(string filename) {
+    size_t dot = filename.rfind('.');
+    if (dot == string::npos) return COMPRESSION_NONE;
+    string ext = filename.substr(dot);
+    if (ext == ".gz") return COMPRESSION_GZIP;
+    if (ext == ".zst") return COMPRESSION_ZSTD;
+    return COMPRESSION_NONE;
+}
+
+/// Recognize a compressed file from its first bytes
+/** \return The compression matching the magic bytes */
+inline Compression compression_from_magic(const char* data, size_t length) {
+    const unsigned char* d = (const unsigned char*)data;
+    if (length >= 2 && d[0] == 0x1f && d[1] == 0x8b) return COMPRESSION_GZIP;
+    if (length >= 4 && d[0] == 0x28 && d[1] == 0xb5 && d[2] == 0x2f && d[3] == 0xfd) {
+        return COMPRESSION_ZSTD;
+    }
+    return COMPRESSION_NONE;
+}
+
+/// Build the shell command (de)compressing through a pipe
+/** \param compression The compression to use
+ *  \param filename The compressed file
+ *  \param decompress Whether to decompress from the file, otherwise
+ *      compress into it
+ *  \return The command to give to popen() */
+inline string compression_command(Compression compression, string filename, bool decompress) {
+    // quote the filename for the shell
+    string quoted = "'";
+    for (char c : filename) {
+        if (c == '\'') quoted += "'\\''";
+        else quoted += c;
+    }
+    quoted += "'";
+    string tool = compression == COMPRESSION_GZIP ? "gzip" : "zstd -q";
+    if (decompress) return tool + " -dc -- " + quoted;
+    return tool + " -c > " + quoted;
+}
+
+/// The source bytes of a document, loaded from a file
+/** Plain files are memory-mapped, compressed files are decompressed into
+ *  memory, and the filename - reads stdin.  Pipes and other files which
+ *  can't be mapped are read into memory as they are, like stdin.  The
+ *  constructor throws "cannot open file" or "cannot decompress file".
+ */
+class SourceFile {
+    public:
+        SourceFile(string filename) : mapped(NULL), mapped_length(0) {
+            if (filename == "-") {
+                ostringstream out;
+                out << cin.rdbuf();
+                buffer = out.str();
+                return;
+            }
+            int fd = open(filename.c_str(), O_RDONLY);
+            if (fd < 0) throw "cannot open file";
+            struct stat info;
+            if (fstat(fd, &info) < 0 || S_ISDIR(info.st_mode)) {
+                close(fd);
+                throw "cannot open file";
+            }
+            if (!S_ISREG(info.st_mode)) {
+                bool read = read_all(fd);
+                close(fd);
+                if (!read) throw "cannot open file";
+                return;
+            }
+            if (info.st_size > 0) {
+                void* map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (map != MAP_FAILED) {
+                    mapped = (const char*)map;
+                    mapped_length = info.st_size;
+                }
+            }
+            close(fd);
+            if (mapped == NULL && info.st_size > 0) throw "cannot open file";
+            
+            // compressed files are recognized by their first bytes, or
+            // by their extension if they're too short to tell
+            Compression compression = compression_from_magic(mapped, mapped_length);
+            if (compression == COMPRESSION_NONE && mapped_length < 4) {
+                compression = compression_from_name(filename);
+            }
+            if (compression != COMPRESSION_NONE) {
+                unmap();
+                read_decompressed(compression, filename);
+            }
+        }
+        ~SourceFile() {
+            unmap();
+        }
+        
+        /// The contents of the file
+        const char* data() const {
+            return mapped ? mapped : buffer.data();
+        }
+        /// The length of the contents in bytes
+        size_t length() const {
+            return mapped ? mapped_length : buffer.length();
+        }
+    private:
+        SourceFile(const SourceFile&);
+        SourceFile& operator=(const SourceFile&);
+        
+        const char* mapped;
+        size_t mapped_length;
+        string buffer;
+        
+        void unmap() {
+            if (mapped) munmap((void*)mapped, mapped_length);
+            mapped = NULL;
+            mapped_length = 0;
+        }
+        
+        /// Read a file which can't be mapped, such as a pipe, into buffer
+        /** \return Whether it was read to the end */
+        bool read_all(int fd) {
+            char buf[65536];
+            while (true) {
+                ssize_t got = ::read(fd, buf, sizeof(buf));
+                if (got < 0 && errno == EINTR) continue;
+                if (got < 0) return false;
+                if (got == 0) return true;
+                buffer.append(buf, got);
+            }
+        }
+        
+        /// Read a compressed file through the decompressing tool
+        void read_decompressed(Compression compression, string filename) {
+            FILE* pipe = popen(compression_command(compression, filename, true).c_str(), "r");
+            if (pipe == NULL) throw "cannot decompress file";
+            char buf[65536];
+            size_t got;
+            while ((got = fread(buf, 1, sizeof(buf), pipe)) > 0) {
+                buffer.append(buf, got);
+            }
+            if (pclose(pipe) != 0) throw "cannot decompress file";
+        }
+};
+
+/// Where the lines of a document start
+/** Maps byte offsets to lines and columns and back, for reporting errors
+ *  and jumping to a line.  The newlines are found with memchr(), which is
+ *  vectorized, and only as far as a query needs, unless build() is called.
+ *  Lines and columns are counted from 1.
+ */
+class LineIndex {
+    public:
+        LineIndex() : data(NULL), length(0), scanned(0) {};
+        LineIndex(const char* data, size_t length) : data(data), length(length), scanned(0) {};
+        
+        /// Starts indexing another buffer, forgetting the old one
+        void reset(const char* data_, size_t length_) {
+            data = data_;
+            length = length_;
+            scanned = 0;
+            newlines.clear();
+        }
+        
+        /// Indexes the whole buffer now
+        void build() {
+            scan_to(length);
+        }
+        
+        /// Stops referring to the buffer, so it can be freed
+        /** Only what has already been indexed can be asked for afterwards. */
+        void detach() {
+            data = NULL;
+            length = scanned;
+        }
+        
+        /// The line an offset is on
+        int line_of(size_t offset) {
+            scan_to(offset);
+            return lower_bound(newlines.begin(), newlines.end(), offset) - newlines.begin() + 1;
+        }
+        
+        /// The column an offset is on, in bytes
+        int column_of(size_t offset) {
+            int line = line_of(offset);
+            return offset - line_start(line) + 1;
+        }
+        
+        /// The offset a line starts at
+        /** \return The offset, or the end of the buffer for lines past it */
+        size_t offset_of(int line) {
+            while ((int)newlines.size() < line-1 && scanned < length) {
+                scan_to(scanned + LINE_INDEX_CHUNK < length ? scanned + LINE_INDEX_CHUNK : length);
+            }
+            if (line <= 1) return 0;
+            if ((int)newlines.size() < line-1) return length;
+            return line_start(line);
+        }
+        
+        /// How much memory the index uses
+        size_t bytes() const {
+            return newlines.capacity() * sizeof(size_t);
+        }
+    private:
+        const char* data;
+        size_t length;
+        /// How far the buffer has been indexed
+        size_t scanned;
+        /// Offsets of the newlines found so far
+        vector<size_t> newlines;
+        
+        size_t line_start(int line) const {
+            return line > 1 ? newlines[line-2] + 1 : 0;
+        }
+        
+        void scan_to(size_t offset) {
+            if (offset > length) offset = length;
+            if (data == NULL || offset <= scanned) return;
+            const char* p = data + scanned;
+            const char* stop = data + offset;
+            while ((p = (const char*)memchr(p, '\n', stop-p)) != NULL) {
+                newlines.push_back(p - data);
+                p++;
+            }
+            scanned = offset;
+        }
+};
+
+/// A substring matcher for searching through the document text
+/** Uses the Boyer-Moore-Horspool algorithm; the skip table is built once
+ *  per search and reused for every string in the document.
+ */
+class TextSearch {
+    public:
+        /// The string being searched for
+        string needle;
+        
+        TextSearch(string needle) : needle(needle) {
+            size_t len = needle.length();
+            for (int i=0; i<256; i++) skip[i] = len;
+            for (size_t i=0; i+1 < len; i++) {
+                skip[(unsigned char)needle[i]] = len-1-i;
+            }
+        }
+        
+        /// Check whether the needle is present in a string
+        /** \return True if haystack contains the needle */
+        bool in(const string& haystack) const {
+            return in(haystack.data(), haystack.length());
+        }
+        /// Check whether the needle is present in a piece of a string
+        /** \return True if the length bytes at h contain the needle */
+        bool in(const char* h, size_t length) const {
+            size_t len = needle.length();
+            if (len == 0) return false;
+            if (length < len) return false;
+            const char* n = needle.data();
+            if (len == 1) return memchr(h, n[0], length) != NULL;
+            unsigned char last = n[len-1];
+            size_t end = length - len;
+            size_t pos = 0;
+            while (pos <= end) {
+                unsigned char c = h[pos+len-1];
+                if (c == last && memcmp(h+pos, n, len-1) == 0) return true;
+                pos += skip[c];
+            }
+            return false;
+        }
+    private:
+        size_t skip[256];
+};
+
+/// A path of elements, for picking nodes out of a document
+/** A single name matches elements of that name at any depth.  A path of
+ *  names separated by /, like catalog/item, is followed from the root; a
+ *  leading / is allowed.  A * step matches any element.  Comments and text
+ *  are named #comment and #text, which * doesn't match.
+ */
+class ElementPath {
+    public:
+        ElementPath(string path) : anywhere(path.find('/') == string::npos) {
+            if (path.length() && path[0] == '/') path.erase(0, 1);
+            size_t start = 0;
+            while (true) {
+                size_t slash = path.find('/', start);
+                steps.push_back(path.substr(start, slash - start));
+                if (slash == string::npos) break;
+                start = slash+1;
+            }
+        }
+        
+        /// Whether the path is usable
+        bool valid() const {
+            for (const string& step : steps) {
+                if (step.length() == 0) return false;
+            }
+            return true;
+        }
+        
+        /// Whether a node is on the path
+        /** \param depth How deep the node is, the root being 1
+         *  \param name The element, or #comment or #text
+         *  \param parents_match Whether the path leads to the parent */
+        template <typename Name>
+        bool matches(size_t depth, const Name& name, bool parents_match) const {
+            if (anywhere) return step_matches(steps[0], name);
+            return parents_match && depth == steps.size() && step_matches(steps[depth-1], name);
+        }
+        
+        /// Whether an element is on the way to nodes on the path
+        template <typename Name>
+        bool leads_to(size_t depth, const Name& name, bool parents_match) const {
+            return parents_match && depth < steps.size() && step_matches(steps[depth-1], name);
+        }
+    private:
+        bool anywhere;
+        vector<string> steps;
+        
+        template <typename Name>
+        static bool step_matches(const string& step, const Name& name) {
+            if (step == "*") return !(name == "#comment" || name == "#text");
+            return name == step.c_str();
+        }
+};
+
+/// Whether a string can be an element or attribute name
+inline bool is_valid_name(const string& name) {
+    if (name.length() == 0) return false;
+    if (char_is<CHAR_NOT_NAME_START>(name[0])) return false;
+    return find_char<CHAR_NAME_END>(name) == -1;
+}
+
+/// What a BulkEdit does to every node it's applied to
+enum BulkOperation { BULK_RENAME, BULK_DELETE, BULK_SET, BULK_UNSET, BULK_WRAP, BULK_UNWRAP };
+
+/// An edit applied to many nodes at once, see XMLDocument::bulk_edit()
+class BulkEdit {
+    public:
+        /// Parses an edit
+        /** One of rename NAME, delete, set ATTRIBUTE VALUE, unset ATTRIBUTE,
+         *  wrap NAME or unwrap.  The value may contain spaces.  Throws an
+         *  error message if the edit doesn't make sense. */
+        BulkEdit(string edit) {
+            size_t space = edit.find(' ');
+            string command = edit.substr(0, space);
+            string rest = space == string::npos ? "" : edit.substr(space+1);
+            if (command == "delete" || command == "unwrap") {
+                operation = command == "delete" ? BULK_DELETE : BULK_UNWRAP;
+                if (rest.length()) throw "the edit takes no arguments";
+                return;
+            }
+            if (command == "set") {
+                operation = BULK_SET;
+                space = rest.find(' ');
+                if (space == string::npos) throw "set needs an attribute and a value";
+                value = rest.substr(space+1);
+                rest = rest.substr(0, space);
+                if (value.find('"') != string::npos) throw "attribute values can't contain \"";
+            } else if (command == "rename") {
+                operation = BULK_RENAME;
+            } else if (command == "unset") {
+                operation = BULK_UNSET;
+            } else if (command == "wrap") {
+                operation = BULK_WRAP;
+            } else {
+                throw "unknown edit, expected rename, delete, set, unset, wrap or unwrap";
+            }
+            if (!is_valid_name(rest)) throw "invalid name";
+            name = rest;
+        }
+        
+        BulkOperation operation;
+        /// The element or attribute name
+        string name;
+        /// The attribute value
+        string value;
+        
+        /// Whether the edit works on text and comments, not just tags
+        bool applies_to_any_node() const {
+            return operation == BULK_DELETE || operation == BULK_WRAP;
+        }
+};
+
+/// Quote a string for JSON output
+/** \return The string in double quotes, with special characters escaped */
+inline string json_string(const string& s) {
+    string out = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (c == '\n') {
+            out += "\\n";
+        } else if (c == '\t') {
+            out += "\\t";
+        } else if ((unsigned char)c < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out += escaped;
+        } else {
+            out += c;
+        }
+    }
+    return out + "\"";
+}
+
+/// FNV-1a, with the bits mixed up afterwards
+inline uint64_t hash_bytes(const char* data, size_t length) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i=0; i<length; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ULL;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+inline uint64_t hash_bytes(const string& s) {
+    return hash_bytes(s.data(), s.length());
+}
+
+/// Adds a hash to a hash of what came before it
+/** The order hashes are combined in matters. */
+inline uint64_t combine_hashes(uint64_t seed, uint64_t hash) {
+    return seed ^ (hash + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2));
+}
+
+/// Memory used by a group of objects, see HeapCensus
+struct CensusEntry {
+    /// How many objects there are
+    long long count = 0;
+    /// Bytes of the objects themselves
+    long long object_bytes = 0;
+    /// Bytes of children vectors
+    long long children_bytes = 0;
+    /// Bytes of attribute vectors
+    long long attribute_bytes = 0;
+    /// Bytes of string buffers on the heap
+    long long string_bytes = 0;
+    /// How much of the vectors and strings is allocated but unused
+    long long slack_bytes = 0;
+    /// Bytes of whole subtrees, for elements
+    long long subtree_bytes = 0;
+    
+    /// All the memory used, not counting subtrees
+    long long bytes() const {
+        return object_bytes + children_bytes + attribute_bytes + string_bytes;
+    }
+    
+    void add(const CensusEntry& other) {
+        count += other.count;
+        object_bytes += other.object_bytes;
+        children_bytes += other.children_bytes;
+        attribute_bytes += other.attribute_bytes;
+        string_bytes += other.string_bytes;
+        slack_bytes += other.slack_bytes;
+        subtree_bytes += other.subtree_bytes;
+    }
+    
+    /// Adds a string's heap buffer, if it has one
+    void add_string(const string& s) {
+        // short strings live inside the string object itself
+        const char* inside = (const char*)&s;
+        if (s.data() >= inside && s.data() < inside + sizeof(s)) return;
+        string_bytes += s.capacity() + 1;
+        slack_bytes += s.capacity() - s.length();
+    }
+    
+    /// The entry as a JSON object, with a name field first
+    string to_json(string name_field, string name) const {
+        ostringstream out;
+        out << "{" << json_string(name_field) << ": " << json_string(name)
+            << ", \"count\": " << count << ", \"bytes\": " << bytes()
+            << ", \"object_bytes\": " << object_bytes
+            << ", \"children_bytes\": " << children_bytes
+            << ", \"attribute_bytes\": " << attribute_bytes
+            << ", \"string_bytes\": " << string_bytes
+            << ", \"slack_bytes\": " << slack_bytes;
+        if (subtree_bytes) out << ", \"subtree_bytes\": " << subtree_bytes;
+        out << "}";
+        return out.str();
+    }
+};
+
 class XMLNode;
 
+/// A census of the heap memory used by a document
+/** Filled in by XMLDocument::census().  Memory is totalled by node type and
+ *  by element name; allocator overhead isn't counted.
+ */
+class HeapCensus {
+    public:
+        /// Memory by node type
+        map<string, CensusEntry> types;
+        /// Memory of tags by element name; subtree_bytes includes everything
+        /// inside those tags (nested tags of the same name count twice)
+        map<string, CensusEntry> elements;
+        /// Memory of the editor's lines
+        CensusEntry editor_lines;
+        /// The shared nodes counted, which are only counted once
+        /** See XMLNode::refs. */
+        unordered_set<const XMLNode*> shared;
+        
+        /// Adds another census to this one
+        void add(const HeapCensus& other) {
+            for (auto& entry : other.types) types[entry.first].add(entry.second);
+            for (auto& entry : other.elements) elements[entry.first].add(entry.second);
+            editor_lines.add(other.editor_lines);
+            shared.insert(other.shared.begin(), other.shared.end());
+        }
+        
+        /// The total memory used by the nodes
+        long long node_bytes() const {
+            long long total = 0;
+            for (auto& entry : types) total += entry.second.bytes();
+            return total;
+        }
+        
+        /// The census as JSON
+        /** Types and elements are listed from the biggest. */
+        string to_json() const {
+            ostringstream out;
+            out << "{\n  \"node_bytes\": " << node_bytes() << ",\n";
+            out << "  \"types\": [\n" << sorted_json("type", types) << "  ],\n";
+            out << "  \"elements\": [\n" << sorted_json("element", elements) << "  ],\n";
+            out << "  \"editor_lines\": " << editor_lines.to_json("name", "EditorLine") << "\n";
+            out << "}\n";
+            return out.str();
+        }
+    private:
+        static string sorted_json(string name_field, const map<string, CensusEntry>& entries) {
+            vector<pair<long long, string> > order;
+            for (auto& entry : entries) {
+                order.push_back(make_pair(-entry.second.bytes(), entry.first));
+            }
+            sort(order.begin(), order.end());
+            string out = "";
+            for (size_t i=0; i<order.size(); i++) {
+                out += "    " + entries.at(order[i].second).to_json(name_field, order[i].second);
+                out += i+1 < order.size() ? ",\n" : "\n";
+            }
+            return out;
+        }
+};
+
+/// Tab-indented output, a node per line, see XMLDocument::to_str()
+/** Output styles are policies the writers are instantiated for, so the
+ *  style is only chosen once per document. */
+struct PrettyStyle {
+    /// Whether nodes go on lines of their own, indented
+    static const bool indented = true;
+    /// Whether elements with only a short text stay on one line
+    static const bool inline_text = false;
+};
+
+/// Like PrettyStyle, but elements with only a short text stay on one line
+struct CompactStyle {
+    static const bool indented = true;
+    static const bool inline_text = true;
+};
+
+/// No whitespace between nodes, besides newlines between lines of text
+struct MinifiedStyle {
+    static const bool indented = false;
+    static const bool inline_text = false;
+};
+
+/// The output styles, for choosing one at runtime
+enum OutputStyle { OUTPUT_PRETTY, OUTPUT_COMPACT, OUTPUT_MINIFIED };
+
+/// How long an element on one line can be in CompactStyle
+#define COMPACT_LINE_LENGTH 80
+
+/// Implements XMLNode::write() for every style, with a write_as() template
+#define WRITE_STYLES \
+    void write(string* out, int depth, PrettyStyle style) const { write_as(out, depth, style); } \
+    void write(string* out, int depth, CompactStyle style) const { write_as(out, depth, style); } \
+    void write(string* out, int depth, MinifiedStyle style) const { write_as(out, depth, style); }
+
+/// How much output XMLDocument::save() collects before writing it, in bytes
+#define SAVE_CHUNK 1048576
+
+/// Output which is written to a file while it's being made
+/** While one is open, tags writing into its string hand it over after each
+ *  child, so only about SAVE_CHUNK of the output is in memory at once.  Only
+ *  the thread which opened it does; the pieces other threads write in
+ *  parallel are left alone until they're joined.  See XMLDocument::save().
+ */
+class StreamedOutput {
+    public:
+        StreamedOutput(FILE* file) : file(file), failed(false), outer(current) {
+            current = this;
+        }
+        ~StreamedOutput() {
+            current = outer;
+        }
+        
+        /// The output not written yet
+        string out;
+        
+        /// Writes the output not written yet
+        /** \return Whether everything was written so far */
+        bool flush() {
+            if (fwrite(out.data(), 1, out.length(), file) != out.length()) failed = true;
+            out.clear();
+            return !failed;
+        }
+        
+        /// Writes a string being written into, if it's the output of this
+        /// thread's StreamedOutput and there's enough in it
+        static void pass(string* out) {
+            if (current != NULL && out == &current->out && out->length() >= SAVE_CHUNK) current->flush();
+        }
+    private:
+        StreamedOutput(const StreamedOutput&);
+        StreamedOutput& operator=(const StreamedOutput&);
+        
+        FILE* file;
+        bool failed;
+        /// The output open before this one
+        StreamedOutput* outer;
+        static thread_local StreamedOutput* current;
+};
+thread_local StreamedOutput* StreamedOutput::current = NULL;
+
 /// A line of text in the editor
 /** This is a supporting class, the purpose of which is to tie together
  *  the editor and the XML document.  It exists mainly to speed up rendering.
@@ -55,17 +863,90 @@ class EditorLine {
         XMLNode* node;
         /// If the line should be highlighted in the editor (e.g. after a search)
         bool highlight;
+        /// Which of the node's lines this is, for text spanning several
+        /** The lines of an XMLContent are its settable parts, so this is
+         *  the part edited on the line; it's 0 for other nodes. */
+        int part = 0;
         
         /// Constructor with highlight off by default
         EditorLine(bool selectable, int depth, string text, XMLNode* node)
             :selectable(selectable), depth(depth), text(text), node(node) {
             highlight = false;
         };
-            
+        
         /// Constructor with highlight settable
         /** For details about parameters, see this class. */
         EditorLine(bool selectable, int depth, string text, XMLNode* node, bool highlight)
             :selectable(selectable), depth(depth), text(text), node(node), highlight(highlight) {};
+        
+        /// Constructor for one of a node's lines
+        EditorLine(bool selectable, int depth, string text, XMLNode* node, bool highlight, int part)
+            :selectable(selectable), depth(depth), text(text), node(node), highlight(highlight), part(part) {};
+};
+
+/// Which nodes are expanded in the editor
+/** Tags shallower than depth are expanded, except for the ones expanded or
+ *  collapsed by hand since the policy was set.  Those are stamped with the
+ *  epoch, so setting a new policy is just bumping it and the nodes don't
+ *  need to be visited.
+ */
+struct ExpandPolicy {
+    /// Tags shallower than this are expanded
+    int depth = 0;
+    /// Nodes expanded or collapsed before this epoch follow depth
+    unsigned epoch = 1;
+    /// Cached line counts made before this generation are stale
+    unsigned generation = 1;
+};
+
+/// Lines being rendered, see XMLDocument::render_window()
+/** Nodes go through all the lines in order, but only the lines inside the
+ *  window are made into EditorLines.  Subtrees before the window are
+ *  skipped by their line count, and rendering stops after the window.
+ */
+struct LineWindow {
+    /// The first line wanted
+    int first;
+    /// How many lines are wanted
+    int count;
+    /// Where the lines go
+    vector<EditorLine>* lines;
+    /// Which nodes are expanded
+    const ExpandPolicy* policy;
+    /// Where to list the lines of search matches, if anywhere
+    /** Listing matches needs every line to be gone through. */
+    vector<int>* matches;
+    /// The line being gone through
+    int line;
+    
+    LineWindow(int first, int count, vector<EditorLine>* lines, const ExpandPolicy* policy, vector<int>* matches)
+        : first(first), count(count), lines(lines), policy(policy), matches(matches), line(0) {};
+    
+    /// Counts a line
+    /** \return Whether the line is inside the window and should be rendered */
+    bool take(bool highlight, bool selectable) {
+        int at = line++;
+        if (matches != NULL && highlight && selectable) matches->push_back(at);
+        return at >= first && at - first < count;
+    }
+    
+    /// Whether the window is still ahead, so lines could be skipped
+    bool before() const {
+        return matches == NULL && line < first;
+    }
+    
+    /// Skips lines if they're all before the window
+    /** \return Whether the lines were skipped */
+    bool skip(int lines) {
+        if (!before() || line + lines > first) return false;
+        line += lines;
+        return true;
+    }
+    
+    /// Whether the rest of the lines aren't wanted
+    bool done() const {
+        return matches == NULL && line - first >= count;
+    }
 };
 
 /// An attribute of an element
@@ -84,6 +965,56 @@ class XMLAttribute {
         }
 };
 
+class XMLTag;
+
+/// Keeps the children of tags out of memory until they're needed
+/** The children of a paged tag are read back when they're rendered,
+ *  searched or edited in bulk, and can be freed again as long as nothing
+ *  inside was changed, see XMLTag::is_evictable().  Implemented by
+ *  PageStore, which reads them from the file they were parsed from.
+ */
+class Pager {
+    public:
+        virtual ~Pager() {};
+        /// Reads the children of a paged out tag back
+        /** Can be called for different tags from several threads at once. */
+        virtual void page_in(XMLTag* tag) = 0;
+        /// Frees the children of a tag
+        virtual void page_out(XMLTag* tag) = 0;
+        /// Reads the children of a paged out tag, leaving it paged out
+        /** Can be called from several threads at once. */
+        virtual void read_children(const XMLTag* tag, vector<XMLNode*>* children) const = 0;
+        /// Marks the children of a tag as just used, so they're freed last
+        virtual void touch(XMLTag* tag) = 0;
+        /// Tells the pager a paged tag is being freed
+        virtual void forget(XMLTag* tag) = 0;
+        /// Pages out the children used longest ago, until they fit the budget
+        /** Only safe while nothing holds on to nodes inside paged tags, such
+         *  as at the start of XMLDocument::render_window().
+         *  \param policy Which nodes are expanded */
+        virtual void trim(const ExpandPolicy& policy) = 0;
+};
+
+/// Where the children of a paged tag are, see Pager
+struct XMLPage {
+    /// The pager which reads them
+    Pager* pager;
+    /// Where the run starts in the source, in bytes, see XMLTag::run
+    size_t start;
+    /// Where the run ends in the source
+    size_t end;
+    /// Whether the children are in memory
+    bool loaded = false;
+    /// Whether anything inside was edited, which keeps it in memory
+    bool dirty = false;
+    /// The memory the children take while loaded
+    long long bytes = 0;
+    /// When the children were last used, see Pager::touch()
+    unsigned long long used = 0;
+    
+    XMLPage(Pager* pager, size_t start, size_t end) : pager(pager), start(start), end(end) {};
+};
+
 /// Abstract XML node
 /** This abstract class represents a node in the XML tree.  Various operations
  *  can be performed on a node.
@@ -95,17 +1026,49 @@ class XMLNode {
     	/// Destructor
         virtual ~XMLNode() {};
         
-        /// Whether the node has been visually expanded
-        /** This is internal to the editor; it doesn't affect output. */
+        /// Whether the node has been visually expanded by hand
+        /** This is internal to the editor.  It only counts if expand_epoch
+         *  is the current epoch, see ExpandPolicy; empty tags are the
+         *  exception, they're always shown and saved as &lt;a>&lt;/a> when
+         *  this is set. */
         bool expanded = false;
+        /// The ExpandPolicy epoch expanded was set in
+        unsigned expand_epoch = 0;
         /// Whether the node has been found by the last search
         /** This is internal to the editor; it doesn't affect output. */
         bool found = false;
+        /// Where the node starts in the parsed document, in bytes
+        /** Nodes added in the editor start at 0. */
+        size_t source_offset = 0;
+        /// How many nodes the subtree had when parsed, counting this one
+        /** Only used to split work between threads, so it isn't kept up
+         *  to date when editing. */
+        size_t subtree_nodes = 1;
+        /// The hash of the subtree, as of the last hash_subtree()
+        /** Equal subtrees hash the same, see TreeDiff. */
+        uint64_t hash = 0;
+        /// How many places in the tree the node is in
+        /** Identical subtrees are only kept once when the document is
+         *  parsed with XMLDocument::share_subtrees, and a node shared by
+         *  several tags is copied before one of them changes it, see
+         *  XMLTag::own_child().  Shared nodes are freed by release(). */
+        unsigned refs = 1;
         
         /// Whether it makes sense to expand this node
         /** In other words, whether this node has (or can have) children */
 	    /** \return True if node is expandable */
         virtual bool is_expandable() { return false; }
+        /// Whether the node is expanded
+        /** \param policy Which nodes are expanded
+         *  \param depth How deep the node is */
+        bool is_expanded(const ExpandPolicy& policy, int depth) const {
+            return expand_epoch == policy.epoch ? expanded : depth < policy.depth;
+        }
+        /// Expands or collapses the node by hand
+        void set_expanded(bool expanded_, const ExpandPolicy& policy) {
+            expanded = expanded_;
+            expand_epoch = policy.epoch;
+        }
         /// Sets a part of this node
         /** The node can have multiple parts; the first parameter specifies
          *  which part is being set.  The second parameter contains the new
@@ -134,15 +1097,29 @@ class XMLNode {
         /** \param node The node to delete */
 	    /** \return True if succesful */
         virtual bool del_node(XMLNode* node) { return false; }
-        /// Finds all elements with the specified name, propagates
-        /** \param str The name to match */
+        /// Finds all nodes containing the searched text, propagates
+        /** Element names, attributes, text content and comments are searched.
+         *  Tags with matches inside are expanded by hand, with the policy's
+         *  epoch, so a new policy should be set before.
+         *  \param search The text to match
+         *  \param policy Which nodes are expanded */
 	    /** \return True if found and the parents should expand */
-        virtual bool find(string str) {
-            expanded = false;
+        virtual bool find(const TextSearch& search, const ExpandPolicy& policy) {
+            found = false;
             return false;
         }
-        /// Expands all nodes, propagates
-        virtual void expand_all() { expanded = true; }
+        /// Marks the node as found or not, as if by a search
+        /** Text spanning several lines marks all of them. */
+        virtual void set_found(bool found_) {
+            found = found_;
+        }
+        /// The name an ElementPath knows the node by
+        /** \return The element, #text or #comment, or an empty string for
+         *  nodes which can't be matched */
+        virtual const string& path_name() const {
+            static const string none = "";
+            return none;
+        }
         
         
         /// Gets the number of settable parts this node has.
@@ -155,12 +1132,57 @@ class XMLNode {
          *  editor, e.g. the element name or attributes. */
 	    /** \return Vector of strings containing the individual parts */
         virtual vector<string> settable_parts() { return vector<string>(); }
+        /// Gets what set() and del() can change, for undoing them
+        /** Children aren't part of it. */
+        virtual vector<string> state() const { return vector<string>(); }
+        /// Puts back what state() got
+        virtual void restore(const vector<string>& state) {}
+        /// Whether the node or anything inside it was found or expanded by
+        /// hand, propagates
+        /** Such nodes have to stay in memory, see XMLTag::is_evictable().
+         *  \param policy Which nodes are expanded */
+        virtual bool has_state(const ExpandPolicy& policy) const {
+            return found || expand_epoch == policy.epoch;
+        }
+        /// Hashes the subtree into hash, propagates
+        /** Children are hashed before the tags containing them, big
+         *  subtrees in parallel. */
+        virtual void hash_subtree() {
+            hash_node();
+        }
+        /// Hashes the node into hash, from the hashes its children have
+        virtual void hash_node() {
+            hash = hash_bytes(path_name());
+        }
+        /// Whether another node is the same, with the very same children
+        /** Used to share identical subtrees, see refs. */
+        virtual bool equals(const XMLNode* other) const {
+            return false;
+        }
+        /// Copies the node, sharing its children with the copy
+        virtual XMLNode* copy() const = 0;
+        
+        /// Frees a node, unless other tags still have it, see refs
+        static void release(XMLNode* node) {
+            if (node->refs > 1) node->refs--;
+            else delete node;
+        }
+        
+        /// Writes the node in an output style
+        /** \param out The string to append to
+         *  \param depth How much to indent
+         *  \param style The output style */
+        virtual void write(string* out, int depth, PrettyStyle style) const {}
+        virtual void write(string* out, int depth, CompactStyle style) const {}
+        virtual void write(string* out, int depth, MinifiedStyle style) const {}
         
         /// Returns a string representation of this node, indented by depth
         /** \param depth How much to indent */
 	    /** \return String representation of this node */
-        virtual string to_str(int depth) const {
-            return "";
+        string to_str(int depth) const {
+            string out = "";
+            write(&out, depth, PrettyStyle());
+            return out;
         }
         /// Returns a string representation of this node
 	    /** \return String representation of this node */
@@ -181,59 +1203,315 @@ class XMLNode {
             return make_pair(edit_buf, 0);
         }
         
-        /// Renders the node as EditorLines into the given vector
-        virtual void render_into(vector<EditorLine>* lines, int depth) {
-            lines->push_back(EditorLine(true, depth, to_str(), this));
+        /// Renders the node's lines which fall into the window, propagates
+        virtual void render_into(LineWindow* window, int depth) {
+            if (window->take(found, true)) {
+                window->lines->push_back(EditorLine(true, depth, to_str(), this, found));
+            }
+        }
+        
+        /// Counts the lines the node renders into
+        virtual int line_count(const ExpandPolicy& policy, int depth) {
+            return 1;
         }
-    private:
+        
+        /// Counts the memory used by this node and its children, propagates
+        /** \param census The census to add the node to
+         *  \return The bytes used by the node and its subtree */
+        virtual long long census(HeapCensus* census) const {
+            return 0;
+        }
+    protected:
+        /// Copies a node of any type, see copy()
+        template <typename Node>
+        static Node* copy_of(const Node& node) {
+            Node* copy = new Node(node);
+            copy->refs = 1;
+            return copy;
+        }
+};
+
+/// Where a line of an XMLContent is
+struct TextLine {
+    /// Where the line starts in XMLContent::content
+    size_t start;
+    /// Where the line starts in the source, after the node's source_offset
+    size_t source;
+    /// Whether the last search found the line
+    bool found;
 };
 
 /// XML Content
-/** Represents a piece of text between other XML nodes.
- *  For convenience while editing, multiple lines of text are split
- *  into distinct XMLContents during parsing, however this is not necessary.
+/** Represents a run of text between other XML nodes.  All the lines of the
+ *  run are kept in one buffer, separated by newlines, with a table of where
+ *  each of them starts, so long texts don't take a node per line.  The
+ *  editor still shows the lines one by one, and each line is a settable
+ *  part of its own, see EditorLine::part.  While parsing, the lines are
+ *  trimmed of the whitespace around them and blank ones are left out.
  */
 class XMLContent : public XMLNode {
     public:
-        XMLContent(string content) : XMLNode(), content(content) {};
+        /// Makes text without any lines, for add_line() to fill
+        XMLContent() : XMLNode() {};
+        XMLContent(string content) : XMLNode(), content(content) {
+            index_lines();
+        };
+        /// The text, its lines separated by newlines
+        /** Only changed through the methods, which keep the lines in step. */
         string content;
         
-        pair<bool, int> set(int which, string text) {
-            // set the content text
-            assert (which == 0); // we only have one settable thing
-            // no < allowed
-            int invalid = any_char_in_string(text, "<");
-            if (invalid != -1) return make_pair(false, invalid);
-            content = text;
-            return make_pair(true, -1);
+        /// How many lines the text has
+        size_t text_lines() const {
+            return lines.size();
         }
         
-        bool del(int which) {
-            // simply delete our content
-            assert (which == 0);
-            content = "";
-            return true;
+        /// Gets a line, without the newline
+        string line(size_t i) const {
+            return content.substr(lines[i].start, line_end(i) - lines[i].start);
         }
         
-        string to_str(int depth) const {
-            return content;
+        /// Adds a line after the others, while parsing
+        /** \param text The line
+         *  \param offset Where the line starts in the source, which is
+         *  where the node starts for the first one */
+        void add_line(const string& text, size_t offset) {
+            if (lines.empty()) source_offset = offset;
+            else content += '\n';
+            lines.push_back(TextLine{content.length(), offset - source_offset, false});
+            content += text;
         }
         
-        vector<string> settable_parts() {
-            vector<string> parts = vector<string>();
-            parts.push_back(content);
-            return parts;
+        /// Gives back the memory kept for more lines, once parsed
+        void shrink() {
+            content.shrink_to_fit();
+            lines.shrink_to_fit();
         }
         
-        void render_into(vector<EditorLine>* lines, int depth) {
-            string s = to_str(0);
-            // this isn't necessary, because while parsing,
-            // we already split newlines into different XMLContents -
-            // but just in case one sneaks in there.
-            replace(s.begin(), s.end(), '\n', ' ');
-            lines->push_back(EditorLine(true, depth, s, this));
+        /// Inserts a line
+        /** It's taken to start in the source where the line before it does.
+         *  \param at Which line it becomes, up to text_lines()
+         *  \param text The line */
+        void insert_line(size_t at, const string& text) {
+            size_t source = at > 0 ? lines[at-1].source : 0;
+            if (at == lines.size()) {
+                if (!lines.empty()) content += '\n';
+                lines.push_back(TextLine{content.length(), source, false});
+                content += text;
+                return;
+            }
+            size_t start = lines[at].start;
+            content.insert(start, text + '\n');
+            for (size_t i=at; i<lines.size(); i++) {
+                lines[i].start += text.length() + 1;
+            }
+            lines.insert(lines.begin() + at, TextLine{start, source, false});
         }
-};
+        
+        /// Deletes a line, unless it's the only one
+        /** \return Whether it was deleted */
+        bool erase_line(size_t at) {
+            if (lines.size() < 2) return false;
+            size_t start = lines[at].start;
+            size_t end = line_end(at);
+            if (at+1 < lines.size()) {
+                // the newline after the line goes with it
+                content.erase(start, end+1 - start);
+                for (size_t i=at+1; i<lines.size(); i++) {
+                    lines[i].start -= end+1 - start;
+                }
+            } else {
+                // the last line takes the newline before it
+                content.erase(start-1, end+1 - start);
+            }
+            lines.erase(lines.begin() + at);
+            return true;
+        }
+        
+        /// Splits the text in two before a line
+        /** \param at The first line to move, from 1 up to text_lines()-1
+         *  \return A new node with the lines from at on, which this loses */
+        XMLContent* split(size_t at) {
+            XMLContent* rest = new XMLContent();
+            size_t start = lines[at].start;
+            size_t source = lines[at].source;
+            rest->content = content.substr(start);
+            rest->source_offset = source_offset + source;
+            for (size_t i=at; i<lines.size(); i++) {
+                rest->lines.push_back(TextLine{lines[i].start - start, lines[i].source - source, lines[i].found});
+                if (lines[i].found) rest->found = found;
+            }
+            content.erase(start-1);
+            lines.resize(at);
+            found = false;
+            for (const TextLine& line : lines) {
+                if (line.found) found = true;
+            }
+            return rest;
+        }
+        
+        /// Finds the line an offset of the source is on
+        /** \return The last line starting at or before the offset */
+        size_t line_at(size_t offset) const {
+            if (offset < source_offset) return 0;
+            auto after = upper_bound(lines.begin(), lines.end(), offset - source_offset,
+                [](size_t source, const TextLine& line) { return source < line.source; });
+            return after == lines.begin() ? 0 : after - lines.begin() - 1;
+        }
+        
+        pair<bool, int> set(int which, string text) {
+            // set a line of the text
+            assert (which >= 0 && which < (int)lines.size());
+            // no < allowed, and no newlines in a line
+            int invalid = find_char<CHAR_OPEN | CHAR_NEWLINE>(text);
+            if (invalid != -1) return make_pair(false, invalid);
+            size_t start = lines[which].start;
+            size_t end = line_end(which);
+            content.replace(start, end - start, text);
+            for (size_t i=which+1; i<lines.size(); i++) {
+                lines[i].start = lines[i].start + text.length() - (end - start);
+            }
+            return make_pair(true, -1);
+        }
+        
+        bool del(int which) {
+            // simply empty the line
+            return set(which, "").first;
+        }
+        
+        WRITE_STYLES
+        
+        template <typename Style>
+        void write_as(string* out, int depth, Style style) const {
+            // the lines are indented like the nodes around them, and blank
+            // ones are left out like blank nodes are
+            bool first = true;
+            for (size_t i=0; i<lines.size(); i++) {
+                size_t start = lines[i].start;
+                size_t end = line_end(i);
+                bool blank = true;
+                for (size_t j=start; j<end && blank; j++) {
+                    if (!char_is<CHAR_SPACE>(content[j])) blank = false;
+                }
+                if (blank) continue;
+                if (!first) {
+                    *out += '\n';
+                    if (Style::indented) out->append(depth, TAB);
+                }
+                out->append(content, start, end - start);
+                first = false;
+            }
+        }
+        
+        int num_settable() {
+            // a line only has itself to set
+            return 1;
+        }
+        
+        vector<string> settable_parts() {
+            vector<string> parts;
+            parts.reserve(lines.size());
+            for (size_t i=0; i<lines.size(); i++) {
+                parts.push_back(line(i));
+            }
+            return parts;
+        }
+        
+        vector<string> state() const {
+            return vector<string>(1, content);
+        }
+        void restore(const vector<string>& state) {
+            content = state[0];
+            index_lines();
+        }
+        
+        void render_into(LineWindow* window, int depth) {
+            // the lines before the window are skipped all at once
+            size_t i = 0;
+            if (window->before()) {
+                i = min((size_t)(window->first - window->line), lines.size());
+                window->skip(i);
+            }
+            for (; i<lines.size() && !window->done(); i++) {
+                bool highlight = found && lines[i].found;
+                if (window->take(highlight, true)) {
+                    window->lines->push_back(EditorLine(true, depth, line(i), this, highlight, i));
+                }
+            }
+        }
+        
+        int line_count(const ExpandPolicy& policy, int depth) {
+            return lines.size();
+        }
+        
+        bool find(const TextSearch& search, const ExpandPolicy& policy) {
+            found = false;
+            for (size_t i=0; i<lines.size(); i++) {
+                lines[i].found = search.in(content.data() + lines[i].start, line_end(i) - lines[i].start);
+                if (lines[i].found) found = true;
+            }
+            return found;
+        }
+        
+        void set_found(bool found_) {
+            found = found_;
+            for (TextLine& line : lines) {
+                line.found = found_;
+            }
+        }
+        
+        const string& path_name() const {
+            static const string name = "#text";
+            return name;
+        }
+        
+        void hash_node() {
+            hash = combine_hashes(hash_bytes(path_name()), hash_bytes(content));
+        }
+        bool equals(const XMLNode* other) const {
+            const XMLContent* text = dynamic_cast<const XMLContent*>(other);
+            return text && text->content == content;
+        }
+        XMLNode* copy() const {
+            return copy_of(*this);
+        }
+        
+        long long census(HeapCensus* census) const {
+            CensusEntry entry;
+            entry.count = 1;
+            entry.object_bytes = sizeof(*this);
+            entry.add_string(content);
+            // the line table is counted with the text
+            entry.string_bytes += lines.capacity() * sizeof(TextLine);
+            entry.slack_bytes += (lines.capacity() - lines.size()) * sizeof(TextLine);
+            census->types["XMLContent"].add(entry);
+            return entry.bytes();
+        }
+    private:
+        /// Where each line is, in order
+        vector<TextLine> lines;
+        
+        /// Where a line ends in content, before its newline
+        size_t line_end(size_t i) const {
+            return i+1 < lines.size() ? lines[i+1].start - 1 : content.length();
+        }
+        
+        /// Finds the lines of content again after it's replaced
+        /** The lines keep where they start in the source and whether they
+         *  were found, as far as there were lines before. */
+        void index_lines() {
+            vector<TextLine> indexed;
+            size_t start = 0;
+            while (true) {
+                size_t i = indexed.size();
+                if (i < lines.size()) indexed.push_back(TextLine{start, lines[i].source, lines[i].found});
+                else indexed.push_back(TextLine{start, i > 0 ? indexed[i-1].source : 0, false});
+                size_t newline = content.find('\n', start);
+                if (newline == string::npos) break;
+                start = newline + 1;
+            }
+            lines.swap(indexed);
+        }
+};
 
 /// XML Tag
 /** Represents a piece of XML tag
@@ -247,8 +1525,12 @@ class XMLTag : public XMLNode {
         XMLTag() {};
         XMLTag(string element) : XMLNode(), element(element) {};
         ~XMLTag() {
+            if (page) {
+                page->pager->forget(this);
+                delete page;
+            }
             for (auto child_p : children) {
-                delete child_p;
+                release(child_p);
             }
         }
         
@@ -256,7 +1538,85 @@ class XMLTag : public XMLNode {
         /// The attributes on the element
         vector<XMLAttribute> attributes;
         /// Child nodes of this tag
+        /** Empty while the tag is paged out. */
         vector<XMLNode*> children;
+        /// Where the children are paged out to, NULL if they never are
+        XMLPage* page = NULL;
+        /// Whether this is a run of its parent's children, see PageStore
+        /** Runs have no element and no lines of their own; their children
+         *  are shown, written, searched and edited as the parent's, at its
+         *  depth. */
+        bool run = false;
+        /// Whether shared nodes are inside, see XMLNode::refs
+        /** map_children() stays on one thread in such tags, as the chunks
+         *  could meet in a shared node. */
+        bool has_shared = false;
+        
+        /// Forgets the start and end tag shown in the editor
+        /** Has to be called when the element or the attributes change, see
+         *  get_start_str(). */
+        void changed() {
+            start_str.clear();
+            end_str.clear();
+        }
+        
+        /// Whether the tag has children, even if they're paged out
+        /** Only tags with children are paged out. */
+        bool has_children() const {
+            return is_paged_out() || children.size() > 0;
+        }
+        /// Whether the children are paged out, see Pager
+        bool is_paged_out() const {
+            return page && !page->loaded;
+        }
+        /// Reads the children back if they're paged out
+        /** \return Whether they were */
+        bool page_in() {
+            if (!is_paged_out()) return false;
+            page->pager->page_in(this);
+            return true;
+        }
+        /// Gets a child to change, copying it first if it's shared
+        /** See XMLNode::refs.  The copy still shares the child's children.
+         *  \param i Which child
+         *  \return The child, which is only in this tag */
+        XMLNode* own_child(size_t i) {
+            if (children[i]->refs > 1) {
+                XMLNode* copy = children[i]->copy();
+                children[i]->refs--;
+                children[i] = copy;
+            }
+            return children[i];
+        }
+        /// Frees the children, which can be read back by page_in()
+        void page_out() {
+            page->pager->page_out(this);
+        }
+        /// Whether the children could be paged out without losing anything
+        /** They can't if anything inside was edited, found or expanded by
+         *  hand, see has_state().
+         *  \param policy Which nodes are expanded */
+        bool is_evictable(const ExpandPolicy& policy) const {
+            if (page == NULL || !page->loaded || page->dirty) return false;
+            for (auto child : children) {
+                if (child->has_state(policy)) return false;
+            }
+            return true;
+        }
+        
+        /// Whether the tag's children are shown
+        /** Empty tags are shown open when expanded by hand. */
+        bool is_open(const ExpandPolicy& policy, int depth) const {
+            if (run) return true;
+            return has_children() ? is_expanded(policy, depth) : expanded;
+        }
+        
+        /// Makes the cached line count stale
+        /** Needed when anything in the subtree changes how many lines it
+         *  renders into, see XMLDocument::changing(). */
+        void forget_line_count() {
+            lines_generation = 0;
+        }
         
         pair<bool, int> set(int which, string text) {
             found = false;
@@ -267,12 +1627,9 @@ class XMLTag : public XMLNode {
                 if (text.size() == 0) return make_pair(false, -1);
                 // first character cannot be invalid, there are specific chars
                 // which can't be the first characters of the element name
-                char c = text[0];
-                for (char invalid_char : INVALID_ELEMENT_FIRST_CHARS) {
-                    if (c == invalid_char) return make_pair(false, 0);
-                }
+                if (char_is<CHAR_NOT_NAME_START>(text[0])) return make_pair(false, 0);
                 // any other character cannot be invalid either
-                int invalid = any_char_in_string(text, WHITESPACE INVALID_ELEMENT_CHARS ">/");
+                int invalid = find_char<CHAR_NAME_END>(text);
                 if (invalid != -1) return make_pair(false, invalid);
                 
                 element = text;
@@ -281,7 +1638,7 @@ class XMLTag : public XMLNode {
                 if (which % 2 == 0) {
                     // if even, we're setting the attribute
                     if (text.size() == 0) return make_pair(false, -1);
-                    int invalid = any_char_in_string(text, WHITESPACE INVALID_ELEMENT_CHARS ">/");
+                    int invalid = find_char<CHAR_NAME_END>(text);
                     if (invalid != -1) return make_pair(false, invalid);
                     
                     attributes[which/2].attribute = text;
@@ -289,7 +1646,7 @@ class XMLTag : public XMLNode {
                 else {
                     // odd, so we're setting the value.  the value doesn't
                     // have any restrictions except for ", since it's quoted
-                    int invalid = any_char_in_string(text, "\"");
+                    int invalid = find_char<CHAR_QUOTE>(text);
                     if (invalid != -1) return make_pair(false, invalid);
                     
                     attributes[which/2].value = text;
@@ -297,10 +1654,11 @@ class XMLTag : public XMLNode {
             } else {
                 // this is a new attribute, create it with an empty value
                 if (text.size() == 0) return make_pair(true, -1);
-                int invalid = any_char_in_string(text, WHITESPACE INVALID_ELEMENT_CHARS ">/");
+                int invalid = find_char<CHAR_NAME_END>(text);
                 if (invalid != -1) return make_pair(false, invalid);
                 attributes.push_back(XMLAttribute(text, ""));
             }
+            changed();
             // we did it!
             return make_pair(true, -1);
         }
@@ -317,6 +1675,7 @@ class XMLTag : public XMLNode {
                     // delete the attribute's value
                     attributes[which/2].value = "";
                 }
+                changed();
                 return true;
             }
             // probably an attempt to delete a nonexistant attribute - fail
@@ -330,7 +1689,7 @@ class XMLTag : public XMLNode {
             int i = 0;
             for (auto i_node : children) {
                 if (node == &*i_node) {
-                    delete node;
+                    release(node);
                     children.erase(children.begin() + i);
                     return true;
                 } else if (i_node->del_node(node)) {
@@ -346,6 +1705,7 @@ class XMLTag : public XMLNode {
             // the start tag line
             if (node == this && !force_after) {
                 // simply insert the new node if it's us
+                page_in();
                 children.insert(children.begin(), new_node);
                 //delete new_node;
                 return true;
@@ -376,7 +1736,7 @@ class XMLTag : public XMLNode {
             // don't claim to be expandable if we don't have children
             // (we actually can be expanded, but it's cleaner not to
             // visualize it)
-            return children.size() >= 1;
+            return has_children();
         }
         
         int num_settable() {
@@ -389,7 +1749,7 @@ class XMLTag : public XMLNode {
             // element name
             parts.push_back(element);
             // attribute names and values
-            for (XMLAttribute attr : attributes) {
+            for (const XMLAttribute& attr : attributes) {
                 parts.push_back(attr.attribute);
                 parts.push_back(attr.value);
             }
@@ -398,283 +1758,2021 @@ class XMLTag : public XMLNode {
             return parts;
         }
         
+        vector<string> state() const {
+            // the element followed by attribute names and values
+            vector<string> parts (1, element);
+            for (const XMLAttribute& attr : attributes) {
+                parts.push_back(attr.attribute);
+                parts.push_back(attr.value);
+            }
+            return parts;
+        }
+        void restore(const vector<string>& state) {
+            element = state[0];
+            attributes.clear();
+            for (size_t i=1; i+1<state.size(); i+=2) {
+                attributes.push_back(XMLAttribute(state[i], state[i+1]));
+            }
+            changed();
+        }
+        bool has_state(const ExpandPolicy& policy) const {
+            if (XMLNode::has_state(policy)) return true;
+            // hand-expanded empty tags are written differently
+            if (expanded && !has_children()) return true;
+            for (auto child : children) {
+                if (child->has_state(policy)) return true;
+            }
+            return false;
+        }
+        
+        /// Finds the tags containing a node, propagates
+        /** \param node The node to look for
+         *  \param ancestors Where to put the tags from this one down to the
+         *  node's parent
+         *  \param positions Where to put where each of the tags after this
+         *  one, and then the node, is among its parent's children
+         *  \return Whether the node is inside this tag; nothing is added
+         *  if it isn't */
+        bool path_to(XMLNode* node, vector<XMLTag*>* ancestors, vector<size_t>* positions) {
+            ancestors->push_back(this);
+            for (size_t i=0; i<children.size(); i++) {
+                positions->push_back(i);
+                if (children[i] == node) return true;
+                XMLTag* tag = dynamic_cast<XMLTag*>(children[i]);
+                if (tag && tag->path_to(node, ancestors, positions)) return true;
+                positions->pop_back();
+            }
+            ancestors->pop_back();
+            return false;
+        }
+        
         /// Gets the start tag
-        /** \return The start tag string */
-        string get_start_str() const {
-            string out = "<";
-            out += element;
-            for (XMLAttribute attr : attributes) {
-                out += " ";
-                out += attr.attribute;
-                out += "=\"";
-                out += attr.value;
-                out += "\"";
-            }
-            if (!children.size() and !expanded) out += " /";
-            out += ">";
-            return out;
+        /** It's kept until changed(), or until the tag gains or loses its
+         *  children or is expanded, which changes the " /" at the end.
+         *  \return The start tag string */
+        const string& get_start_str() const {
+            bool empty = !has_children() and !expanded;
+            if (start_str.empty() || empty != start_str_empty) {
+                start_str = "<";
+                start_str += element;
+                for (const XMLAttribute& attr : attributes) {
+                    start_str += " ";
+                    start_str += attr.attribute;
+                    start_str += "=\"";
+                    start_str += attr.value;
+                    start_str += "\"";
+                }
+                if (empty) start_str += " /";
+                start_str += ">";
+                start_str_empty = empty;
+            }
+            return start_str;
         }
         
         /// Gets the end tag
-        /** \return The end tag string */
-        string get_end_str() const {
-            return "</" + element + ">";
+        /** It's kept until changed(), like the start tag.
+         *  \return The end tag string */
+        const string& get_end_str() const {
+            if (end_str.empty()) end_str = "</" + element + ">";
+            return end_str;
+        }
+        
+        WRITE_STYLES
+        
+        template <typename Style>
+        void write_as(string* out, int depth, Style style) const {
+            if (is_paged_out()) {
+                // the children are read into a copy, so saving doesn't page
+                // anything in
+                XMLTag copy (element);
+                copy.attributes = attributes;
+                copy.expanded = expanded;
+                copy.subtree_nodes = subtree_nodes;
+                page->pager->read_children(this, &copy.children);
+                copy.write_as(out, depth, style);
+                return;
+            }
+            write_start(out, style);
+            if (!children.size() && !expanded) return;
+            if (Style::inline_text && is_short_text()) {
+                *out += static_cast<const XMLContent*>(children[0])->content;
+            } else if (!splits_children()) {
+                write_children(out, 0, children.size(), depth, style);
+                if (Style::indented) {
+                    *out += '\n';
+                    out->append(depth, TAB);
+                }
+            } else {
+                // big subtrees are written in parallel, a piece per chunk
+                vector<string> pieces = map_children<string>([this, depth](size_t from, size_t to) {
+                    string piece = "";
+                    write_children(&piece, from, to, depth, Style());
+                    return piece;
+                });
+                for (const string& piece : pieces) {
+                    *out += piece;
+                    StreamedOutput::pass(out);
+                }
+                if (Style::indented) {
+                    *out += '\n';
+                    out->append(depth, TAB);
+                }
+            }
+            *out += "</";
+            *out += element;
+            *out += '>';
+        }
+        
+        void render_into(LineWindow* window, int depth) {
+            if (is_open(*window->policy, depth)) {
+                // don't bother going through subtrees before the window
+                if (window->before() && window->skip(line_count(*window->policy, depth))) return;
+                if (window->matches != NULL && is_paged_out()) {
+                    // nothing inside was found, or it would have stayed in
+                    if (!run) window->take(found, true);
+                    window->line += line_count(*window->policy, depth) - (run ? 0 : 1);
+                    return;
+                }
+                if (page) {
+                    page_in();
+                    page->pager->touch(this);
+                }
+                if (!run && window->take(found, true)) {
+                    window->lines->push_back(EditorLine(true, depth, get_start_str(), this, found));
+                }
+                for (auto& child : children) {
+                    if (window->done()) return;
+                    child->render_into(window, run ? depth : depth+1);
+                }
+                if (!run && window->take(found, false)) {
+                    window->lines->push_back(EditorLine(false, depth, get_end_str(), this, found));
+                }
+            } else if (!window->take(found, true)) {
+                return;
+            } else if (has_children()) {
+                // we have children which will be shown if expanded - convey
+                // this with ...
+                window->lines->push_back(EditorLine(true, depth, get_start_str()+" ...", this, found));
+            } else {
+                window->lines->push_back(EditorLine(true, depth, get_start_str(), this, found));
+            }
+        }
+        
+        int line_count(const ExpandPolicy& policy, int depth) {
+            if (!is_open(policy, depth)) return 1;
+            if (lines_generation == policy.generation) return lines;
+            // the start and end tag, and the children
+            bool paged_in = page_in();
+            int count = run ? 0 : 2;
+            for (auto child : children) {
+                count += child->line_count(policy, run ? depth : depth+1);
+            }
+            // counting alone doesn't keep the children in memory
+            if (paged_in && is_evictable(policy)) page_out();
+            lines = count;
+            lines_generation = policy.generation;
+            return count;
+        }
+        
+        pair<string, int> get_settable_line(int select_cursor, string edit_buf) {
+            // the reason this looks the way it does is so we can
+            // easily get the select_x value (offset from left)
+            int i=0;
+            int select_x = 0;
+            string line = "";
+            for (string part : settable_parts()) {
+                if (i == 0) line += "<";
+                else if (i % 2 == 0) line += "=\"";
+                else line += " ";
+                if (i == select_cursor) {
+                    select_x = line.length();
+                    line += edit_buf;
+                } else {
+                    line += part;
+                }
+                if (i != 0 && i % 2 == 0) line += "\"";
+                i++;
+            }
+            if (!has_children() and !expanded) line += "/";
+            line += ">";
+            return make_pair(line, select_x);
+        }
+        
+        bool find(const TextSearch& search, const ExpandPolicy& policy) {
+            // we're not expanded by default, the policy takes care of that
+            found = false;
+            bool inside = false;
+            bool paged_in = page_in();
+            // every node only marks itself, so big subtrees can be searched
+            // in parallel
+            vector<char> chunks = map_children<char>([this, &search, &policy](size_t from, size_t to) {
+                char matched = false;
+                for (size_t i=from; i<to; i++) {
+                    if (children[i]->find(search, policy)) matched = true;
+                }
+                return matched;
+            });
+            for (char matched : chunks) {
+                // some of our children or grand-children (...) matched,
+                // so expand us
+                if (matched) inside = true;
+            }
+            // children without matches don't need to stay in memory
+            if (paged_in && !inside && is_evictable(policy)) page_out();
+            if (!run && search.in(element)) found = true;
+            for (const XMLAttribute& attr : attributes) {
+                if (search.in(attr.attribute) || search.in(attr.value)) found = true;
+            }
+            if (found || inside) {
+                // only expand if there's something to show, an expanded
+                // empty tag would change the output
+                if (has_children() && !run) set_expanded(true, policy);
+                // tell (grand...)parents to expand
+                return true;
+            }
+            return false;
+        }
+        
+        const string& path_name() const {
+            return element;
+        }
+        
+        void hash_subtree() {
+            page_in();
+            map_children<char>([this](size_t from, size_t to) {
+                for (size_t i=from; i<to; i++) {
+                    children[i]->hash_subtree();
+                }
+                return char();
+            });
+            hash_node();
+        }
+        void hash_node() {
+            // attributes hash the same in any order
+            uint64_t attributes_hash = 0;
+            for (const XMLAttribute& attr : attributes) {
+                attributes_hash += combine_hashes(hash_bytes(attr.attribute), hash_bytes(attr.value));
+            }
+            hash = combine_hashes(hash_bytes(element), attributes_hash);
+            for (auto child : children) {
+                hash = combine_hashes(hash, child->hash);
+            }
+        }
+        
+        bool equals(const XMLNode* other) const {
+            const XMLTag* tag = dynamic_cast<const XMLTag*>(other);
+            if (tag == NULL || tag->element != element || tag->expanded != expanded
+                || tag->attributes.size() != attributes.size() || tag->children != children) {
+                return false;
+            }
+            for (size_t i=0; i<attributes.size(); i++) {
+                if (tag->attributes[i].attribute != attributes[i].attribute
+                    || tag->attributes[i].value != attributes[i].value) {
+                    return false;
+                }
+            }
+            return true;
+        }
+        XMLNode* copy() const {
+            XMLTag* tag = copy_of(*this);
+            tag->page = NULL;
+            for (auto child : children) {
+                child->refs++;
+            }
+            return tag;
+        }
+        
+        /// Applies a bulk edit to the tag itself
+        /** Only renaming and attributes are done here, the rest changes
+         *  the parent, see bulk_edit(). */
+        void apply(const BulkEdit& edit) {
+            changed();
+            if (edit.operation == BULK_RENAME) {
+                element = edit.name;
+                return;
+            }
+            for (size_t i=0; i<attributes.size(); i++) {
+                if (attributes[i].attribute != edit.name) continue;
+                if (edit.operation == BULK_SET) {
+                    attributes[i].value = edit.value;
+                } else if (edit.operation == BULK_UNSET) {
+                    attributes.erase(attributes.begin() + i);
+                }
+                return;
+            }
+            if (edit.operation == BULK_SET) attributes.push_back(XMLAttribute(edit.name, edit.value));
+        }
+        
+        /// Applies a bulk edit to the matching nodes inside the tag, propagates
+        /** The children are gone through once and replaced with a new list,
+         *  so the whole tree takes linear time however many nodes match.
+         *  Descendants are edited before the nodes containing them, and
+         *  nothing inside a deleted node is looked at.  Wrapping tags are
+         *  expanded by hand.
+         *
+         *  \param edit The edit
+         *  \param path Which nodes to edit, or NULL for the ones found by
+         *  the last search
+         *  \param depth How deep the children are, the root being 1
+         *  \param parents_match Whether the path leads to this tag
+         *  \param policy Which nodes are expanded
+         *  \return How many nodes were edited */
+        long long bulk_edit(const BulkEdit& edit, const ElementPath* path, size_t depth,
+                            bool parents_match, const ExpandPolicy& policy) {
+            long long edited = 0;
+            bool paged_in = page_in();
+            vector<XMLNode*> edited_children;
+            edited_children.reserve(children.size());
+            for (size_t i=0; i<children.size(); i++) {
+                XMLNode* child = children[i];
+                XMLTag* tag = dynamic_cast<XMLTag*>(child);
+                if (tag && tag->run) {
+                    // the children of runs are edited as ours
+                    edited += tag->bulk_edit(edit, path, depth, parents_match, policy);
+                    edited_children.push_back(child);
+                    continue;
+                }
+                const string& name = child->path_name();
+                bool matched = path ? path->matches(depth, name, parents_match) : child->found;
+                if (!(tag || edit.applies_to_any_node())) matched = false;
+                if (matched && edit.operation == BULK_DELETE) {
+                    release(child);
+                    edited++;
+                    continue;
+                }
+                bool leads_to = path && path->leads_to(depth, name, parents_match);
+                if (child->refs > 1) {
+                    // shared nodes are copied, as they're edited in one
+                    // place, but only on the way to the nodes edited
+                    if (matched || (tag && tag->has_bulk_edits(edit, path, depth+1, leads_to))) {
+                        child = own_child(i);
+                        tag = dynamic_cast<XMLTag*>(child);
+                    } else {
+                        edited_children.push_back(child);
+                        continue;
+                    }
+                }
+                if (tag) edited += tag->bulk_edit(edit, path, depth+1, leads_to, policy);
+                if (!matched) {
+                    edited_children.push_back(child);
+                    continue;
+                }
+                edited++;
+                if (edit.operation == BULK_WRAP) {
+                    XMLTag* wrapper = new XMLTag(edit.name);
+                    wrapper->children.push_back(child);
+                    wrapper->subtree_nodes = child->subtree_nodes + 1;
+                    wrapper->has_shared = has_shared;
+                    wrapper->set_expanded(true, policy);
+                    edited_children.push_back(wrapper);
+                } else if (edit.operation == BULK_UNWRAP) {
+                    tag->page_in();
+                    edited_children.insert(edited_children.end(), tag->children.begin(), tag->children.end());
+                    tag->children.clear();
+                    delete tag;
+                } else {
+                    tag->apply(edit);
+                    edited_children.push_back(child);
+                }
+            }
+            children.swap(edited_children);
+            forget_line_count();
+            // edited children stay in memory, the rest can go back out
+            if (page && edited) page->dirty = true;
+            else if (paged_in && is_evictable(policy)) page_out();
+            return edited;
+        }
+        
+        /// Whether bulk_edit() would edit anything inside the tag
+        /** Nothing is changed, so shared tags can be looked into before
+         *  they're copied.  Paged out children count as edited.  For the
+         *  parameters, see bulk_edit(). */
+        bool has_bulk_edits(const BulkEdit& edit, const ElementPath* path, size_t depth,
+                            bool parents_match) const {
+            if (is_paged_out()) return true;
+            for (const XMLNode* child : children) {
+                const XMLTag* tag = dynamic_cast<const XMLTag*>(child);
+                if (tag && tag->run) {
+                    if (tag->has_bulk_edits(edit, path, depth, parents_match)) return true;
+                    continue;
+                }
+                const string& name = child->path_name();
+                bool matched = path ? path->matches(depth, name, parents_match) : child->found;
+                if (matched && (tag || edit.applies_to_any_node())) return true;
+                bool leads_to = path && path->leads_to(depth, name, parents_match);
+                if (tag && tag->has_bulk_edits(edit, path, depth+1, leads_to)) return true;
+            }
+            return false;
+        }
+        
+        /// Finds the child starting closest before an offset
+        /** Children are in document order, except for ones added in the
+         *  editor, which don't start anywhere.
+         *  \return The index of the child, or -1 if there's none */
+        int child_at(size_t offset) const {
+            int closest = -1;
+            for (int i=0; i<(int)children.size(); i++) {
+                size_t start = children[i]->source_offset;
+                if (start < source_offset || start > offset) continue;
+                if (closest == -1 || start >= children[closest]->source_offset) closest = i;
+            }
+            return closest;
+        }
+        
+        long long census(HeapCensus* census) const {
+            CensusEntry entry;
+            entry.count = 1;
+            entry.object_bytes = sizeof(*this);
+            entry.children_bytes = children.capacity() * sizeof(XMLNode*);
+            entry.attribute_bytes = attributes.capacity() * sizeof(XMLAttribute);
+            entry.slack_bytes = (children.capacity() - children.size()) * sizeof(XMLNode*)
+                + (attributes.capacity() - attributes.size()) * sizeof(XMLAttribute);
+            entry.add_string(element);
+            for (const XMLAttribute& attr : attributes) {
+                entry.add_string(attr.attribute);
+                entry.add_string(attr.value);
+            }
+            entry.add_string(start_str);
+            entry.add_string(end_str);
+            census->types["XMLTag"].add(entry);
+            
+            long long subtree = entry.bytes();
+            if (!splits_children()) {
+                for (auto child : children) {
+                    if (child->refs > 1 && !census->shared.insert(child).second) continue;
+                    subtree += child->census(census);
+                }
+            } else {
+                // big subtrees are counted in parallel, each chunk into its
+                // own census
+                vector<pair<long long, HeapCensus> > chunks = map_children<pair<long long, HeapCensus> >(
+                    [this](size_t from, size_t to) {
+                        pair<long long, HeapCensus> chunk (0, HeapCensus());
+                        for (size_t i=from; i<to; i++) {
+                            chunk.first += children[i]->census(&chunk.second);
+                        }
+                        return chunk;
+                    });
+                for (auto& chunk : chunks) {
+                    subtree += chunk.first;
+                    census->add(chunk.second);
+                }
+            }
+            entry.subtree_bytes = subtree;
+            census->elements[element].add(entry);
+            return subtree;
+        }
+    private:
+        /// The start tag get_start_str() last made, empty until it's shown
+        mutable string start_str;
+        /// Whether start_str was made for a tag without children
+        mutable bool start_str_empty = false;
+        /// The end tag get_end_str() last made
+        mutable string end_str;
+        
+        /// Writes the start tag, like get_start_str()
+        template <typename Style>
+        void write_start(string* out, Style style) const {
+            *out += '<';
+            *out += element;
+            for (const XMLAttribute& attr : attributes) {
+                *out += ' ';
+                *out += attr.attribute;
+                *out += "=\"";
+                *out += attr.value;
+                *out += '"';
+            }
+            if (!has_children() && !expanded) *out += Style::indented ? " />" : "/>";
+            else *out += '>';
+        }
+        
+        /// Writes some of the children, each on its own line if indented
+        /** Children which only write whitespace are left out. */
+        template <typename Style>
+        void write_children(string* out, size_t from, size_t to, int depth, Style style) const {
+            bool after_text = text_before(from);
+            write_children(out, from, to, depth, style, &after_text);
+        }
+        /// Writes some of the children, going through runs
+        /** \param after_text Whether the node written last is text, which
+         *  is updated */
+        template <typename Style>
+        void write_children(string* out, size_t from, size_t to, int depth, Style style,
+                            bool* after_text) const {
+            for (size_t i=from; i<to; i++) {
+                const XMLTag* tag = dynamic_cast<const XMLTag*>(children[i]);
+                if (tag && tag->run) {
+                    tag->write_run(out, depth, style, after_text);
+                    continue;
+                }
+                bool text = dynamic_cast<const XMLContent*>(children[i]) != NULL;
+                size_t before = out->length();
+                if (Style::indented) {
+                    *out += '\n';
+                    out->append(depth+1, TAB);
+                } else if (*after_text && text) {
+                    // lines of text are only told apart by newlines
+                    *out += '\n';
+                }
+                *after_text = text;
+                size_t start = out->length();
+                children[i]->write(out, depth+1, style);
+                // a child which had its output written isn't blank
+                bool blank = out->length() >= start;
+                for (size_t j=start; j<out->length() && blank; j++) {
+                    if (!char_is<CHAR_SPACE>((*out)[j])) blank = false;
+                }
+                if (blank) out->resize(before);
+                StreamedOutput::pass(out);
+            }
+        }
+        
+        /// Writes the children of a run as the parent's, see run
+        template <typename Style>
+        void write_run(string* out, int depth, Style style, bool* after_text) const {
+            if (is_paged_out()) {
+                // read into a copy, like write_as()
+                XMLTag copy;
+                copy.run = true;
+                page->pager->read_children(this, &copy.children);
+                copy.write_run(out, depth, style, after_text);
+                return;
+            }
+            write_children(out, 0, children.size(), depth, style, after_text);
+        }
+        
+        /// Whether the node written just before a child is a line of text
+        /** Runs are looked through; the ones read from the file start and
+         *  end with tags or comments, see PageStore. */
+        bool text_before(size_t i) const {
+            while (i > 0) {
+                const XMLNode* node = children[--i];
+                const XMLTag* tag = dynamic_cast<const XMLTag*>(node);
+                if (tag == NULL || !tag->run) return dynamic_cast<const XMLContent*>(node) != NULL;
+                if (tag->is_paged_out()) return false;
+                if (tag->children.size()) return tag->text_before(tag->children.size());
+            }
+            return false;
+        }
+        
+        /// Whether the tag only has a short line of text, see CompactStyle
+        bool is_short_text() const {
+            if (children.size() != 1) return false;
+            const XMLContent* text = dynamic_cast<const XMLContent*>(children[0]);
+            if (text == NULL || text->text_lines() != 1 || is_whitespace(text->content)) return false;
+            size_t length = 2*element.length() + 5 + text->content.length();
+            for (const XMLAttribute& attr : attributes) {
+                length += attr.attribute.length() + attr.value.length() + 4;
+            }
+            return length <= COMPACT_LINE_LENGTH;
+        }
+        
+        /// Whether map_children() splits the children between threads
+        bool splits_children() const {
+            return subtree_nodes >= 2*PARALLEL_CHUNK && TaskPool::shared().size() > 1 && !has_shared;
+        }
+        
+        /// Maps ranges of children to results, in parallel for big subtrees
+        /** The children are split into chunks of about PARALLEL_CHUNK
+         *  nodes, which are handed to the shared TaskPool.  Small subtrees
+         *  are done in one go on the calling thread.  The map must only
+         *  touch its own chunk of the tree.
+         *
+         *  \param map Gets the range of children, from and to, and gives
+         *  its result
+         *  \return The results, in document order */
+        template <typename T, typename Map>
+        vector<T> map_children(Map map) const {
+            if (!splits_children()) return vector<T>(1, map(0, children.size()));
+            vector<size_t> bounds (1, 0);
+            size_t weight = 0;
+            for (size_t i=0; i<children.size(); i++) {
+                weight += children[i]->subtree_nodes;
+                if (weight >= PARALLEL_CHUNK) {
+                    bounds.push_back(i+1);
+                    weight = 0;
+                }
+            }
+            if (bounds.back() != children.size()) bounds.push_back(children.size());
+            if (bounds.size() < 3) return vector<T>(1, map(0, children.size()));
+            
+            vector<T> results (bounds.size()-1);
+            TaskGroup group (TaskPool::shared());
+            for (size_t i=1; i<results.size(); i++) {
+                group.run([&results, &bounds, &map, i]() {
+                    results[i] = map(bounds[i], bounds[i+1]);
+                });
+            }
+            results[0] = map(bounds[0], bounds[1]);
+            group.wait();
+            return results;
+        }
+        
+        /// The cached line count, see line_count()
+        int lines = 0;
+        /// The ExpandPolicy generation lines was counted in
+        unsigned lines_generation = 0;
+};
+
+/// XML Declaration
+/** Represents the XML declaration
+ *
+ *  According to the specification, a XML document may contain a XML declaration
+ *  at the start.  We expose this, but do not allow it to be edited
+ *  (it wouldn't make sense).
+ *
+ *  Example declaration: &lt;?xml version="1.0" encoding="UTF-8" standalone="no" ?>
+ */
+class XMLDeclaration : public XMLNode {
+    public:
+        XMLDeclaration() : XMLNode() {};
+        
+        /// The attributes on the declaration
+        vector<XMLAttribute> attributes;
+        
+        WRITE_STYLES
+        
+        template <typename Style>
+        void write_as(string* out, int depth, Style style) const {
+            *out += "<?xml";
+            for (const XMLAttribute& attr : attributes) {
+                *out += ' ';
+                *out += attr.attribute;
+                *out += "=\"";
+                *out += attr.value;
+                *out += '"';
+            }
+            *out += "?>";
+        }
+        
+        virtual void render_into(LineWindow* window, int depth) {
+            if (window->take(false, false)) {
+                window->lines->push_back(EditorLine(false, depth, to_str(0), this));
+            }
+        }
+        
+        XMLNode* copy() const {
+            return copy_of(*this);
+        }
+};
+
+/// XML Doctype
+/** Represents the XML doctype
+ *
+ *  There are a few restrictions on the doctype we don't validate right now...
+ *
+ *  Example doctype: &lt;!DOCTYPE html PUBLIC "-//W3C//DTD XHTML 1.0 Strict//EN"
+ * "http://www.w3.org/TR/xhtml1/DTD/xhtml1-strict.dtd">
+ */
+class XMLDoctype : public XMLNode {
+    public:
+        XMLDoctype() : XMLNode() {};
+        
+        /// Contents of this doctype
+        string text;
+        
+        pair<bool, int> set(int which, string text_) {
+            // we only have one settable thing
+            assert (which == 0);
+            int invalid = find_char<CHAR_CLOSE>(text_);
+            if (invalid != -1) return make_pair(false, invalid);
+            text = text_;
+            return make_pair(true, -1);
+        }
+        
+        vector<string> settable_parts() {
+            vector<string> parts = vector<string>();
+            // only the content is settable
+            string s = text;
+            replace(s.begin(), s.end(), '\n', ' ');
+            parts.push_back(s);
+            return parts;
+        }
+        
+        vector<string> state() const {
+            return vector<string>(1, text);
+        }
+        void restore(const vector<string>& state) {
+            text = state[0];
+        }
+        pair<string, int> get_settable_line(int select_cursor, string edit_buf) {
+            return make_pair("<!DOCTYPE "+edit_buf+">", 10);
+        }
+        
+        WRITE_STYLES
+        
+        template <typename Style>
+        void write_as(string* out, int depth, Style style) const {
+            *out += "<!DOCTYPE ";
+            *out += text;
+            *out += '>';
+        }
+        
+        virtual void render_into(LineWindow* window, int depth) {
+            if (!window->take(found, true)) return;
+            string s = to_str(0);
+            replace(s.begin(), s.end(), '\n', ' ');
+            window->lines->push_back(EditorLine(true, depth, s, this, found));
+        }
+        
+        bool find(const TextSearch& search, const ExpandPolicy& policy) {
+            found = search.in(text);
+            return found;
+        }
+        
+        XMLNode* copy() const {
+            return copy_of(*this);
+        }
+};
+
+/// XML Comment
+/** Represents a XML comment
+ *  A XML comment can occur at any place inside content.  We expose comments
+ *  and allow them to be edited.
+ * 
+ *  Example comment: &lt;!-- hello! -->
+ */
+class XMLComment : public XMLNode {
+    public:
+        XMLComment(string comment) : XMLNode(), comment(comment) {};
+        
+        /// The text of the comment
+        string comment;
+        
+        pair<bool, int> set(int which, string text) {
+            // we only have one settable thing
+            assert (which == 0);
+            // TODO no -- can be present
+            comment = text;
+            return make_pair(true, -1);
+        }
+        
+        vector<string> settable_parts() {
+            vector<string> parts = vector<string>();
+            // only the comment is settable
+            parts.push_back(comment);
+            return parts;
+        }
+        
+        vector<string> state() const {
+            return vector<string>(1, comment);
+        }
+        void restore(const vector<string>& state) {
+            comment = state[0];
+        }
+        pair<string, int> get_settable_line(int select_cursor, string edit_buf) {
+            return make_pair("<!--"+edit_buf+"-->", 4);
+        }
+        
+        WRITE_STYLES
+        
+        template <typename Style>
+        void write_as(string* out, int depth, Style style) const {
+            // the parent indents comments too, so they end up indented twice
+            if (Style::indented) out->append(depth, TAB);
+            *out += "<!--";
+            *out += comment;
+            *out += "-->";
+        }
+        
+        bool find(const TextSearch& search, const ExpandPolicy& policy) {
+            found = search.in(comment);
+            return found;
+        }
+        
+        const string& path_name() const {
+            static const string name = "#comment";
+            return name;
+        }
+        
+        void hash_node() {
+            hash = combine_hashes(hash_bytes(path_name()), hash_bytes(comment));
+        }
+        bool equals(const XMLNode* other) const {
+            const XMLComment* other_comment = dynamic_cast<const XMLComment*>(other);
+            return other_comment && other_comment->comment == comment;
+        }
+        XMLNode* copy() const {
+            return copy_of(*this);
+        }
+        
+        long long census(HeapCensus* census) const {
+            CensusEntry entry;
+            entry.count = 1;
+            entry.object_bytes = sizeof(*this);
+            entry.add_string(comment);
+            census->types["XMLComment"].add(entry);
+            return entry.bytes();
+        }
+};
+
+/// How many megabytes of edits are kept for undoing by default
+#define JOURNAL_DEFAULT_LIMIT 64
+
+/// An edit which can be undone, see EditJournal
+/** Undoing an edit and doing it again are the same operation: a set swaps
+ *  the node's state with the one kept, and an insertion or deletion moves
+ *  the node between the document and the entry.  Deleted nodes are kept
+ *  whole, so undoing takes time proportional to the edit itself.
+ */
+struct JournalEntry {
+    /// The edited node
+    XMLNode* node = NULL;
+    /// The tags from the root down to the node's parent
+    /** Empty for the root and the doctype. */
+    vector<XMLTag*> ancestors;
+    /// Where each tag after the root, and then the node, is in its parent
+    vector<size_t> positions;
+    /// Whether the node was inserted or deleted, rather than set
+    bool structural = false;
+    /// Whether the node is out of the document, and so owned by the entry
+    bool detached = false;
+    /// The node's state from before a set, or after it once undone
+    vector<string> state;
+    /// Which of the node's lines was edited, see EditorLine::part
+    int part = 0;
+    /// Whether the edit is undone and done again with the one before it
+    /** For edits made of several, like splitting text to insert a node
+     *  in the middle of it. */
+    bool joined = false;
+    /// The memory the entry keeps
+    long long bytes = 0;
+    
+    /// Undoes the edit, or does it again if it's been undone
+    void flip() {
+        if (!structural) {
+            vector<string> current = node->state();
+            node->restore(state);
+            state.swap(current);
+            return;
+        }
+        vector<XMLNode*>& children = ancestors.back()->children;
+        if (detached) {
+            children.insert(children.begin() + positions.back(), node);
+        } else {
+            assert (children[positions.back()] == node);
+            children.erase(children.begin() + positions.back());
+        }
+        detached = !detached;
+    }
+    
+    /// Frees the node if the entry owns it
+    void release() {
+        if (detached) XMLNode::release(node);
+        detached = false;
+    }
+};
+
+/// The edits which can be undone and redone
+/** The journal only holds edits up to a limit of memory; the oldest ones
+ *  are forgotten first.  The edits are undone in reverse order, so the
+ *  places they were done in are still where they were.  Anything which
+ *  changes the document without going through the journal has to clear
+ *  it.
+ */
+class EditJournal {
+    public:
+        EditJournal() : done(0), bytes(0) {};
+        ~EditJournal() {
+            clear();
+        }
+        
+        /// How much memory the edits may keep, in bytes
+        long long limit = JOURNAL_DEFAULT_LIMIT * 1048576LL;
+        
+        /// Adds an edit which has just been done
+        /** The edits which were undone can't be redone anymore. */
+        void record(const JournalEntry& entry) {
+            while (entries.size() > done) {
+                forget(entries.back());
+                entries.pop_back();
+            }
+            entries.push_back(entry);
+            bytes += entry.bytes;
+            done++;
+            while (bytes > limit && entries.size()) {
+                forget(entries.front());
+                entries.pop_front();
+                done--;
+                // edits done together are forgotten together
+                while (entries.size() && entries.front().joined) {
+                    forget(entries.front());
+                    entries.pop_front();
+                    done--;
+                }
+            }
+        }
+        
+        /// Joins the edit just recorded to the one before, see
+        /// JournalEntry::joined
+        /** If the one before was already forgotten, the edit is forgotten
+         *  too, so the rest of the edits done together can't be undone
+         *  without it. */
+        void join() {
+            // edits are forgotten oldest first, so the one before is only
+            // left if something is
+            if (entries.size() > 1) {
+                entries.back().joined = true;
+            } else if (entries.size()) {
+                forget(entries.back());
+                entries.pop_back();
+                done--;
+            }
+        }
+        
+        /// Undoes the last edit
+        /** \return The edit, the first one of edits done together, or
+         *  NULL if there's none */
+        JournalEntry* undo() {
+            if (done == 0) return NULL;
+            JournalEntry* entry;
+            do {
+                entry = &entries[--done];
+                entry->flip();
+            } while (entry->joined && done > 0);
+            return entry;
+        }
+        
+        /// Does the last undone edit again
+        /** \return The edit, the last one of edits done together, or NULL
+         *  if there's none */
+        JournalEntry* redo() {
+            if (done == entries.size()) return NULL;
+            JournalEntry* entry;
+            do {
+                entry = &entries[done++];
+                entry->flip();
+            } while (done < entries.size() && entries[done].joined);
+            return entry;
+        }
+        
+        /// Forgets all the edits
+        void clear() {
+            for (JournalEntry& entry : entries) {
+                entry.release();
+            }
+            entries.clear();
+            done = 0;
+            bytes = 0;
+        }
+    private:
+        /// The edits, oldest first
+        deque<JournalEntry> entries;
+        /// How many of the edits are done, the rest were undone
+        size_t done;
+        /// The memory the edits keep
+        long long bytes;
+        
+        void forget(JournalEntry& entry) {
+            bytes -= entry.bytes;
+            entry.release();
+        }
+};
+
+/// XML Document
+/** Represents the entire XML document in memory
+ *  
+ */
+class XMLDocument {
+    public:
+        /// Whether the document has a declaration
+        bool have_declaration=false;
+        /// The XML declaration, if any
+        XMLDeclaration declaration;
+        
+        /// Whether the document has a doctype
+        bool have_doctype=false;
+        /// The XML doctype, if any
+        XMLDoctype doctype;
+        
+        /// The root tag, which is necessary
+        XMLTag root;
+        
+        /// Constructor
+        XMLDocument() {};
+        
+        /// Parse the XML document inside the provided document
+        /** When an error is encountered, according to the XML specification,
+         *  no further attempt at parsing should be made.  XMLDocument throws
+         *  an exception with an appropriate message.  Nonetheless, the partial
+         *  document up to the error has been parsed and is available for
+         *  inspection.
+         *  
+         *  The document has to be valid UTF-8, or US-ASCII if its declaration
+         *  says so; other declared encodings aren't checked.  The check runs
+         *  a chunk ahead of the parser, and an invalid character is only
+         *  reported once the parser gets to it.
+         *  
+         * \param filename The filename to open, or - for stdin
+         */
+        bool parse(string filename) {
+            SourceFile source (filename);
+            return parse(source.data(), source.length());
+        }
+        
+        /// Parse the XML document from an already open stream
+        /** Behaves like parse(string), see there for details about errors.
+         *  The stream doesn't need to be seekable, so pipes work too; it's
+         *  read whole before parsing.
+         *
+         * \param stream The stream to read the document from
+         */
+        bool parse(istream& stream) {
+            string source = read_stream(stream);
+            return parse(source.data(), source.length());
+        }
+        
+        /// Parse the XML document from a buffer in memory
+        /** Behaves like parse(string), see there for details about errors.
+         *  The buffer isn't copied and only needs to live until this returns.
+         *
+         * \param data The document
+         * \param length The length of the document in bytes
+         */
+        bool parse(const char* data, size_t length) {
+            in_begin = data;
+            in_pos = data;
+            in_end = data + length;
+            in_eof = false;
+            source_length = length;
+            // nothing is checked until the encoding is known
+            in_encoding = ENCODING_UNCHECKED;
+            in_checked = in_end;
+            in_invalid = NULL;
+            // the index can be built alongside parsing, if it's wanted
+            line_index.reset(data, length);
+            thread indexer;
+            if (index_lines) indexer = thread(&LineIndex::build, &line_index);
+            try {
+                parse_buffer();
+            } catch (char const* message) {
+                if (indexer.joinable()) indexer.join();
+                last_parsed_offset = in_pos - in_begin;
+                last_parsed_line = line_index.line_of(last_parsed_offset);
+                last_parsed_column = line_index.column_of(last_parsed_offset);
+                finish_line_index();
+                finish_sharing();
+                throw;
+            }
+            if (indexer.joinable()) indexer.join();
+            finish_line_index();
+            finish_sharing();
+            return true;
+        }
+        
+        /// Expands the document down to a byte offset of the parsed document
+        /** The tags on the way to the node starting closest before offset
+         *  are expanded, so it gets rendered.  Throws "can't go to an
+         *  offset in shared subtrees" with share_subtrees, as every place
+         *  of a shared subtree has the offsets of the first.
+         *  \return The line of the node, or of the line of text the offset
+         *  is in */
+        int go_to_offset(size_t offset) {
+            if (share_subtrees) throw "can't go to an offset in shared subtrees";
+            matches_stale = true;
+            int line = prolog_lines();
+            if (have_doctype && offset < root.source_offset) return line-1;
+            XMLTag* tag = &root;
+            int depth = 0;
+            while (true) {
+                tag->page_in();
+                int i = tag->child_at(offset);
+                if (i == -1) return line;
+                tag->forget_line_count();
+                // the start tag and the children before; runs have neither
+                // a start tag nor a depth of their own
+                if (!tag->run) {
+                    tag->set_expanded(true, policy);
+                    line++;
+                    depth++;
+                }
+                for (int j=0; j<i; j++) {
+                    line += tag->children[j]->line_count(policy, depth);
+                }
+                // the tags on the way are expanded by hand, so they can't
+                // be shared
+                XMLNode* child = tag->own_child(i);
+                XMLContent* text = dynamic_cast<XMLContent*>(child);
+                if (text) return line + text->line_at(offset);
+                tag = dynamic_cast<XMLTag*>(child);
+                if (tag == NULL) return line;
+            }
+        }
+        
+        /// Expands the document down to a line of the parsed document
+        /** Needs index_lines to have been set while parsing.
+         *  \param line The line, counted from 1
+         *  \return The line of the node starting closest before the line's
+         *  end, see go_to_offset() */
+        int go_to_line(int line) {
+            size_t offset = line_index.offset_of(line+1);
+            return go_to_offset(offset ? offset-1 : 0);
+        }
+        
+        /// Sets a part of a node, so it can be undone
+        /** See XMLNode::set().  A shared node is copied first, see
+         *  own_node(). */
+        pair<bool, int> set(XMLNode* node, int which, string text) {
+            node = own_node(node);
+            vector<string> before = node->state();
+            pair<bool, int> result = node->set(which, text);
+            // the parts of text are its lines
+            if (result.first) record_set(node, before, dynamic_cast<XMLContent*>(node) ? which : 0);
+            return result;
+        }
+        
+        /// Deletes a part of a node, so it can be undone
+        /** See XMLNode::del() and own_node(). */
+        bool del(XMLNode* node, int which) {
+            node = own_node(node);
+            vector<string> before = node->state();
+            bool deleted = node->del(which);
+            if (deleted) record_set(node, before);
+            return deleted;
+        }
+        
+        /// Deletes a node
+        /** Attempts to delete node.  The node is kept in the journal
+         *  rather than freed, so the deletion can be undone.  Shared tags
+         *  containing it are copied first, see own_node(). */
+	    /** \param node The node to delete
+          * \return True if succesful  */
+        bool del_node(XMLNode* node) {
+            // can't delete the root node...
+            if (node == &root) return false;
+            node = own_node(node);
+            JournalEntry entry;
+            if (!root.path_to(node, &entry.ancestors, &entry.positions)) return false;
+            keep_pages(entry.ancestors);
+            entry.node = node;
+            entry.structural = true;
+            HeapCensus census;
+            entry.bytes = sizeof(entry) + node->census(&census);
+            entry.flip();
+            journal.record(entry);
+            modified = true;
+            return true;
+        }
+        
+        /// Deletes what's on a rendered line
+        /** That's the node, see del_node(), or only the line for text
+         *  spanning several.
+         *  \param i The line
+         *  \return True if succesful */
+        bool del_line(int i) {
+            XMLContent* text = dynamic_cast<XMLContent*>(own_node(line(i).node));
+            if (text == NULL || text->text_lines() < 2) return del_node(line(i).node);
+            int part = line(i).part;
+            vector<string> before = text->state();
+            text->erase_line(part);
+            record_set(text, before, part);
+            return true;
+        }
+        
+        /// Inserts a new node after what's on a rendered line
+        /** Like ins_node(), except that new text goes into the text on the
+         *  line as a line of its own, and other nodes inserted in the middle
+         *  of text split it in two.  Either way it takes one undo, and the
+         *  journal keeps or forgets the edits together.
+         *  \param i The line
+         *  \param new_node The node to insert, which is freed if it's
+         *  merged or can't be inserted
+         *  \return True if succesful */
+        bool ins_line(int i, XMLNode* new_node) {
+            XMLNode* node = own_node(line(i).node);
+            int part = line(i).part;
+            XMLContent* text = dynamic_cast<XMLContent*>(node);
+            if (text == NULL) return ins_node(node, !line(i).selectable, new_node);
+            vector<string> before = text->state();
+            XMLContent* added = dynamic_cast<XMLContent*>(new_node);
+            if (added) {
+                text->insert_line(part+1, added->content);
+                delete new_node;
+                record_set(text, before, part+1);
+                return true;
+            }
+            if (part+1 == (int)text->text_lines()) return ins_node(text, true, new_node);
+            // the lines after go into text of their own, after the new node
+            XMLContent* rest = text->split(part+1);
+            record_set(text, before);
+            ins_node(text, true, rest);
+            journal.join();
+            ins_node(text, true, new_node);
+            journal.join();
+            return true;
+        }
+        
+        /// Inserts a new node
+        /** Attempts to insert new_node into or after node.  Shared tags it
+         *  goes into are copied first, see own_node(). */
+	    /** \param node The node to work with
+	      * \param force_after Whether to put the node after the current node
+	      * \param new_node The new node to be inserted */
+	    /** \return True if succesful */
+        bool ins_node(XMLNode* node, bool force_after, XMLNode* new_node) {
+            // can't insert anything after the root node...
+            if (!(node == &root && force_after)) {
+                node = own_node(node);
+                if (root.ins_node(node, force_after, new_node)) {
+                    JournalEntry entry;
+                    root.path_to(new_node, &entry.ancestors, &entry.positions);
+                    keep_pages(entry.ancestors);
+                    entry.node = new_node;
+                    entry.structural = true;
+                    HeapCensus census;
+                    entry.bytes = sizeof(entry) + new_node->census(&census);
+                    journal.record(entry);
+                    modified = true;
+                    return true;
+                }
+            }
+            // we've failed to insert it, so get rid of it.
+            delete new_node;
+            return false;
+        }
+        
+        /// Returns a string representation of the XML document
+        /** suxml has a particular idea about how whitespace is used in XML.
+         *  This results in monolithic output, but doesn't preserve some
+         *  user whitespace.  In most cases, this is acceptable, because
+         *  consecutive whitespace doesn't convey extra meaning.
+         *  The newline parameter specifies whether to include a stray
+         *  newline at the end of the document.
+         *
+         *  \param newline Whether to insert a stray newline at the end of
+         *      the document
+         *  \param style How to lay the document out, see PrettyStyle,
+         *      CompactStyle and MinifiedStyle
+         *
+	     *  \return String representation of the XML document */
+        string to_str(bool newline, OutputStyle style = OUTPUT_PRETTY) const {
+            string out = "";
+            write_document(&out, newline, style);
+            return out;
+        }
+        
+        /// Writes the XML document into a file
+        /** Files ending in .gz or .zst are compressed.  The filename -
+         *  writes to stdout.  Throws "failed to write" on failure.
+         *
+         *  The output is written while it's being made, see StreamedOutput,
+         *  so it's never in memory whole.  When tags are paged out, the file
+         *  they're read from mustn't change under them, so the document is
+         *  written next to the file and renamed over it.  So are compressed
+         *  files, so a failed write leaves the file as it was.
+         *
+         *  \param filename The file to write
+         *  \param newline Whether to insert a stray newline at the end of
+         *      the document
+         *  \param style How to lay the document out */
+        void save(string filename, bool newline, OutputStyle style = OUTPUT_PRETTY) const {
+            if (filename == "-") {
+                cout.flush();
+                bool written = stream_to(stdout, newline, style);
+                if (fflush(stdout) != 0 || !written) throw "failed to write";
+                return;
+            }
+            Compression compression = compression_from_name(filename);
+            // compressed files are written next to the file too, as the
+            // shell would truncate it before anything is written
+            bool replace = pager || compression != COMPRESSION_NONE;
+            string target = filename;
+            FILE* file = NULL;
+            if (replace) {
+                target += ".XXXXXX";
+                int fd = mkstemp(&target[0]);
+                if (fd < 0) throw "failed to write";
+                if (compression != COMPRESSION_NONE) {
+                    close(fd);
+                    file = popen(compression_command(compression, target, false).c_str(), "w");
+                } else {
+                    file = fdopen(fd, "wb");
+                    if (file == NULL) close(fd);
+                }
+                if (file == NULL) {
+                    remove(target.c_str());
+                    throw "failed to write";
+                }
+            } else {
+                file = fopen(filename.c_str(), "wb");
+                if (file == NULL) throw "failed to write";
+            }
+            bool written = stream_to(file, newline, style);
+            int closed = compression != COMPRESSION_NONE ? pclose(file) : fclose(file);
+            if (closed != 0 || !written) {
+                // the file is left as it was
+                if (replace) remove(target.c_str());
+                throw "failed to write";
+            }
+            if (replace) {
+                // the file keeps its permissions, new files get the usual
+                struct stat info;
+                mode_t mode;
+                if (stat(filename.c_str(), &info) == 0) {
+                    mode = info.st_mode & 07777;
+                } else {
+                    mode_t mask = umask(0);
+                    umask(mask);
+                    mode = 0666 & ~mask;
+                }
+                chmod(target.c_str(), mode);
+                if (rename(target.c_str(), filename.c_str()) != 0) {
+                    remove(target.c_str());
+                    throw "failed to write";
+                }
+            }
+        }
+        
+        /// Renders the whole XML document into EditorLines
+        /** This generates a representation of the document,
+         *  respecting things like expanded nodes or searches, for the editor.
+         *  The editor itself only renders what fits on the screen, see
+         *  render_window().
+         */
+        void render() {
+            render_window(0, INT_MAX);
+        }
+        
+        /// Renders some lines of the XML document into EditorLines
+        /** Only the nodes before the window which are expanded since their
+         *  lines were last counted are gone through, so this takes time
+         *  proportional to the window, not the document.
+         *
+         *  \param first The first line to render
+         *  \param count How many lines to render, fewer at the end */
+        void render_window(int first, int count) {
+            editor_lines.clear();
+            // nothing holds on to the nodes of the last window anymore
+            if (pager) pager->trim(policy);
+            window_top = first;
+            LineWindow window (first, count, &editor_lines, &policy, NULL);
+            render_lines(&window);
+        }
+        
+        /// Gets a rendered line
+        /** \param i The line, which has to be inside the rendered window */
+        EditorLine& line(int i) {
+            return editor_lines[i - window_top];
+        }
+        
+        /// Counts the lines of the whole document
+        /** The count is cached, only the parts changed since the last
+         *  count are counted again. */
+        int line_count() {
+            return prolog_lines() + root.line_count(policy, 0);
+        }
+        
+        /// Whether the node on a rendered line is expanded
+        bool is_expanded(int i) {
+            return line(i).node->is_expanded(policy, line(i).depth);
+        }
+        
+        /// Expands or collapses the node on a rendered line by hand
+        void set_expanded(int i, bool expanded) {
+            changing(i);
+            line(i).node->set_expanded(expanded, policy);
+        }
+        
+        /// Expands the tags down to a depth, and collapses the rest
+        /** Takes constant time, the nodes aren't visited.
+         *  \param depth How many levels to expand, 1 is just the root */
+        void expand_to(int depth) {
+            policy.depth = depth;
+            policy.epoch++;
+            policy.generation++;
+            matches_stale = true;
+        }
+        
+        /// Expands all nodes
+        void expand_all() {
+            expand_to(INT_MAX);
+        }
+        
+        /// Tells the document the node on a line is about to be changed
+        /** Has to be called before the node is expanded, edited, deleted or
+         *  has a node inserted after it, so the line counts of the tags
+         *  containing it are counted again.  If the node or the tags
+         *  containing it are shared, they're copied and the window is
+         *  rendered again, see XMLNode::refs.
+         *
+         *  \param i The line of the node */
+        void changing(int i) {
+            i -= prolog_lines();
+            matches_stale = true;
+            if (i < 0) return;
+            // go down to the line, through the tags containing it
+            XMLTag* tag = &root;
+            int depth = 0;
+            bool copied = false;
+            while (tag != NULL) {
+                tag->forget_line_count();
+                if (!tag->run) {
+                    if (i == 0 || !tag->is_open(policy, depth)) break;
+                    i--;
+                    depth++;
+                }
+                tag->page_in();
+                XMLTag* next = NULL;
+                for (size_t j=0; j<tag->children.size(); j++) {
+                    XMLNode* child = tag->children[j];
+                    int lines = child->line_count(policy, depth);
+                    if (i < lines) {
+                        // shared nodes are copied, as they change in one place
+                        if (child->refs > 1) {
+                            child = tag->own_child(j);
+                            copied = true;
+                        }
+                        next = dynamic_cast<XMLTag*>(child);
+                        break;
+                    }
+                    i -= lines;
+                }
+                tag = next;
+            }
+            // the rendered lines have to point to the copies
+            if (copied) render_window(window_top, editor_lines.size());
+        }
+        
+        /// Finds and marks all nodes containing the specified text
+        /** Element names, attribute names and values, text content,
+         *  comments and the doctype are all searched.  Matches are
+         *  expanded into view and everything else is collapsed; their
+         *  lines are listed by matches().
+         *
+         *  \param str The text to search for */
+        void find(string str) {
+            TextSearch search = TextSearch(str);
+            expand_to(0);
+            if (have_doctype) doctype.find(search, policy);
+            root.find(search, policy);
+        }
+        
+        /// Applies an edit to many nodes at once
+        /** The tree is gone through once.  The root can be renamed, have its
+         *  attributes changed or be wrapped, but it can't be deleted or
+         *  unwrapped.  Everything is counted again afterwards.
+         *
+         *  \param edit The edit
+         *  \param path Which nodes to edit, or NULL for the ones found by
+         *  the last search, see find()
+         *  \return How many nodes were edited */
+        long long bulk_edit(const BulkEdit& edit, const ElementPath* path) {
+            bool matched = path ? path->matches(1, root.element, true) : root.found;
+            bool leads_to = path && path->leads_to(1, root.element, true);
+            long long edited = root.bulk_edit(edit, path, 2, leads_to, policy);
+            if (matched && edit.operation == BULK_WRAP) {
+                // the root is part of the document, so its insides move
+                XMLTag* wrapped = new XMLTag();
+                wrapped->element.swap(root.element);
+                wrapped->attributes.swap(root.attributes);
+                wrapped->children.swap(root.children);
+                wrapped->subtree_nodes = root.subtree_nodes;
+                wrapped->source_offset = root.source_offset;
+                wrapped->found = root.found;
+                wrapped->expanded = root.expanded;
+                wrapped->expand_epoch = root.expand_epoch;
+                root.element = edit.name;
+                root.changed();
+                root.children.push_back(wrapped);
+                root.subtree_nodes++;
+                root.found = false;
+                root.set_expanded(true, policy);
+                edited++;
+            } else if (matched && edit.operation != BULK_DELETE && edit.operation != BULK_UNWRAP) {
+                root.apply(edit);
+                edited++;
+            }
+            policy.generation++;
+            matches_stale = true;
+            // the journal's places in the document are gone
+            journal.clear();
+            modified = true;
+            return edited;
+        }
+        
+        /// Undoes the last edit
+        /** The tags containing the edit are expanded.
+         *  \return The line of the edit, or -1 if there's nothing to undo */
+        int undo() {
+            return show_edit(journal.undo());
+        }
+        
+        /// Does the last undone edit again
+        /** \return The line of the edit, or -1 if there's nothing to redo */
+        int redo() {
+            return show_edit(journal.redo());
+        }
+        
+        /// Finds where a node is in the document
+        /** \param node The node
+         *  \param positions Where to put where the node and the tags
+         *  containing it are among their parents' children, from the root
+         *  down; empty for the root
+         *  \return Whether the node is the root or inside it */
+        bool path_of(XMLNode* node, vector<size_t>* positions) {
+            vector<XMLTag*> ancestors;
+            return node == &root || root.path_to(node, &ancestors, positions);
         }
         
-        virtual string to_str(int depth) const {
-            if (!children.size() && !expanded) {
-                return get_start_str();
-            } else {
-                string out = "";
-                out += get_start_str();
-                // we let the children to_str() too
-                for (auto child_p : children) {
-                    string child_str = (*child_p).to_str(depth+1);
-                    if (!is_whitespace(child_str)) {
-                        out += "\n";
-                        out += string(depth+1, TAB);
-                        out += child_str;
-                    }
+        /// Finds the line of the node at a path, see path_of()
+        /** Paths past the end of a tag's children end up on its end tag.
+         *  \param positions The path
+         *  \param expand Whether to expand the tags on the way; otherwise
+         *  the line of the first closed tag is given
+         *  \return The line */
+        int line_of_path(const vector<size_t>& positions, bool expand) {
+            matches_stale = true;
+            int line = prolog_lines();
+            XMLTag* tag = &root;
+            int depth = 0;
+            for (size_t step=0; step<positions.size() && tag != NULL; step++) {
+                tag->forget_line_count();
+                // a tag which lost its only child stays closed, and runs
+                // have no line or depth of their own
+                if (!tag->run) {
+                    if (!tag->has_children()) return line;
+                    if (expand) tag->set_expanded(true, policy);
+                    else if (!tag->is_open(policy, depth)) return line;
+                    line++;
+                    depth++;
                 }
-                out += "\n";
-                out += string(depth, TAB);
-                out += get_end_str();
-                return out;
+                tag->page_in();
+                size_t position = positions[step] < tag->children.size() ? positions[step] : tag->children.size();
+                for (size_t i=0; i<position; i++) {
+                    line += tag->children[i]->line_count(policy, depth);
+                }
+                tag = position < tag->children.size() ? dynamic_cast<XMLTag*>(tag->children[position]) : NULL;
             }
+            return line;
         }
         
-        void render_into(vector<EditorLine>* lines, int depth) {
-            if (expanded) { // and children.size()
-                lines->push_back(EditorLine(true, depth, get_start_str(), this, found));
-                for (auto& child : children) {
-                    child->render_into(lines, depth+1);
-                }
-                lines->push_back(EditorLine(false, depth, get_end_str(), this, found));
-            } else if (children.size()) {
-                // we have children which will be shown if expanded - convey
-                // this with ...
-                lines->push_back(EditorLine(true, depth, get_start_str()+" ...", this, found));
-            } else {
-                lines->push_back(EditorLine(true, depth, get_start_str(), this, found));
+        /// Parses the document again after its file changed
+        /** Only the children covering the changed bytes are parsed again,
+         *  in the deepest tag whose start and end tags are outside the
+         *  change; the nodes before them are kept as they are, and the ones
+         *  after are kept and moved by how much the file grew.  When there's
+         *  no such tag, or the document was edited since it was parsed, the
+         *  whole document is parsed again.  Either way, nodes which end up
+         *  in the same place keep whether they're expanded and found.
+         *  Passing 0 for both prefix and suffix parses everything again.
+         *  Throws like parse() when the new contents don't parse, leaving
+         *  the document as it was.
+         *
+         *  \param data The new contents
+         *  \param length The length of the new contents
+         *  \param prefix How many bytes at the start are the same as in what
+         *  the document was parsed from
+         *  \param suffix How many bytes at the end are the same, not
+         *  overlapping the prefix */
+        void reload(const char* data, size_t length, size_t prefix, size_t suffix) {
+            if (modified || !reparse_change(data, length, prefix, suffix)) {
+                reparse_whole(data, length);
+            }
+            source_length = length;
+            if (index_lines) {
+                line_index.reset(data, length);
+                line_index.build();
+                line_index.detach();
             }
+            journal.clear();
+            modified = false;
+            policy.generation++;
+            matches_stale = true;
         }
         
-        pair<string, int> get_settable_line(int select_cursor, string edit_buf) {
-            // the reason this looks the way it does is so we can
-            // easily get the select_x value (offset from left)
-            int i=0;
-            int select_x = 0;
-            string line = "";
-            for (string part : settable_parts()) {
-                if (i == 0) line += "<";
-                else if (i % 2 == 0) line += "=\"";
-                else line += " ";
-                if (i == select_cursor) {
-                    select_x = line.length();
-                    line += edit_buf;
-                } else {
-                    line += part;
-                }
-                if (i != 0 && i % 2 == 0) line += "\"";
-                i++;
+        /// Lists the lines of the nodes found by the last search
+        /** The lines are listed again after anything changes, which
+         *  needs going through all of them.
+         *  \return The lines, in document order */
+        const vector<int>& matches() {
+            if (matches_stale) {
+                match_lines.clear();
+                LineWindow window (0, 0, NULL, &policy, &match_lines);
+                render_lines(&window);
+                matches_stale = false;
             }
-            if (children.size() == 0 and !expanded) line += "/";
-            line += ">";
-            return make_pair(line, select_x);
+            return match_lines;
         }
         
-        bool find(string str) {
-            // we're not expanded by default
-            expanded = false;
-            for (auto& child : children) {
-                if (child->find(str)) {
-                    // some of our children or grand-children (...) matched,
-                    // so expand us
-                    expanded = true;
-                }
+        /// Counts the memory used by the document
+        /** The root tag, declaration and doctype are part of the document
+         *  object, so only their strings and vectors are counted.
+         *  The editor lines are counted as they were last rendered.
+         *
+         *  \param census The census to fill in */
+        void census(HeapCensus* census) const {
+            root.census(census);
+            CensusEntry& root_entry = census->types["XMLTag"];
+            root_entry.object_bytes -= sizeof(root);
+            CensusEntry& root_element = census->elements[root.element];
+            root_element.object_bytes -= sizeof(root);
+            root_element.subtree_bytes -= sizeof(root);
+            
+            CensusEntry& lines = census->editor_lines;
+            lines.count = editor_lines.size();
+            lines.object_bytes = editor_lines.capacity() * sizeof(EditorLine);
+            lines.slack_bytes = (editor_lines.capacity() - editor_lines.size()) * sizeof(EditorLine);
+            for (const EditorLine& line : editor_lines) {
+                lines.add_string(line.text);
             }
-            if (element == str) {
-                // it's us!
-                found = true;
-                expanded = true;
-                // tell (grand...)parents to expand
-                return true;
+        }
+        
+        /// The line a parsing error was found on, counted from 1
+        int last_parsed_line = 0;
+        /// The column a parsing error was found on, in bytes from 1
+        int last_parsed_column = 0;
+        /// The byte offset a parsing error was found at
+        size_t last_parsed_offset = 0;
+        
+        /// Whether to keep identical subtrees only once while parsing
+        /** Parsed nodes are hashed, and a node the same as one parsed
+         *  before at the same depth, with the same children, is replaced by
+         *  it, so repeated subtrees only take memory once.  Shared nodes
+         *  are copied when they're changed, see XMLNode::refs.  Their
+         *  source offsets are the first one's, so documents parsed this way
+         *  can't be reloaded. */
+        bool share_subtrees = false;
+        
+        /// Whether to index the lines of the parsed document
+        /** The index is needed by go_to_line(), and is built in another
+         *  thread while parsing. */
+        bool index_lines = false;
+        /// The lines of the parsed document
+        LineIndex line_index;
+        
+        /// Whether the document was edited since it was parsed
+        /** Cleared by reload(), and should be cleared by whoever saves the
+         *  document. */
+        bool modified = false;
+        
+        /// Where tags are paged out to, NULL if the whole document is in memory
+        /** See PageStore::load().  Paged out tags are read back as they're
+         *  needed, and the ones not needed are paged out again before
+         *  rendering. */
+        Pager* pager = NULL;
+        
+        /// Moves the source offsets of a subtree
+        static void move_offsets(XMLNode* node, long long by) {
+            node->source_offset += by;
+            XMLTag* tag = dynamic_cast<XMLTag*>(node);
+            if (tag == NULL) return;
+            for (XMLNode* child : tag->children) {
+                move_offsets(child, by);
             }
-            if (expanded) return true; // found in a child
-            return false;
         }
         
-        void expand_all() {
-            if (children.size()) expanded = true;
-            for (auto& child : children) {
-                child->expand_all();
+        /// Which nodes are expanded in the editor
+        ExpandPolicy policy;
+        /// The edits which can be undone
+        EditJournal journal;
+        /// The rendered lines of the editor, see render_window()
+        vector<EditorLine> editor_lines;
+        /// The line editor_lines start at
+        int window_top = 0;
+    private:
+        /// The lines matched by the last search, see matches()
+        vector<int> match_lines;
+        /// Whether match_lines needs to be listed again
+        bool matches_stale = true;
+        
+        /// How many lines come before the root tag
+        int prolog_lines() const {
+            return have_declaration + have_doctype;
+        }
+        
+        /// Parses the changed part of the document again, see reload()
+        /** \return Whether it could be done */
+        bool reparse_change(const char* data, size_t length, size_t prefix, size_t suffix) {
+            if (prefix + suffix > source_length || prefix + suffix > length) return false;
+            size_t change_end = source_length - suffix;
+            long long growth = (long long)length - (long long)source_length;
+            // go down to the deepest tag with the change between its children
+            vector<XMLTag*> tags;
+            vector<size_t> positions;
+            size_t from = 0, to = 0;
+            XMLTag* tag = &root;
+            while (changed_children(tag, prefix, change_end, &from, &to)) {
+                tags.push_back(tag);
+                if (to != from+1) break;
+                tag = dynamic_cast<XMLTag*>(tag->children[from]);
+                if (tag == NULL) break;
+                positions.push_back(from);
+            }
+            if (tags.empty()) return false;
+            if (positions.size() == tags.size()) {
+                // the innermost tag didn't have the change between children
+                positions.pop_back();
+                changed_children(tags.back(), prefix, change_end, &from, &to);
+            }
+            tag = tags.back();
+            
+            // parse the children as those of a document of their own
+            size_t start = tag->children[from]->source_offset;
+            size_t end = tag->children[to]->source_offset + growth;
+            string head = have_declaration ? declaration.to_str() : "";
+            head += "<r>";
+            string buffer = head + string(data + start, end - start) + "</r>";
+            XMLDocument fragment;
+            try {
+                fragment.parse(buffer.data(), buffer.length());
+            } catch (char const* message) {
+                return false;
+            }
+            vector<XMLNode*>& parsed = fragment.root.children;
+            long long counted = 0;
+            for (size_t i=0; i<parsed.size(); i++) {
+                move_offsets(parsed[i], (long long)start - head.length());
+                counted += parsed[i]->subtree_nodes;
+            }
+            carry_children(&tag->children[from], to - from, parsed.data(), parsed.size());
+            for (size_t i=from; i<to; i++) {
+                counted -= tag->children[i]->subtree_nodes;
+                XMLNode::release(tag->children[i]);
+            }
+            tag->children.erase(tag->children.begin() + from, tag->children.begin() + to);
+            tag->children.insert(tag->children.begin() + from, parsed.begin(), parsed.end());
+            to = from + parsed.size();
+            parsed.clear();
+            
+            // everything after the change moved
+            for (size_t depth=0; depth<tags.size(); depth++) {
+                size_t after = depth+1 < tags.size() ? positions[depth]+1 : to;
+                for (size_t i=after; i<tags[depth]->children.size(); i++) {
+                    move_offsets(tags[depth]->children[i], growth);
+                }
+                tags[depth]->subtree_nodes += counted;
+                tags[depth]->forget_line_count();
             }
+            return true;
         }
-};
-
-/// XML Declaration
-/** Represents the XML declaration
- *
- *  According to the specification, a XML document may contain a XML declaration
- *  at the start.  We expose this, but do not allow it to be edited
- *  (it wouldn't make sense).
- *
- *  Example declaration: &lt;?xml version="1.0" encoding="UTF-8" standalone="no" ?>
- */
-class XMLDeclaration : public XMLNode {
-    public:
-        XMLDeclaration() : XMLNode() {};
         
-        /// The attributes on the declaration
-        vector<XMLAttribute> attributes;
+        /// Finds the children of a tag which cover a change, see reparse_change()
+        /** Text next to the change could run into it, so the children have
+         *  to be between tags or comments.
+         *  \param from Where to put the first child covering the change
+         *  \param to Where to put the child after the last one, which is
+         *  outside the change
+         *  \return Whether the change is between the tag's children */
+        static bool changed_children(XMLTag* tag, size_t prefix, size_t change_end, size_t* from, size_t* to) {
+            const vector<XMLNode*>& children = tag->children;
+            auto starts_before = [](size_t offset, const XMLNode* node) { return offset < node->source_offset; };
+            auto starts_after = [](const XMLNode* node, size_t offset) { return node->source_offset < offset; };
+            size_t first = upper_bound(children.begin(), children.end(), prefix, starts_before) - children.begin();
+            if (first == 0) return false;
+            first--;
+            while (first > 0 && dynamic_cast<XMLContent*>(children[first-1])) first--;
+            size_t last = lower_bound(children.begin(), children.end(), change_end, starts_after) - children.begin();
+            while (last < children.size() && dynamic_cast<XMLContent*>(children[last])) last++;
+            if (last == children.size()) return false;
+            *from = first;
+            *to = last;
+            return true;
+        }
         
-        string to_str(int depth) const {
-            string out = "<?xml";
-            for (XMLAttribute attr : attributes) {
-                out += " ";
-                out += attr.attribute;
-                out += "=\"";
-                out += attr.value;
-                out += "\"";
-            }
-            out += "?>";
-            return out;
+        /// Parses the whole document again, see reload()
+        void reparse_whole(const char* data, size_t length) {
+            unique_ptr<XMLDocument> fresh (new XMLDocument());
+            try {
+                fresh->parse(data, length);
+            } catch (char const* message) {
+                last_parsed_line = fresh->last_parsed_line;
+                last_parsed_column = fresh->last_parsed_column;
+                last_parsed_offset = fresh->last_parsed_offset;
+                throw;
+            }
+            carry_state(&root, &fresh->root);
+            // the fresh document gets the old contents, and frees them
+            root.element.swap(fresh->root.element);
+            root.attributes.swap(fresh->root.attributes);
+            root.changed();
+            root.children.swap(fresh->root.children);
+            swap(root.subtree_nodes, fresh->root.subtree_nodes);
+            swap(root.source_offset, fresh->root.source_offset);
+            swap(have_declaration, fresh->have_declaration);
+            declaration.attributes.swap(fresh->declaration.attributes);
+            swap(have_doctype, fresh->have_doctype);
+            doctype.text.swap(fresh->doctype.text);
+            swap(doctype.source_offset, fresh->doctype.source_offset);
         }
         
-        virtual void render_into(vector<EditorLine>* lines, int depth) {
-            lines->push_back(EditorLine(false, depth, to_str(0), this));
+        /// Gives a node and the nodes in the same places inside it the
+        /// expansion and search state of an old node
+        static void carry_state(const XMLNode* old_node, XMLNode* node) {
+            node->expanded = old_node->expanded;
+            node->expand_epoch = old_node->expand_epoch;
+            node->set_found(old_node->found);
+            const XMLTag* old_tag = dynamic_cast<const XMLTag*>(old_node);
+            XMLTag* tag = dynamic_cast<XMLTag*>(node);
+            if (old_tag == NULL || tag == NULL) return;
+            carry_children(old_tag->children.data(), old_tag->children.size(),
+                tag->children.data(), tag->children.size());
         }
-};
-
-/// XML Doctype
-/** Represents the XML doctype
- *
- *  There are a few restrictions on the doctype we don't validate right now...
- *
- *  Example doctype: &lt;!DOCTYPE html PUBLIC "-//W3C//DTD XHTML 1.0 Strict//EN"
- * "http://www.w3.org/TR/xhtml1/DTD/xhtml1-strict.dtd">
- */
-class XMLDoctype : public XMLNode {
-    public:
-        XMLDoctype() : XMLNode() {};
         
-        /// Contents of this doctype
-        string text;
+        /// Carries the state of old nodes over to new ones, see carry_state()
+        /** Nodes are paired from the start and from the end, as long as
+         *  their names match, so nodes after an inserted or deleted one
+         *  are still paired. */
+        static void carry_children(XMLNode* const* old_nodes, size_t old_count,
+                                   XMLNode* const* nodes, size_t count) {
+            size_t front = 0;
+            while (front < old_count && front < count
+                   && old_nodes[front]->path_name() == nodes[front]->path_name()) {
+                carry_state(old_nodes[front], nodes[front]);
+                front++;
+            }
+            for (size_t back=1; back <= old_count-front && back <= count-front; back++) {
+                if (old_nodes[old_count-back]->path_name() != nodes[count-back]->path_name()) break;
+                carry_state(old_nodes[old_count-back], nodes[count-back]);
+            }
+        }
         
-        pair<bool, int> set(int which, string text_) {
-            // we only have one settable thing
-            assert (which == 0);
-            int invalid = any_char_in_string(text_, ">");
-            if (invalid != -1) return make_pair(false, invalid);
-            text = text_;
-            return make_pair(true, -1);
+        /// Gets a node to edit, copying it first if it's shared
+        /** Shared nodes change in all their places, so the node and the
+         *  shared tags containing it are copied in the first place it's
+         *  in, see XMLNode::refs.  The editor copies them in the place on
+         *  the cursor's line before, see changing().
+         *  \param node The node
+         *  \return The node to edit, which is only in one place */
+        XMLNode* own_node(XMLNode* node) {
+            if (!share_subtrees || node == &root) return node;
+            vector<XMLTag*> ancestors;
+            vector<size_t> positions;
+            if (!root.path_to(node, &ancestors, &positions)) return node;
+            XMLTag* tag = &root;
+            bool copied = false;
+            for (size_t position : positions) {
+                tag->forget_line_count();
+                if (tag->children[position]->refs > 1) copied = true;
+                node = tag->own_child(position);
+                tag = dynamic_cast<XMLTag*>(node);
+            }
+            // the rendered lines have to point to the copies
+            if (copied) render_window(window_top, editor_lines.size());
+            return node;
         }
         
-        vector<string> settable_parts() {
-            vector<string> parts = vector<string>();
-            // only the content is settable
-            string s = text;
-            replace(s.begin(), s.end(), '\n', ' ');
-            parts.push_back(s);
-            return parts;
+        /// Keeps the paged tags containing an edit in memory
+        /** \param ancestors The tags containing the edit, see
+         *  XMLTag::path_to() */
+        static void keep_pages(const vector<XMLTag*>& ancestors) {
+            for (XMLTag* tag : ancestors) {
+                if (tag->page) tag->page->dirty = true;
+            }
         }
-        pair<string, int> get_settable_line(int select_cursor, string edit_buf) {
-            return make_pair("<!DOCTYPE "+edit_buf+">", 10);
+        
+        /// Records a set in the journal, unless nothing changed
+        /** \param part Which of the node's lines was set */
+        void record_set(XMLNode* node, const vector<string>& before, int part = 0) {
+            if (node->state() == before) return;
+            JournalEntry entry;
+            // the root and the doctype aren't inside anything
+            if (node != &root) root.path_to(node, &entry.ancestors, &entry.positions);
+            keep_pages(entry.ancestors);
+            entry.node = node;
+            entry.state = before;
+            entry.part = part;
+            entry.bytes = sizeof(entry);
+            for (const string& part : before) {
+                entry.bytes += part.capacity();
+            }
+            journal.record(entry);
+            modified = true;
         }
         
-        string to_str(int depth) const {
-            return "<!DOCTYPE "+text+">";
+        /// Expands the document down to an edit which was undone or redone
+        /** \return The line of the node, or where it was */
+        int show_edit(JournalEntry* entry) {
+            if (entry == NULL) return -1;
+            modified = true;
+            if (entry->ancestors.empty()) return entry->node == &root ? prolog_lines() : prolog_lines()-1;
+            int line = line_of_path(entry->positions, true);
+            // a line of text which is gone ends up on the last one left
+            if (entry->part > 0) line += min(entry->part, entry->node->line_count(policy, 0) - 1);
+            return line;
         }
         
-        virtual void render_into(vector<EditorLine>* lines, int depth) {
-            string s = to_str(0);
-            replace(s.begin(), s.end(), '\n', ' ');
-            lines->push_back(EditorLine(true, depth, s, this));
+        /// Goes through the lines of the document
+        void render_lines(LineWindow* window) {
+            if (have_declaration) {
+                declaration.render_into(window, 0);
+            }
+            if (have_doctype) {
+                doctype.render_into(window, 0);
+            }
+            root.render_into(window, 0);
         }
-};
-
-/// XML Comment
-/** Represents a XML comment
- *  A XML comment can occur at any place inside content.  We expose comments
- *  and allow them to be edited.
- * 
- *  Example comment: &lt;!-- hello! -->
- */
-class XMLComment : public XMLNode {
-    public:
-        XMLComment(string comment) : XMLNode(), comment(comment) {};
         
-        /// The text of the comment
-        string comment;
+        /// The length of what the document was parsed from
+        size_t source_length = 0;
+        /// The start of the buffer being parsed
+        const char* in_begin;
+        /// The next character to read
+        const char* in_pos;
+        /// The end of the buffer being parsed
+        const char* in_end;
+        /// Whether a read went past the end of the buffer
+        bool in_eof;
+        /// The last character read
+        char c;
+        /// The encoding the document is checked against
+        Encoding in_encoding;
+        /// How far the encoding has been checked
+        const char* in_checked;
+        /// The first invalid character found, if any
+        const char* in_invalid;
+        /// The nodes parsed so far by their hash and depth, see share()
+        unordered_map<uint64_t, XMLNode*> shared_nodes;
         
-        pair<bool, int> set(int which, string text) {
-            // we only have one settable thing
-            assert (which == 0);
-            // TODO no -- can be present
-            comment = text;
-            return make_pair(true, -1);
+        /// Writes the whole document, see to_str()
+        void write_document(string* out, bool newline, OutputStyle style) const {
+            switch (style) {
+                case OUTPUT_COMPACT: write_document_as(out, newline, CompactStyle()); break;
+                case OUTPUT_MINIFIED: write_document_as(out, newline, MinifiedStyle()); break;
+                default: write_document_as(out, newline, PrettyStyle());
+            }
         }
         
-        vector<string> settable_parts() {
-            vector<string> parts = vector<string>();
-            // only the comment is settable
-            parts.push_back(comment);
-            return parts;
+        /// Writes the whole document in an output style
+        template <typename Style>
+        void write_document_as(string* out, bool newline, Style style) const {
+            if (have_declaration) {
+                declaration.write(out, 0, style);
+                if (Style::indented) *out += '\n';
+            }
+            if (have_doctype) {
+                doctype.write(out, 0, style);
+                if (Style::indented) *out += '\n';
+            }
+            root.write(out, 0, style);
+            if (newline) *out += '\n';
         }
-        pair<string, int> get_settable_line(int select_cursor, string edit_buf) {
-            return make_pair("<!--"+edit_buf+"-->", 4);
+        
+        /// Writes the whole document to a file while it's being made, see save()
+        /** \return Whether everything was written */
+        bool stream_to(FILE* file, bool newline, OutputStyle style) const {
+            StreamedOutput output (file);
+            write_document(&output.out, newline, style);
+            return output.flush();
         }
         
-        string to_str(int depth) const {
-            return string(depth, '\t')+"<!--"+comment+"-->";
+        /// Keeps the line index after parsing only if it's wanted
+        void finish_line_index() {
+            if (index_lines) line_index.detach();
+            else line_index.reset(NULL, 0);
         }
-};
-
-/// XML Document
-/** Represents the entire XML document in memory
- *  
- */
-class XMLDocument {
-    public:
-        /// Whether the document has a declaration
-        bool have_declaration=false;
-        /// The XML declaration, if any
-        XMLDeclaration declaration;
         
-        /// Whether the document has a doctype
-        bool have_doctype=false;
-        /// The XML doctype, if any
-        XMLDoctype doctype;
+        /// Gives a node the same as one parsed before instead, if sharing
+        /** See share_subtrees.  The node's children have to be shared
+         *  already, so comparing them takes constant time.
+         *  \param node The node just parsed, freed if it's replaced
+         *  \param depth How deep the node is, the root being 0
+         *  \return The node to put in the tree */
+        XMLNode* share(XMLNode* node, size_t depth) {
+            if (!share_subtrees) return node;
+            node->hash_node();
+            XMLNode*& before = shared_nodes[combine_hashes(node->hash, depth)];
+            if (before == NULL) before = node;
+            if (before == node || !before->equals(node)) return node;
+            delete node;
+            before->refs++;
+            return before;
+        }
         
-        /// The root tag, which is necessary
-        XMLTag root;
+        /// Forgets the nodes kept for sharing, and marks the tags sharing them
+        void finish_sharing() {
+            if (!share_subtrees) return;
+            unordered_map<uint64_t, XMLNode*>().swap(shared_nodes);
+            unordered_set<XMLTag*> seen;
+            mark_shared(&root, &seen);
+        }
         
-        /// Constructor
-        XMLDocument() {};
+        /// Sets XMLTag::has_shared in a subtree, going through shared tags once
+        /** \return Whether the tag has shared nodes inside */
+        static bool mark_shared(XMLTag* tag, unordered_set<XMLTag*>* seen) {
+            if (tag->refs > 1 && !seen->insert(tag).second) return tag->has_shared;
+            tag->has_shared = false;
+            for (XMLNode* child : tag->children) {
+                XMLTag* child_tag = dynamic_cast<XMLTag*>(child);
+                bool inside = child_tag && mark_shared(child_tag, seen);
+                if (inside || child->refs > 1) tag->has_shared = true;
+            }
+            return tag->has_shared;
+        }
         
-        /// Parse the XML document inside the provided document
-        /** When an error is encountered, according to the XML specification,
-         *  no further attempt at parsing should be made.  XMLDocument throws
-         *  an exception with an appropriate message.  Nonetheless, the partial
-         *  document up to the error has been parsed and is available for
-         *  inspection.
-         *  
-         * \param filename The filename to open
-         */
-        bool parse(string filename) {
-            ifstream fin (filename, ios::in);
-            if (!fin.is_open() || !fin.good() || !fin) throw "cannot open file";
-            in = &fin;
-            
+        /// Parses the buffer set up by parse()
+        bool parse_buffer() {
             // the tag stack as we work ourselves through the tree
             vector<XMLTag*> tag_stack;
+            // how many nodes there were before each tag on the stack
+            vector<size_t> nodes_before;
+            size_t nodes = 1;
             
             // no content can be present before the root tag
-            if (!is_whitespace(read_string_until("<"))) throw "content before root tag or declaration";
+            if (!is_whitespace(read_string_until<CHAR_OPEN>())) throw "content before root tag or declaration";
             READ_CHAR();
             if (c == '?') {
                 // this is a declaration
-                string dec_name = read_string_until(WHITESPACE "?>");
+                string dec_name = read_string_until<CHAR_BREAK | CHAR_QUESTION | CHAR_CLOSE>();
                 if (c == '>') throw "invalid declaration";
                 if (dec_name != "xml") throw "declaration does not start with <?xml";
                 
@@ -683,28 +3781,32 @@ class XMLDocument {
                 if (c != '?') throw "invalid declaration";
                 READ_CHAR();
                 if (c != '>') throw "invalid declaration";
-                if (!is_whitespace(read_string_until("<"))) throw "content between declaration and doctype or root tag";
+                if (!is_whitespace(read_string_until<CHAR_OPEN>())) throw "content between declaration and doctype or root tag";
             } else {
                 UNREAD();
             }
+            start_encoding_check();
             READ_CHAR();
             if (c == '!') {
                 // this might be a DOCTYPE
-                string name = read_string_until(WHITESPACE);
+                string name = read_string_until<CHAR_BREAK>();
                 if (name != "DOCTYPE") throw "invalid root tag starting with !";
                 have_doctype = true;
-                doctype.text = read_string_until(">");
-                if (!is_whitespace(read_string_until("<"))) throw "content between doctype and root tag";
+                doctype.source_offset = in_pos - in_begin - name.length() - 3;
+                doctype.text = read_string_until<CHAR_CLOSE>();
+                if (!is_whitespace(read_string_until<CHAR_OPEN>())) throw "content between doctype and root tag";
             } else {
                 UNREAD();
             }
             // this is the root tag
-            string element_name = read_string_until(WHITESPACE ">");
+            root.source_offset = in_pos - in_begin - 1;
+            string element_name = read_string_until<CHAR_BREAK | CHAR_CLOSE>();
             UNREAD();
             root.element = element_name;
             root.attributes = read_attributes();
             if (c != '/') {
                 tag_stack.push_back(&root);
+                nodes_before.push_back(0);
             } else {
                 // the root tag was empty!
                 READ_CHAR();
@@ -712,20 +3814,36 @@ class XMLDocument {
             }
             while (tag_stack.size()) {
                 read_whitespace();
-                if (in->eof()) throw "early eof";
+                if (eof()) throw "early eof";
                 UNREAD();
-                // read any content between tags
+                // read any content between tags, all its lines into one node
+                XMLContent* content_p = NULL;
                 while (true) {
-                    string content = read_string_until("\n<");
-                    content.erase(content.find_last_not_of(WHITESPACE)+1);
+                    size_t content_start = in_pos - in_begin;
+                    string content = read_string_until<CHAR_NEWLINE | CHAR_OPEN>();
+                    size_t length = content.length();
+                    while (length && char_is<CHAR_BREAK>(content[length-1])) length--;
+                    content.resize(length);
                     if (content.size()) {
-                        tag_stack.back()->children.push_back(new XMLContent(content));
+                        if (content_p == NULL) {
+                            // it's in the tree while being read, in case
+                            // the document ends early
+                            content_p = new XMLContent();
+                            nodes++;
+                            tag_stack.back()->children.push_back(content_p);
+                        }
+                        content_p->add_line(content, content_start);
                     }
                     if (c == '<') break;
                     read_whitespace();
                     UNREAD();
                 }
+                if (content_p) {
+                    content_p->shrink();
+                    tag_stack.back()->children.back() = share(content_p, tag_stack.size());
+                }
                 // inside a tag
+                size_t tag_start = in_pos - in_begin - 1;
                 READ_CHAR();
                 if (c == '!') {
                     for (int i=0; i < 2; i++) {
@@ -735,7 +3853,7 @@ class XMLDocument {
                     // this is a comment
                     string comment_text = "";
                     while (true) {
-                        comment_text += read_string_until("-");
+                        comment_text += read_string_until<CHAR_DASH>();
                         READ_CHAR();
                         if (c == '-') break;
                         comment_text += "-";
@@ -743,146 +3861,119 @@ class XMLDocument {
                     }
                     READ_CHAR();
                     if (c != '>') throw "errornous comment, contains --";
-                    tag_stack.back()->children.push_back(new XMLComment(comment_text));
+                    XMLComment* comment_p = new XMLComment(comment_text);
+                    comment_p->source_offset = tag_start;
+                    nodes++;
+                    tag_stack.back()->children.push_back(share(comment_p, tag_stack.size()));
                 } else if (c == '/') {
                     // this is an end tag
-                    element_name = read_string_until(">");
+                    element_name = read_string_until<CHAR_CLOSE>();
                     if (element_name != tag_stack.back()->element) {
                         throw "mismatched end tag";
                     }
+                    tag_stack.back()->subtree_nodes = nodes - nodes_before.back();
                     tag_stack.pop_back();
+                    nodes_before.pop_back();
+                    if (tag_stack.size()) {
+                        XMLNode*& closed = tag_stack.back()->children.back();
+                        closed = share(closed, tag_stack.size());
+                    }
                 } else {
                     // this is a regular element
-                    for (char invalid_char : INVALID_ELEMENT_FIRST_CHARS) {
-                        if (c == invalid_char) throw "invalid first character of element name";
-                    }
+                    if (char_is<CHAR_NOT_NAME_START>(c)) throw "invalid first character of element name";
                     UNREAD();
-                    element_name = read_string_until(WHITESPACE "/>" INVALID_ELEMENT_CHARS);
-                    for (char invalid_char : INVALID_ELEMENT_CHARS) {
-                        if (c == invalid_char) throw "invalid character in element name";
-                    }
+                    element_name = read_string_until<CHAR_NAME_END>();
+                    if (char_is<CHAR_NOT_NAME>(c)) throw "invalid character in element name";
                     UNREAD();
                     
                     XMLTag* tag_p = new XMLTag(element_name);
+                    tag_p->source_offset = tag_start;
                     tag_p->attributes = read_attributes();
                     tag_stack.back()->children.push_back(tag_p);
+                    nodes++;
                     if (c == '>') {
                         tag_stack.push_back(tag_p);
+                        nodes_before.push_back(nodes-1);
                     } else if (c == '/') {
                         // this is an empty-element tag, no need to push it
                         // down the stack
                         READ_CHAR();
                         if (c != '>') throw "characters after / in empty-element tag";
+                        tag_stack.back()->children.back() = share(tag_p, tag_stack.size());
                     }
                 }
             }
             read_whitespace(true);
             // there must not be anything else besides the root tag
-            if (!in->eof()) throw "root tag isn't alone";
+            if (!eof()) throw "root tag isn't alone";
             
             // we parsed it!
             return true;
         }
         
-        /// Deletes a node
-        /** Attempts to delete node */
-	    /** \param node The node to delete
-          * \return True if succesful  */
-        bool del_node(XMLNode* node) {
-            // can't delete the root node...
-            if (node == &root) return false;
-            return root.del_node(node);
+        /// Read a whole stream into a string, without seeking
+        static string read_stream(istream& stream) {
+            if (!stream.good()) throw "cannot open file";
+            ostringstream out;
+            out << stream.rdbuf();
+            return out.str();
         }
         
-        /// Inserts a new node
-        /** Attempts to insert new_node into or after node */
-	    /** \param node The node to work with
-	      * \param force_after Whether to put the node after the current node
-	      * \param new_node The new node to be inserted */
-	    /** \return True if succesful */
-        bool ins_node(XMLNode* node, bool force_after, XMLNode* new_node) {
-            // can't insert anything after the root node...
-            if (!(node == &root && force_after)) {
-                if (root.ins_node(node, force_after, new_node)) {
-                    return true;
-                }
+        /// Reads the next character into c
+        /** Past the end of the buffer, c is left alone and eof() is set. */
+        void read_char() {
+            if (in_pos < in_end) {
+                if (in_pos >= in_checked) check_ahead();
+                c = *in_pos++;
+            } else {
+                in_eof = true;
             }
-            // we've failed to insert it, so get rid of it.
-            delete new_node;
-            return false;
         }
         
-        /// Returns a string representation of the XML document
-        /** suxml has a particular idea about how whitespace is used in XML.
-         *  This results in monolithic output, but doesn't preserve some
-         *  user whitespace.  In most cases, this is acceptable, because
-         *  consecutive whitespace doesn't convey extra meaning.
-         *  The newline parameter specifies whether to include a stray
-         *  newline at the end of the document.
-         *
-         *  \param newline Whether to insert a stray newline at the end of
-         *      the document
-         *
-	     *  \return String representation of the XML document */
-        string to_str(bool newline) const {
-            string out = "";
-            if (have_declaration) {
-                out += declaration.to_str(0)+"\n";
-            }
-            if (have_doctype) {
-                out += doctype.to_str(0)+"\n";
+        /// Starts checking the encoding, once the declaration has been read
+        void start_encoding_check() {
+            string encoding = "";
+            for (const XMLAttribute& attribute : declaration.attributes) {
+                if (attribute.attribute == "encoding") encoding = attribute.value;
             }
-            
-            string nl = "";
-            if (newline) nl = "\n";
-            
-            return out+root.to_str(0) + nl;
+            in_encoding = encoding_from_name(encoding);
+            if (in_encoding == ENCODING_UNCHECKED) return;
+            in_checked = in_begin;
+            check_ahead();
         }
         
-        /// Renders the XML document into EditorLines
-        /** This generates a representation of the document,
-         *  respecting things like expanded nodes or searches, for the editor.
-         */
-        void render() {
-            editor_lines.clear();
-            if (have_declaration) {
-                declaration.render_into(&editor_lines, 0);
+        /// Checks the encoding of the next chunk of the buffer
+        /** Throws when the parser gets to an invalid character. */
+        void check_ahead() {
+            while (in_invalid == NULL && in_checked <= in_pos && in_checked < in_end) {
+                const char* to = in_end - in_checked > ENCODING_CHUNK ? in_checked + ENCODING_CHUNK : in_end;
+                in_checked = check_encoding(in_checked, to, in_end, in_encoding, &in_invalid);
             }
-            if (have_doctype) {
-                doctype.render_into(&editor_lines, 0);
+            if (in_invalid != NULL && in_invalid <= in_pos) {
+                in_pos = in_invalid;
+                throw encoding_error(in_encoding);
             }
-            root.render_into(&editor_lines, 0);
         }
         
-        /// Finds and marks all elements with the specified name
-        void find(string str) {
-            root.find(str);
+        /// Steps back by a character, so it gets read again
+        void unread() {
+            if (!in_eof && in_pos > in_begin) in_pos--;
         }
         
-        /// Expands all nodes
-        void expand_all() {
-            root.expand_all();
+        /// Whether a read went past the end of the buffer
+        bool eof() const {
+            return in_eof;
         }
         
-        /// The last parsed line, for convenience in reporting errors
-        int last_parsed_line = 0;
-        
-        /// The lines of the editor
-        vector<EditorLine> editor_lines;
-    private:
-        ifstream* in;
-        char c;
-        
         void read_whitespace(bool eof_fine) {
-            if (in->eof()) {
+            if (eof()) {
                 if (eof_fine) return;
                 throw "early eof";
             }
             while (true) {
                 READ_CHAR();
-                if (c == '\n') last_parsed_line++;
-                if (!isspace(c)) return;
-                if (in->eof()) {
+                if (!char_is<CHAR_SPACE>(c)) return;
+                if (eof()) {
                     if (eof_fine) return;
                     throw "early eof";
                 }
@@ -893,17 +3984,16 @@ class XMLDocument {
             read_whitespace(false);
         }
         
-        string read_string_until(string chars) {
-            if (in->eof()) throw "early eof";
-            string result = "";
+        /// Reads up to a character in some classes, which is left in c
+        /** \param Stops The classes, see CharClass */
+        template <unsigned Stops>
+        string read_string_until() {
+            if (eof()) throw "early eof";
+            const char* start = in_pos;
             while (true) {
                 READ_CHAR();
-                if (in->eof()) throw "early eof";
-                if (c == '\n') last_parsed_line++;
-                for (char stop_char : chars) {
-                    if (c == stop_char) return result;
-                }
-                result += c;
+                if (eof()) throw "early eof";
+                if (char_is<Stops>(c)) return string(start, in_pos-1 - start);
             }
         }
         
@@ -915,11 +4005,11 @@ class XMLDocument {
                 if (c == '/') break;
                 if (is_declaration and c == '?') break;
                 UNREAD();
-                string name = read_string_until(WHITESPACE "=");
+                string name = read_string_until<CHAR_BREAK | CHAR_EQUALS>();
                 if (c != '=') throw "attribute lacks value";
                 read_whitespace();
                 if (c != '"' and c != '\'') throw "attribute value not in quotes";
-                string value = read_string_until(string(1, c));
+                string value = c == '"' ? read_string_until<CHAR_QUOTE>() : read_string_until<CHAR_APOSTROPHE>();
                 attributes.push_back(XMLAttribute(name, value));
             }
             return attributes;
@@ -928,3 +4018,5 @@ class XMLDocument {
             return read_attributes(false);
         }
 };
+
+#endif
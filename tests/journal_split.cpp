@@ -0,0 +1,53 @@
+/** \file journal_split.cpp
+ *  Checks that undoing a node inserted in the middle of text never leaves
+ *  the text cut short, even when the journal can't keep the split, see
+ *  `make test`.
+ *  \author David Labský <labskdav@fit.cvut.cz> */
+
+#include <cstdio>
+#include <string>
+using namespace std;
+
+#include "../src/xml.cpp"
+
+/// Inserts a tag into a long text near its end and undoes it
+/** The document has to end up as it was, or as it was after the insert
+ *  if the journal couldn't keep it, but never in between.
+ *  \param lines How many lines the text has
+ *  \param limit The journal limit, in bytes
+ *  \return Whether it did */
+bool undo_split(int lines, long long limit) {
+    string source = "<a>\n";
+    for (int i=0; i<lines; i++) {
+        source += "\tline " + to_string(i) + " of the text\n";
+    }
+    source += "</a>\n";
+    XMLDocument document;
+    document.journal.limit = limit;
+    if (!document.parse(source.data(), source.length())) return false;
+    string before = document.to_str(true);
+    document.expand_all();
+    // the start tag is the first line, and the text comes right after
+    int line = lines - 10;
+    document.render_window(line, 1);
+    document.ins_line(line, new XMLTag("b"));
+    string inserted = document.to_str(true);
+    document.undo();
+    string after = document.to_str(true);
+    if (after == before || after == inserted) return true;
+    printf("%d lines with a journal of %lld bytes: %d bytes before, %d after undo\n",
+           lines, limit, (int)before.length(), (int)after.length());
+    return false;
+}
+
+int main() {
+    int failed = 0;
+    // the split fits the journal
+    if (!undo_split(1000, 1048576)) failed++;
+    // the text from before the split is bigger than the journal, but the
+    // lines split off aren't
+    if (!undo_split(60000, 1048576)) failed++;
+    if (failed) return 1;
+    printf("journal_split: tags inserted into text are undone whole\n");
+    return 0;
+}
@@ -0,0 +1,73 @@
+/** \file tokenizer_feed.cpp
+ *  Checks that a document fed to XMLTokenizer a piece at a time gives the
+ *  same result as the whole document, see `make test`.
+ *  \author David Labský <labskdav@fit.cvut.cz> */
+
+#include <cstdio>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "../src/tokenizer.cpp"
+
+/// Validates a document fed in pieces, like validate_stream() does
+/** \param document The document
+ *  \param piece How long the pieces are, in bytes
+ *  \param offset Where to put the byte offset of the error
+ *  \return NULL if the document is fine, an error message otherwise */
+const char* validate_fed(const string& document, size_t piece, size_t* offset) {
+    XMLTokenizer tokenizer;
+    XMLToken token;
+    size_t fed = 0;
+    try {
+        while (true) {
+            while (tokenizer.next(&token));
+            if (!tokenizer.needs_input()) break;
+            if (fed == document.length()) {
+                tokenizer.finish();
+                continue;
+            }
+            size_t length = document.length() - fed < piece ? document.length() - fed : piece;
+            tokenizer.feed(document.data() + fed, length);
+            fed += length;
+        }
+    } catch (char const* message) {
+        *offset = tokenizer.offset();
+        return message;
+    }
+    return NULL;
+}
+
+int main() {
+    vector<string> documents = {
+        "<a>\n\t<b c=\"d\">text</b>\n\t<!-- a - comment -->\n</a>\n",
+        "<?xml version=\"1.0\"?>\n<a>\n\t<b/>\n</a>\n",
+        // invalid UTF-8 in the declaration, before the encoding is known
+        "<?xml version=\"1.0\" x=\"\xff\"?>\n<a/>\n",
+        "<?xml version=\"1.0\" encoding=\"UTF-8\" x=\"\xc3\"?>\n<a/>\n",
+        // invalid UTF-8 in the document
+        "<a>\n\tb\xff\n</a>\n",
+        "<?xml version=\"1.0\" encoding=\"US-ASCII\"?>\n<a>\xc3\xa9</a>\n",
+        // errors in the middle of tokens
+        "<a>\n\t<!-- x -- y -->\n</a>\n",
+        "<a b=\"c>\n",
+        "<a>\n\t</b>\n</a>\n",
+    };
+    int failed = 0;
+    for (size_t i=0; i<documents.size(); i++) {
+        const string& document = documents[i];
+        size_t whole_offset = 0;
+        const char* whole = validate(document.data(), document.length(), &whole_offset);
+        for (size_t piece : {1, 2, 3, 7, 64}) {
+            size_t fed_offset = 0;
+            const char* fed = validate_fed(document, piece, &fed_offset);
+            if (fed == whole && (whole == NULL || fed_offset == whole_offset)) continue;
+            printf("document %d in %d byte pieces: %s at %d, whole: %s at %d\n", (int)i, (int)piece,
+                   fed ? fed : "fine", (int)fed_offset, whole ? whole : "fine", (int)whole_offset);
+            failed++;
+        }
+    }
+    if (failed) return 1;
+    printf("tokenizer_feed: all documents tokenize the same fed in pieces\n");
+    return 0;
+}